@@ -0,0 +1,291 @@
+/* lock-free bufpool.h against the pool it replaced, a mutex with a hash from buffer to element.
+   usage: bufpool [max threads] [cycles per thread]
+   each thread keeps a few buffers and, for each cycle, gives back its oldest one and takes
+   another, then attaches and detaches it once more, as a second holder would. thread counts
+   double from 1 to 'max'. a buffer handed out twice stops the run */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "common.h"
+#include "list.h"
+#include "hash.h"
+#include "bufpool.h"
+
+/******************************************************************************
+ *              DEFINITIONS
+ ******************************************************************************/
+#define HOLD 4      /* buffers each thread keeps at a time */
+
+/******************************************************************************
+ *              DATA STRUCTURES
+ ******************************************************************************/
+/* the former pool: every call under the mutex, and attach/detach look the element up */
+struct hashpool_elem_t {
+    void *buf;
+    int ref_count;
+    struct list_t list_entry;
+};
+
+struct hashpool_t {
+    pthread_mutex_t mutex;
+    struct list_head_t free_list;
+    hash_handle buf_table;
+    struct hashpool_elem_t *elems;
+    char *bufs;
+};
+
+struct pool_ops_t {
+    const char *name;
+    void *(*create)(int num);
+    void (*delete)(void *pool);
+    int (*get)(void *pool, int **p_buf);
+    int (*attach)(void *pool, int *buf);
+    int (*detach)(void *pool, int *buf);
+};
+
+struct worker_t {
+    pthread_t thread;
+    const struct pool_ops_t *ops;
+    void *pool;
+    long cycles;
+    int ret;
+};
+
+/******************************************************************************
+ *              PRIVATE FUNCTIONS
+ ******************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *hashpool_create(int num)
+{
+    struct hashpool_t *h;
+    int i;
+
+    TALLOC(h, return NULL);
+    ASSERT(h->elems = calloc(num, sizeof(struct hashpool_elem_t)), return NULL);
+    ASSERT(h->bufs = calloc(num, sizeof(int)), return NULL);
+    ASSERT(h->buf_table = hash_create(num), return NULL);
+
+    pthread_mutex_init(&h->mutex, NULL);
+
+    for(i = 0; i < num; i++) {
+        h->elems[i].buf = &h->bufs[i * sizeof(int)];
+        ASSERT(hash_add(h->buf_table, (hash_key_t)h->elems[i].buf, &h->elems[i]) == SUCCESS, return NULL);
+        ASSERT(list_push(&h->free_list, &h->elems[i].list_entry) == SUCCESS, return NULL);
+    }
+
+    return h;
+}
+
+static void hashpool_delete(void *pool)
+{
+    struct hashpool_t *h = pool;
+
+    hash_destroy(h->buf_table);
+    pthread_mutex_destroy(&h->mutex);
+    FREE(h->elems);
+    FREE(h->bufs);
+    FREE(h);
+}
+
+static int hashpool_get(void *pool, int **p_buf)
+{
+    struct hashpool_t *h = pool;
+    struct hashpool_elem_t *p;
+    struct list_t *e;
+    int ret = FAILURE;
+
+    pthread_mutex_lock(&h->mutex);
+    if((e = list_pop(&h->free_list))) {
+        list_upcast(p, e);
+        p->ref_count += 1;
+        *p_buf = p->buf;
+        ret = SUCCESS;
+    }
+    pthread_mutex_unlock(&h->mutex);
+
+    return ret;
+}
+
+static int hashpool_ref(struct hashpool_t *h, int *buf, int val)
+{
+    struct hashpool_elem_t *p;
+    int ret = SUCCESS;
+
+    pthread_mutex_lock(&h->mutex);
+    if((p = hash_lookup(h->buf_table, (hash_key_t)buf))) {
+        p->ref_count += val;
+        if(p->ref_count == 0) {
+            list_push(&h->free_list, &p->list_entry);
+        }
+    } else {
+        ret = FAILURE;
+    }
+    pthread_mutex_unlock(&h->mutex);
+
+    return ret;
+}
+
+static int hashpool_attach(void *pool, int *buf)
+{
+    return hashpool_ref(pool, buf, 1);
+}
+
+static int hashpool_detach(void *pool, int *buf)
+{
+    return hashpool_ref(pool, buf, -1);
+}
+
+static void *treiber_create(int num)
+{
+    return bufpool_create(num, num, sizeof(int), NULL, NULL);
+}
+
+static void treiber_delete(void *pool)
+{
+    bufpool_delete(pool);
+}
+
+static int treiber_get(void *pool, int **p_buf)
+{
+    bufpool_handle h = pool;
+
+    return bufpool_try_get(h, p_buf);
+}
+
+static int treiber_attach(void *pool, int *buf)
+{
+    return bufpool_attach(pool, buf);
+}
+
+static int treiber_detach(void *pool, int *buf)
+{
+    return bufpool_detach(pool, buf);
+}
+
+static const struct pool_ops_t pools[] = {
+    { "treiber", treiber_create, treiber_delete, treiber_get, treiber_attach, treiber_detach },
+    { "hash+mutex", hashpool_create, hashpool_delete, hashpool_get, hashpool_attach, hashpool_detach },
+};
+
+/* each buffer holds 1 while it is out, so a double handout shows */
+static void *worker(void *v)
+{
+    struct worker_t *w = v;
+    int *held[HOLD] = {};
+    int *buf;
+    long i;
+    int k;
+
+    for(i = 0; i < w->cycles; i++) {
+        k = i % HOLD;
+
+        if(held[k]) {
+            __atomic_store_n(held[k], 0, __ATOMIC_RELAXED);
+            ASSERT(w->ops->detach(w->pool, held[k]) == SUCCESS, goto error);
+        }
+
+        ASSERT(w->ops->get(w->pool, &buf) == SUCCESS, goto error);
+        ASSERT(__atomic_exchange_n(buf, 1, __ATOMIC_RELAXED) == 0, ({
+                    ERR("%s handed out %p twice\n", w->ops->name, buf);
+                    goto error;}));
+
+        ASSERT(w->ops->attach(w->pool, buf) == SUCCESS, goto error);
+        ASSERT(w->ops->detach(w->pool, buf) == SUCCESS, goto error);
+
+        held[k] = buf;
+    }
+
+    for(k = 0; k < HOLD; k++) {
+        if(held[k]) {
+            __atomic_store_n(held[k], 0, __ATOMIC_RELAXED);
+            ASSERT(w->ops->detach(w->pool, held[k]) == SUCCESS, goto error);
+        }
+    }
+
+    w->ret = SUCCESS;
+    return NULL;
+error:
+    w->ret = FAILURE;
+    return NULL;
+}
+
+/* ns per cycle of all threads together, or a negative value on failure */
+static double run(const struct pool_ops_t *ops, int threads, long cycles)
+{
+    struct worker_t *w;
+    void *pool;
+    double t0, ns;
+    int ret = SUCCESS;
+    int i;
+
+    ASSERT(w = calloc(threads, sizeof(struct worker_t)), return -1);
+    ASSERT(pool = ops->create(threads * HOLD), return -1);
+
+    t0 = now_ns();
+
+    for(i = 0; i < threads; i++) {
+        w[i].ops = ops;
+        w[i].pool = pool;
+        w[i].cycles = cycles;
+        ASSERT(pthread_create(&w[i].thread, NULL, worker, &w[i]) == 0, return -1);
+    }
+
+    for(i = 0; i < threads; i++) {
+        pthread_join(w[i].thread, NULL);
+        if(w[i].ret != SUCCESS) {
+            ret = FAILURE;
+        }
+    }
+
+    ns = now_ns() - t0;
+
+    ops->delete(pool);
+    FREE(w);
+
+    return ret == SUCCESS ? ns / ((double)cycles * threads) : -1;
+}
+
+/******************************************************************************
+ *              MAIN
+ ******************************************************************************/
+int main(int argc, char **argv)
+{
+    int max_threads = argc > 1 ? atoi(argv[1]) : 8;
+    long cycles = argc > 2 ? atol(argv[2]) : 1000000;
+    double ns;
+    int threads;
+    int p;
+
+    ASSERT(max_threads > 0 && cycles > 0, return 1);
+
+    printf("%ld cycles a thread, %d buffers held by each (get, attach, 2 detach a cycle)\n",
+            cycles, HOLD);
+    printf("%-8s", "threads");
+    for(p = 0; p < (int)(sizeof(pools) / sizeof(pools[0])); p++) {
+        printf(" %12s %8s", pools[p].name, "Mcyc/s");
+    }
+    printf("\n");
+
+    for(threads = 1; threads <= max_threads; threads *= 2) {
+        printf("%-8d", threads);
+
+        for(p = 0; p < (int)(sizeof(pools) / sizeof(pools[0])); p++) {
+            ASSERT((ns = run(&pools[p], threads, cycles)) > 0, return 1);
+            printf(" %9.1f ns %8.2f", ns, 1e3 / ns);
+        }
+
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,248 @@
+/* delivery of one frame to many sessions, on the caller and by send workers.
+   usage: fanout [sessions] [max workers] [seconds]
+   a server on loopback gets 'sessions' UDP clients through SETUP and PLAY, then rtp_send_h264()
+   is called back to back with an access unit of SPS, PPS and a 100 KB IDR slice. worker counts
+   are 0 (__rtp_deliver() on the caller), then 1 and doubling up to 'max', which goes through
+   __rtp_fan_out(). the clients do not read, so the kernel drops at their sockets. packets/s
+   are those rtsp_get_stat() counts over the run */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "rtsp_server.h"
+
+/******************************************************************************
+ *              DEFINITIONS
+ ******************************************************************************/
+#define IDR_LEN (100 * 1024)
+#define CLIENT_PORT 20000   /* RTP of the first client. RTCP above it */
+
+/******************************************************************************
+ *              DATA STRUCTURES
+ ******************************************************************************/
+struct client_t {
+    int rtsp_fd;
+    int rtp_fd;
+    int rtcp_fd;
+};
+
+/******************************************************************************
+ *              PRIVATE DATA
+ ******************************************************************************/
+static const unsigned char head[] = {
+    0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x1f, 0xab,   /* SPS */
+    0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x3c, 0x80,         /* PPS */
+    0x00, 0x00, 0x00, 0x01, 0x65,                           /* IDR slice */
+};
+
+static signed char frame[sizeof(head) + IDR_LEN];
+
+/******************************************************************************
+ *              PRIVATE FUNCTIONS
+ ******************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int udp_bind(unsigned short port)
+{
+    struct sockaddr_in addr = { sin_family: AF_INET, sin_port: htons(port) };
+    int fd;
+
+    ASSERT((fd = socket(AF_INET, SOCK_DGRAM, 0)) >= 0, return -1);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0, ({
+                ERR("bind %u failed\n", port);
+                close(fd);
+                return -1;}));
+
+    return fd;
+}
+
+/* the server starts its listeners on its own threads */
+static int rtsp_connect(void)
+{
+    struct sockaddr_in addr = { sin_family: AF_INET, sin_port: htons(SERVER_RTSP_PORT) };
+    int fd;
+    int i;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for(i = 0; i < 50; i++) {
+        ASSERT((fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0, return -1);
+        if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(20000);
+    }
+
+    ERR("no server on port %d\n", SERVER_RTSP_PORT);
+    return -1;
+}
+
+/* one request, and its reply headers to 'reply' */
+static int request(int fd, const char *req, char *reply, size_t size)
+{
+    struct pollfd p = { fd: fd, events: POLLIN };
+    size_t got = 0;
+    ssize_t n;
+
+    ASSERT(write(fd, req, strlen(req)) == (ssize_t)strlen(req), return FAILURE);
+
+    reply[0] = '\0';
+    while(!strstr(reply, "\r\n\r\n")) {
+        ASSERT(got < size - 1 && poll(&p, 1, 2000) > 0, return FAILURE);
+        ASSERT((n = read(fd, reply + got, size - 1 - got)) > 0, return FAILURE);
+        got += n;
+        reply[got] = '\0';
+    }
+
+    ASSERT(strncmp(reply, "RTSP/1.0 200", 12) == 0, ({
+                ERR("%s", reply);
+                return FAILURE;}));
+
+    return SUCCESS;
+}
+
+static int client_play(struct client_t *c, int index)
+{
+    unsigned short port = CLIENT_PORT + 2 * index;
+    char req[256];
+    char reply[2048];
+    char *session;
+
+    ASSERT((c->rtp_fd = udp_bind(port)) >= 0, return FAILURE);
+    ASSERT((c->rtcp_fd = udp_bind(port + 1)) >= 0, return FAILURE);
+    ASSERT((c->rtsp_fd = rtsp_connect()) >= 0, return FAILURE);
+
+    snprintf(req, sizeof(req), "SETUP rtsp://127.0.0.1/streamid=0 RTSP/1.0\r\nCSeq: 1\r\n"
+            "Transport: RTP/AVP;unicast;client_port=%u-%u\r\n\r\n", port, port + 1);
+    ASSERT(request(c->rtsp_fd, req, reply, sizeof(reply)) == SUCCESS, return FAILURE);
+    ASSERT(session = strstr(reply, "Session: "), return FAILURE);
+
+    snprintf(req, sizeof(req), "PLAY rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: 2\r\nSession: %llx\r\n\r\n",
+            strtoull(session + strlen("Session: "), NULL, 16));
+    ASSERT(request(c->rtsp_fd, req, reply, sizeof(reply)) == SUCCESS, return FAILURE);
+
+    return SUCCESS;
+}
+
+static void client_close(struct client_t *c)
+{
+    CLOSE(c->rtsp_fd);
+    CLOSE(c->rtp_fd);
+    CLOSE(c->rtcp_fd);
+}
+
+static int send_frame(rtsp_handle h)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return rtp_send_h264(h, frame, sizeof(frame), &tv);
+}
+
+/* packets/s to 'sessions' clients with 'workers' send workers, or a negative value on failure */
+static double run(int sessions, int workers, double seconds)
+{
+    struct rtsp_attr_t attr;
+    struct rtsp_stat_t s0, s1;
+    struct client_t *clients;
+    rtsp_handle h = NULL;
+    double t0, ns;
+    double ret = -1;
+    int i;
+
+    rtsp_attr_init(&attr);
+    attr.max_con = sessions;
+    attr.send_workers = workers;
+    /* a frame is about 75 packets. none dropped for congestion but by the kernel */
+    attr.send_queue_depth = 4096;
+
+    ASSERT(clients = calloc(sessions, sizeof(struct client_t)), return -1);
+    for(i = 0; i < sessions; i++) {
+        clients[i].rtsp_fd = clients[i].rtp_fd = clients[i].rtcp_fd = -1;
+    }
+
+    ASSERT(h = rtsp_create_attr(&attr), goto error);
+
+    /* DESCRIBE needs the parameter sets, SETUP does not. sent once so that they are known */
+    ASSERT(send_frame(h) == SUCCESS, goto error);
+
+    for(i = 0; i < sessions; i++) {
+        ASSERT(client_play(&clients[i], i) == SUCCESS, goto error);
+    }
+
+    /* PLAY replies before the snapshot of the sessions is published */
+    usleep(100000);
+
+    ASSERT(rtsp_get_stat(h, &s0) == SUCCESS, goto error);
+    t0 = now_ns();
+    do {
+        ASSERT(send_frame(h) == SUCCESS, goto error);
+    } while((ns = now_ns() - t0) < seconds * 1e9);
+    ASSERT(rtsp_get_stat(h, &s1) == SUCCESS, goto error);
+
+    ASSERT(s1.dropped_frames == s0.dropped_frames, ({
+                ERR("%llu frames dropped\n", s1.dropped_frames - s0.dropped_frames);
+                goto error;}));
+
+    printf("%-8d %-8d %12.0f %10.1f %10.1f\n", sessions, workers, (s1.packets - s0.packets) * 1e9 / ns,
+            (s1.frames - s0.frames) * 1e9 / ns, ns / 1e3 / (s1.frames - s0.frames));
+    ret = (s1.packets - s0.packets) * 1e9 / ns;
+
+error:
+    for(i = 0; i < sessions; i++) {
+        client_close(&clients[i]);
+    }
+    if(h) {
+        rtsp_finish(h);
+    }
+    FREE(clients);
+
+    return ret;
+}
+
+/******************************************************************************
+ *              MAIN
+ ******************************************************************************/
+int main(int argc, char **argv)
+{
+    int sessions = argc > 1 ? atoi(argv[1]) : 32;
+    int max_workers = argc > 2 ? atoi(argv[2]) : 4;
+    double seconds = argc > 3 ? atof(argv[3]) : 2;
+    unsigned int seed = 1;
+    size_t i;
+    int workers;
+
+    ASSERT(sessions > 0 && max_workers >= 0 && seconds > 0, return 1);
+
+    /* no start code in the slice */
+    memcpy(frame, head, sizeof(head));
+    for(i = sizeof(head); i < sizeof(frame); i++) {
+        frame[i] = rand_r(&seed) % 255 + 1;
+    }
+
+    printf("%ld CPUs, %zu byte IDR access units\n", sysconf(_SC_NPROCESSORS_ONLN), sizeof(frame));
+    printf("%-8s %-8s %12s %10s %10s\n", "sessions", "workers", "packets/s", "frames/s", "us/frame");
+
+    for(workers = 0; workers <= max_workers; workers = workers ? workers * 2 : 1) {
+        ASSERT(run(sessions, workers, seconds) > 0, return 1);
+    }
+
+    return 0;
+}
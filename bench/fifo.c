@@ -0,0 +1,300 @@
+/* fifo of thread.h against the pipe fifo it replaced.
+   usage: fifo [messages] [producers]
+   ping-pong bounces one message between two threads over a fifo each way. streaming sends
+   'messages' from one thread to another. fan-in sends them from 'producers' threads into one
+   consumer, also through the ring with a mutex around each put, as rtp_submit_h264_async()
+   did while the ring took one producer. each producer numbers its messages, so a lost,
+   doubled or reordered one stops the run */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "thread.h"
+
+/******************************************************************************
+ *              DATA STRUCTURES
+ ******************************************************************************/
+/* the former fifo: pointers written to a pipe, with a count under a mutex */
+struct pipe_fifo_t {
+    pthread_mutex_t mutex;
+    int num;
+    int fds[2];
+};
+
+struct fifo_ops_t {
+    const char *name;
+    void *(*create)(void);
+    void (*delete)(void *fifo);
+    int (*put)(void *fifo, void *ptr);
+    int (*get)(void *fifo, void **p_ptr);
+};
+
+struct msg_t {
+    int producer;
+    long seq;
+};
+
+struct peer_t {
+    pthread_t thread;
+    const struct fifo_ops_t *ops;
+    void *in;
+    void *out;
+    long count;
+    int index;
+    pthread_mutex_t *mutex;     /* around each put, or NULL */
+    int ret;
+};
+
+/******************************************************************************
+ *              PRIVATE FUNCTIONS
+ ******************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *pipe_create(void)
+{
+    struct pipe_fifo_t *f;
+
+    TALLOC(f, return NULL);
+    ASSERT(pipe(f->fds) == 0, ({ FREE(f); return NULL;}));
+    pthread_mutex_init(&f->mutex, NULL);
+
+    return f;
+}
+
+static void pipe_delete(void *fifo)
+{
+    struct pipe_fifo_t *f = fifo;
+
+    close(f->fds[0]);
+    close(f->fds[1]);
+    pthread_mutex_destroy(&f->mutex);
+    FREE(f);
+}
+
+static int pipe_put(void *fifo, void *ptr)
+{
+    struct pipe_fifo_t *f = fifo;
+
+    pthread_mutex_lock(&f->mutex);
+    f->num++;
+    pthread_mutex_unlock(&f->mutex);
+
+    return write(f->fds[1], &ptr, sizeof(ptr)) == sizeof(ptr) ? SUCCESS : FAILURE;
+}
+
+static int pipe_get(void *fifo, void **p_ptr)
+{
+    struct pipe_fifo_t *f = fifo;
+
+    if(read(f->fds[0], p_ptr, sizeof(*p_ptr)) != sizeof(*p_ptr)) {
+        return FAILURE;
+    }
+
+    pthread_mutex_lock(&f->mutex);
+    f->num--;
+    pthread_mutex_unlock(&f->mutex);
+
+    return SUCCESS;
+}
+
+static void *ring_create(void)
+{
+    return fifo_create();
+}
+
+static void ring_delete(void *fifo)
+{
+    fifo_delete(fifo);
+}
+
+static int ring_put(void *fifo, void *ptr)
+{
+    return fifo_put(fifo, ptr);
+}
+
+static int ring_get(void *fifo, void **p_ptr)
+{
+    return fifo_get(fifo, p_ptr);
+}
+
+static const struct fifo_ops_t fifos[] = {
+    { "ring", ring_create, ring_delete, ring_put, ring_get },
+    { "pipe", pipe_create, pipe_delete, pipe_put, pipe_get },
+};
+
+/* sends back what it gets */
+static void *echo(void *v)
+{
+    struct peer_t *p = v;
+    void *ptr;
+    long i;
+
+    for(i = 0; i < p->count; i++) {
+        ASSERT(p->ops->get(p->in, &ptr) == SUCCESS, goto error);
+        ASSERT(p->ops->put(p->out, ptr) == SUCCESS, goto error);
+    }
+
+    p->ret = SUCCESS;
+    return NULL;
+error:
+    p->ret = FAILURE;
+    return NULL;
+}
+
+static void *produce(void *v)
+{
+    struct peer_t *p = v;
+    struct msg_t *msgs;
+    long i;
+    int ret;
+
+    ASSERT(msgs = calloc(p->count, sizeof(struct msg_t)), goto error);
+
+    for(i = 0; i < p->count; i++) {
+        msgs[i].producer = p->index;
+        msgs[i].seq = i;
+
+        if(p->mutex) {
+            pthread_mutex_lock(p->mutex);
+        }
+
+        ret = p->ops->put(p->out, &msgs[i]);
+
+        if(p->mutex) {
+            pthread_mutex_unlock(p->mutex);
+        }
+
+        ASSERT(ret == SUCCESS, goto error);
+    }
+
+    /* the consumer is done with them when it joins */
+    p->in = msgs;
+    p->ret = SUCCESS;
+    return NULL;
+error:
+    p->ret = FAILURE;
+    return NULL;
+}
+
+/* ns per round trip */
+static double ping_pong(const struct fifo_ops_t *ops, long count)
+{
+    struct peer_t peer = { ops: ops, count: count };
+    void *ptr = &peer;
+    double t0, ns;
+    long i;
+
+    ASSERT(peer.in = ops->create(), return -1);
+    ASSERT(peer.out = ops->create(), return -1);
+    ASSERT(pthread_create(&peer.thread, NULL, echo, &peer) == 0, return -1);
+
+    t0 = now_ns();
+    for(i = 0; i < count; i++) {
+        ASSERT(ops->put(peer.in, ptr) == SUCCESS, return -1);
+        ASSERT(ops->get(peer.out, &ptr) == SUCCESS, return -1);
+    }
+    ns = now_ns() - t0;
+
+    pthread_join(peer.thread, NULL);
+    ops->delete(peer.in);
+    ops->delete(peer.out);
+
+    return peer.ret == SUCCESS ? ns / count : -1;
+}
+
+/* ns per message from 'producers' threads to this one */
+static double fan_in(const struct fifo_ops_t *ops, long count, int producers, int locked)
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct peer_t *p;
+    struct msg_t *msg;
+    long *next;
+    void *fifo;
+    double t0, ns;
+    int ret = SUCCESS;
+    long i;
+    int k;
+
+    ASSERT(p = calloc(producers, sizeof(struct peer_t)), return -1);
+    ASSERT(next = calloc(producers, sizeof(long)), return -1);
+    ASSERT(fifo = ops->create(), return -1);
+
+    t0 = now_ns();
+
+    for(k = 0; k < producers; k++) {
+        p[k].ops = ops;
+        p[k].out = fifo;
+        p[k].count = count / producers;
+        p[k].index = k;
+        p[k].mutex = locked ? &mutex : NULL;
+        ASSERT(pthread_create(&p[k].thread, NULL, produce, &p[k]) == 0, return -1);
+    }
+
+    for(i = 0; i < count / producers * producers; i++) {
+        ASSERT(ops->get(fifo, (void **)&msg) == SUCCESS, return -1);
+        ASSERT(msg->seq == next[msg->producer], ({
+                    ERR("%s: producer %d sent %ld, %ld expected\n", ops->name, msg->producer,
+                        msg->seq, next[msg->producer]);
+                    ret = FAILURE;
+                    break;}));
+        next[msg->producer] += 1;
+    }
+
+    ns = now_ns() - t0;
+
+    for(k = 0; k < producers; k++) {
+        pthread_join(p[k].thread, NULL);
+        if(p[k].ret != SUCCESS) {
+            ret = FAILURE;
+        }
+        FREE(p[k].in);
+    }
+
+    ops->delete(fifo);
+    FREE(next);
+    FREE(p);
+
+    return ret == SUCCESS ? ns / i : -1;
+}
+
+/******************************************************************************
+ *              MAIN
+ ******************************************************************************/
+int main(int argc, char **argv)
+{
+    long count = argc > 1 ? atol(argv[1]) : 1000000;
+    int producers = argc > 2 ? atoi(argv[2]) : 4;
+    double ns;
+    int f;
+
+    ASSERT(count > 0 && producers > 0, return 1);
+
+    printf("%ld messages, %d producers for fan-in\n", count, producers);
+    printf("%-12s %14s %14s %14s\n", "", "ping-pong", "streaming", "fan-in");
+
+    for(f = 0; f < (int)(sizeof(fifos) / sizeof(fifos[0])); f++) {
+        printf("%-12s", fifos[f].name);
+        ASSERT((ns = ping_pong(&fifos[f], count / 10)) > 0, return 1);
+        printf(" %8.0f ns/rt", ns);
+        ASSERT((ns = fan_in(&fifos[f], count, 1, FALSE)) > 0, return 1);
+        printf(" %7.0f ns/msg", ns);
+        ASSERT((ns = fan_in(&fifos[f], count, producers, FALSE)) > 0, return 1);
+        printf(" %7.0f ns/msg\n", ns);
+    }
+
+    printf("%-12s %14s %14s", "ring+mutex", "", "");
+    ASSERT((ns = fan_in(&fifos[0], count, producers, TRUE)) > 0, return 1);
+    printf(" %7.0f ns/msg\n", ns);
+
+    return 0;
+}
@@ -0,0 +1,336 @@
+/* packetization of rtp.c, payloads pointing into the caller's buffer, against the copying
+   one it replaced.
+   usage: fua [4k60 | 1080p30] [seconds]
+   a stream of one IDR access unit (SPS, PPS, IDR slice) a second and P slices between is
+   packetized by __packetize_frame() and by the former scheme that copied each payload into an
+   arena. each is timed alone, then with sendmmsg() to a UDP socket on loopback that nobody
+   reads. figures are per second of the stream, so that the memcpy() bytes/s of each path
+   compare against the bitrate */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* the packetizer is private to it */
+#include "rtp.c"
+
+/******************************************************************************
+ *              DATA STRUCTURES
+ ******************************************************************************/
+struct preset_t {
+    const char *name;
+    size_t idr_len;     /* bytes of the IDR slice */
+    size_t p_len;       /* bytes of each P slice */
+    int fps;
+};
+
+/* the former batch: payloads copied to one arena, {header, payload} per packet */
+struct copy_batch_t {
+    signed char *arena;
+    rtp_hdr_t *headers;
+    struct iovec *iovs;
+    struct mmsghdr *msgs;
+    int num;
+    int cap;
+};
+
+struct result_t {
+    double ns;          /* packetization of the whole run */
+    double send_ns;     /* ... with sendmmsg() */
+    unsigned long long copied;  /* bytes memcpy()'d by the packetizer, whole run */
+};
+
+/******************************************************************************
+ *              PRIVATE DATA
+ ******************************************************************************/
+/* about 55 and 9 Mbit/s */
+static const struct preset_t presets[] = {
+    { "4k60",    1024 * 1024, 100 * 1024, 60 },
+    { "1080p30",  300 * 1024,  30 * 1024, 30 },
+};
+
+static const signed char sps[] = { 0x67, 0x64, 0x00, 0x33, 0xac, 0x2c, 0xa4, 0x01, 0xe0 };
+static const signed char pps[] = { 0x68, 0xee, 0x3c, 0xb0 };
+
+/* rand() is fenced off by thread.h */
+static unsigned int seed = 1;
+
+/******************************************************************************
+ *              PRIVATE FUNCTIONS
+ ******************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* an annex B access unit. slice bytes are never 0, so no start code is emulated */
+static signed char *make_au(int idr, size_t slice_len, size_t *p_len)
+{
+    signed char *p;
+    size_t len = slice_len + 4;
+    size_t i = 0;
+
+    if(idr) {
+        len += 4 + sizeof(sps) + 4 + sizeof(pps);
+    }
+
+    ASSERT(p = malloc(len), return NULL);
+
+    if(idr) {
+        memcpy(&p[i], "\x00\x00\x00\x01", 4);
+        memcpy(&p[i + 4], sps, sizeof(sps));
+        i += 4 + sizeof(sps);
+
+        memcpy(&p[i], "\x00\x00\x00\x01", 4);
+        memcpy(&p[i + 4], pps, sizeof(pps));
+        i += 4 + sizeof(pps);
+    }
+
+    memcpy(&p[i], "\x00\x00\x00\x01", 4);
+    p[i + 4] = idr ? 0x65 : 0x41;
+
+    for(i += 5; i < len; i++) {
+        p[i] = rand_r(&seed) % 255 + 1;
+    }
+
+    *p_len = len;
+    return p;
+}
+
+/* bytes __rtp_batch_add_payload() copied into the descriptors */
+static unsigned long long zerocopy_copied(struct __rtp_batch_t *batch)
+{
+    unsigned long long n = 0;
+    int i;
+
+    for(i = 0; i < batch->num; i++) {
+        n += batch->payloads[i].fu_len;
+    }
+
+    return n;
+}
+
+static int copy_grow(struct copy_batch_t *batch, int cap)
+{
+    ASSERT(batch->arena = realloc(batch->arena, cap * __RTP_MAXPAYLOADSIZE), return FAILURE);
+    ASSERT(batch->headers = realloc(batch->headers, cap * sizeof(rtp_hdr_t)), return FAILURE);
+    ASSERT(batch->iovs = realloc(batch->iovs, cap * 2 * sizeof(struct iovec)), return FAILURE);
+    ASSERT(batch->msgs = realloc(batch->msgs, cap * sizeof(struct mmsghdr)), return FAILURE);
+
+    memset(batch->headers, 0, cap * sizeof(rtp_hdr_t));
+    batch->cap = cap;
+
+    return SUCCESS;
+}
+
+static void copy_add(struct copy_batch_t *batch, signed char *payload, size_t len)
+{
+    int i = batch->num++;
+
+    batch->iovs[i * 2].iov_base = &(batch->headers[i]);
+    batch->iovs[i * 2].iov_len = sizeof(rtp_hdr_t);
+    batch->iovs[i * 2 + 1].iov_base = payload;
+    batch->iovs[i * 2 + 1].iov_len = len;
+
+    CLEAR(batch->msgs[i]);
+    batch->msgs[i].msg_hdr.msg_iov = &(batch->iovs[i * 2]);
+    batch->msgs[i].msg_hdr.msg_iovlen = 2;
+}
+
+/* the former __packetize_nal(): single NALs and FU-A fragments are copied whole. the arena
+   holds a frame, as 'cap' was sized for the largest */
+static unsigned long long copy_packetize(struct copy_batch_t *batch, struct nal_table_t *nals)
+{
+    unsigned long long copied = 0;
+    signed char *nalptr;
+    signed char *dst;
+    size_t nalsize;
+    size_t len;
+    unsigned int nri, pt;
+    int first;
+    int i;
+
+    batch->num = 0;
+
+    for(i = 0; i < nals->num; i++) {
+        nalptr = nals->units[i].ptr;
+        nalsize = nals->units[i].len;
+        dst = &(batch->arena[batch->num * __RTP_MAXPAYLOADSIZE]);
+
+        if(nalsize <= __RTP_MAXPAYLOADSIZE) {
+            memcpy(dst, nalptr, nalsize);
+            copy_add(batch, dst, nalsize);
+            copied += nalsize;
+            continue;
+        }
+
+        nri = nalptr[0] & 0x60;
+        pt = nalptr[0] & 0x1F;
+
+        nalptr += 1;
+        nalsize -= 1;
+
+        for(first = TRUE; nalsize > 0; first = FALSE) {
+            len = min(nalsize, (size_t)__RTP_MAXPAYLOADSIZE - 2);
+            dst = &(batch->arena[batch->num * __RTP_MAXPAYLOADSIZE]);
+
+            dst[0] = 28 | nri;
+            dst[1] = pt | (first ? 1 << 7 : 0) | (len == nalsize ? 1 << 6 : 0);
+            memcpy(dst + 2, nalptr, len);
+            copy_add(batch, dst, len + 2);
+            copied += len + 2;
+
+            nalptr += len;
+            nalsize -= len;
+        }
+    }
+
+    return copied;
+}
+
+static void flush(int fd, struct mmsghdr *msgs, int num)
+{
+    int sent;
+    int n;
+
+    for(sent = 0; sent < num; sent += n) {
+        n = min(num - sent, __RTP_SENDMMSG_MAX);
+        TEST(sendmmsg(fd, &msgs[sent], n, 0) >= 0, ERR("sendmmsg:%s\n", strerror(errno)));
+    }
+}
+
+static void report(const char *name, const struct result_t *r, int seconds, size_t stream_bytes)
+{
+    printf("%-10s %12.1f %12.1f %12.2f %9.2f\n", name, r->ns / seconds / 1000,
+            r->send_ns / seconds / 1000, r->copied / (double)seconds / 1e6,
+            (double)r->copied / stream_bytes);
+}
+
+/******************************************************************************
+ *              MAIN
+ ******************************************************************************/
+int main(int argc, char **argv)
+{
+    const struct preset_t *preset = &presets[0];
+    int seconds = argc > 2 ? atoi(argv[2]) : 10;
+    struct nal_table_t **nals;
+    struct __rtp_batch_t *zc;
+    struct copy_batch_t copy = {};
+    struct result_t zc_res = {};
+    struct result_t copy_res = {};
+    struct sockaddr_in addr = {};
+    socklen_t addrlen = sizeof(addr);
+    signed char **aus;
+    size_t *au_lens;
+    size_t stream_bytes = 0;
+    double t0;
+    int sink, fd;
+    int i, f, s;
+
+    for(i = 0; argc > 1 && i < (int)(sizeof(presets) / sizeof(presets[0])); i++) {
+        if(strcmp(argv[1], presets[i].name) == 0) {
+            break;
+        }
+    }
+
+    ASSERT(i < (int)(sizeof(presets) / sizeof(presets[0])), ({
+                ERR("unknown preset %s\n", argv[1]);
+                return 1;}));
+    ASSERT(seconds > 0, return 1);
+
+    preset = &presets[i];
+
+    ASSERT(aus = calloc(preset->fps, sizeof(signed char *)), return 1);
+    ASSERT(au_lens = calloc(preset->fps, sizeof(size_t)), return 1);
+    ASSERT(nals = calloc(preset->fps, sizeof(struct nal_table_t *)), return 1);
+
+    /* one second of the stream. each access unit is indexed once, as __rtp_send_frame() does */
+    for(f = 0; f < preset->fps; f++) {
+        ASSERT(aus[f] = make_au(f == 0, f == 0 ? preset->idr_len : preset->p_len, &au_lens[f]), return 1);
+        ASSERT(nals[f] = nal_table_create(), return 1);
+        ASSERT(nal_scan(nals[f], aus[f], au_lens[f]) == SUCCESS, return 1);
+        stream_bytes += au_lens[f];
+    }
+
+    stream_bytes *= seconds;
+
+    ASSERT(zc = __rtp_batch_create(), return 1);
+    ASSERT(copy_grow(&copy, preset->idr_len / (__RTP_MAXPAYLOADSIZE - 2) + 4) == SUCCESS, return 1);
+
+    /* nobody reads, so the kernel drops past the receive buffer. the send is still whole */
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT((sink = socket(AF_INET, SOCK_DGRAM, 0)) >= 0, return 1);
+    ASSERT(bind(sink, (struct sockaddr *)&addr, sizeof(addr)) == 0, return 1);
+    ASSERT(getsockname(sink, (struct sockaddr *)&addr, &addrlen) == 0, return 1);
+    ASSERT((fd = socket(AF_INET, SOCK_DGRAM, 0)) >= 0, return 1);
+    ASSERT(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0, return 1);
+
+    t0 = now_ns();
+    for(s = 0; s < seconds; s++) {
+        for(f = 0; f < preset->fps; f++) {
+            __rtp_batch_reset(zc);
+            ASSERT(__packetize_frame(zc, nals[f]) == SUCCESS, return 1);
+            __rtp_batch_prepare(zc);
+            zc_res.copied += zerocopy_copied(zc);
+        }
+    }
+    zc_res.ns = now_ns() - t0;
+
+    t0 = now_ns();
+    for(s = 0; s < seconds; s++) {
+        for(f = 0; f < preset->fps; f++) {
+            copy_res.copied += copy_packetize(&copy, nals[f]);
+        }
+    }
+    copy_res.ns = now_ns() - t0;
+
+    t0 = now_ns();
+    for(s = 0; s < seconds; s++) {
+        for(f = 0; f < preset->fps; f++) {
+            __rtp_batch_reset(zc);
+            ASSERT(__packetize_frame(zc, nals[f]) == SUCCESS, return 1);
+            __rtp_batch_prepare(zc);
+            flush(fd, zc->msgs, zc->num);
+        }
+    }
+    zc_res.send_ns = now_ns() - t0;
+
+    t0 = now_ns();
+    for(s = 0; s < seconds; s++) {
+        for(f = 0; f < preset->fps; f++) {
+            copy_packetize(&copy, nals[f]);
+            flush(fd, copy.msgs, copy.num);
+        }
+    }
+    copy_res.send_ns = now_ns() - t0;
+
+    printf("%s: IDR %zu bytes, P %zu bytes, %d fps, %.1f Mbit/s, %d s\n", preset->name,
+            preset->idr_len, preset->p_len, preset->fps, stream_bytes * 8.0 / seconds / 1e6, seconds);
+    printf("%-10s %12s %12s %12s %9s\n", "per second", "packetize", "+sendmmsg", "memcpy", "copied/");
+    printf("%-10s %12s %12s %12s %9s\n", "of stream", "us", "us", "MB/s", "stream");
+    report("zero-copy", &zc_res, seconds, stream_bytes);
+    report("copy", &copy_res, seconds, stream_bytes);
+
+    close(fd);
+    close(sink);
+    __rtp_batch_delete(zc);
+    FREE(copy.arena);
+    FREE(copy.headers);
+    FREE(copy.iovs);
+    FREE(copy.msgs);
+
+    for(f = 0; f < preset->fps; f++) {
+        nal_table_delete(nals[f]);
+        FREE(aus[f]);
+    }
+
+    FREE(nals);
+    FREE(aus);
+    FREE(au_lens);
+
+    return 0;
+}
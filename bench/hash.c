@@ -0,0 +1,256 @@
+/* open addressing of hash.h against the chained buckets it replaced.
+   usage: hash [rounds]
+   for each table size and load factor, random 64-bit keys are looked up in random order
+   (hits), then keys that are not there (misses). the best round counts. the chained table
+   gets as many buckets as the open one has slots, so chains are as long as the load factor */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "common.h"
+#include "list.h"
+#include "hash.h"
+
+/******************************************************************************
+ *              DEFINITIONS
+ ******************************************************************************/
+#define LOOKUPS (64 * 1024)     /* a round, at least */
+
+/******************************************************************************
+ *              DATA STRUCTURES
+ ******************************************************************************/
+/* the former table: a list per bucket, an allocation per entry, 32-bit keys hashed as
+   (key / buf_size) % size. both are known at run time only, as they were */
+struct chain_entry_t {
+    struct list_t list_entry;
+    unsigned int key;
+    void *value;
+};
+
+struct chain_table_t {
+    struct list_head_t *pool;
+    size_t buf_size;    /* 1 for the session table */
+    unsigned int size;
+};
+
+/******************************************************************************
+ *              PRIVATE DATA
+ ******************************************************************************/
+static const int sizes[] = { 16, 4096, 65536 };
+static const double loads[] = { 0.25, 0.5, 0.75 };
+
+/******************************************************************************
+ *              PRIVATE FUNCTIONS
+ ******************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static int chain_clean(struct list_t *e)
+{
+    struct chain_entry_t *p;
+
+    list_upcast(p, e);
+    FREE(p);
+
+    return SUCCESS;
+}
+
+static struct chain_table_t *chain_create(int size, size_t buf_size)
+{
+    struct chain_table_t *h;
+
+    TALLOC(h, return NULL);
+    ASSERT(h->pool = calloc(size, sizeof(struct list_head_t)), ({ FREE(h); return NULL;}));
+    h->size = size;
+    h->buf_size = buf_size;
+
+    return h;
+}
+
+static void chain_destroy(struct chain_table_t *h)
+{
+    unsigned int i;
+
+    for(i = 0; i < h->size; i++) {
+        list_destroy(&h->pool[i]);
+    }
+
+    FREE(h->pool);
+    FREE(h);
+}
+
+static int chain_match(struct list_t *e, void *v)
+{
+    struct chain_entry_t *p;
+
+    list_upcast(p, e);
+
+    return p->key == *(unsigned int *)v;
+}
+
+static int chain_add(struct chain_table_t *h, unsigned int key, void *value)
+{
+    struct chain_entry_t *p;
+
+    TALLOC(p, return FAILURE);
+    p->key = key;
+    p->value = value;
+    p->list_entry.cleaner = chain_clean;
+
+    return list_add(&h->pool[(key / h->buf_size) % h->size], &p->list_entry);
+}
+
+static void *chain_lookup(struct chain_table_t *h, unsigned int key)
+{
+    struct chain_entry_t *p;
+    struct list_t *e;
+
+    if(!(e = list_select(&h->pool[(key / h->buf_size) % h->size], chain_match, &key))) {
+        return NULL;
+    }
+
+    list_upcast(p, e);
+
+    return p->value;
+}
+
+/* ns per lookup, the best of 'rounds'. each round goes over 'keys' until LOOKUPS are done,
+   and 'expect' of each pass must find a value */
+static double time_open(hash_handle h, const hash_key_t *keys, int num, int rounds, int expect)
+{
+    double t0, best = 1e18;
+    int found;
+    int r, i, n = 0;
+
+    for(r = 0; r < rounds; r++) {
+        t0 = now_ns();
+        for(found = 0, n = 0; n < LOOKUPS; n += num) {
+            for(i = 0; i < num; i++) {
+                found += hash_lookup(h, keys[i]) != NULL;
+            }
+        }
+        best = min(best, now_ns() - t0);
+
+        ASSERT(found == expect * (n / num), return -1);
+    }
+
+    return best / n;
+}
+
+static double time_chain(struct chain_table_t *h, const hash_key_t *keys, int num, int rounds, int expect)
+{
+    double t0, best = 1e18;
+    int found;
+    int r, i, n = 0;
+
+    for(r = 0; r < rounds; r++) {
+        t0 = now_ns();
+        for(found = 0, n = 0; n < LOOKUPS; n += num) {
+            for(i = 0; i < num; i++) {
+                found += chain_lookup(h, (unsigned int)keys[i]) != NULL;
+            }
+        }
+        best = min(best, now_ns() - t0);
+
+        ASSERT(found == expect * (n / num), return -1);
+    }
+
+    return best / n;
+}
+
+/* 'slots' for the open table, and as many buckets for the chained one */
+static int bench(int slots, double load, int rounds)
+{
+    struct chain_table_t *chain;
+    hash_handle open;
+    hash_key_t *hits, *misses;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL ^ slots;
+    hash_key_t key;
+    double hit_open, hit_chain, miss_open, miss_chain;
+    int num = max((int)(slots * load), 1);
+    int i, j;
+
+    ASSERT(hits = calloc(num, sizeof(hash_key_t)), return FAILURE);
+    ASSERT(misses = calloc(num, sizeof(hash_key_t)), return FAILURE);
+
+    /* sized so that the table is 'slots' and does not grow */
+    ASSERT(open = hash_create(slots * 3 / 4), return FAILURE);
+    ASSERT(chain = chain_create(slots, 1), return FAILURE);
+    ASSERT((int)(open->mask + 1) == slots, return FAILURE);
+
+    /* low 32 bits differ too, so that the chained table tells them apart */
+    for(i = 0; i < num * 2; i++) {
+        do {
+            key = xorshift(&seed);
+        } while(hash_exist(open, key) || chain_lookup(chain, (unsigned int)key));
+
+        if(i < num) {
+            hits[i] = key;
+            ASSERT(hash_add(open, key, &hits[i]) == SUCCESS, return FAILURE);
+            ASSERT(chain_add(chain, (unsigned int)key, &hits[i]) == SUCCESS, return FAILURE);
+        } else {
+            misses[i - num] = key;
+        }
+    }
+
+    /* looked up in an order of their own */
+    for(i = num - 1; i > 0; i--) {
+        j = xorshift(&seed) % (i + 1);
+        key = hits[i];
+        hits[i] = hits[j];
+        hits[j] = key;
+    }
+
+    ASSERT((hit_open = time_open(open, hits, num, rounds, num)) > 0, return FAILURE);
+    ASSERT((hit_chain = time_chain(chain, hits, num, rounds, num)) > 0, return FAILURE);
+    ASSERT((miss_open = time_open(open, misses, num, rounds, 0)) >= 0, return FAILURE);
+    ASSERT((miss_chain = time_chain(chain, misses, num, rounds, 0)) >= 0, return FAILURE);
+
+    printf("%8d %6.2f %8d %10.1f %10.1f %10.1f %10.1f\n", slots, load, num,
+            hit_chain, hit_open, miss_chain, miss_open);
+
+    hash_destroy(open);
+    chain_destroy(chain);
+    FREE(hits);
+    FREE(misses);
+
+    return SUCCESS;
+}
+
+/******************************************************************************
+ *              MAIN
+ ******************************************************************************/
+int main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 50;
+    int s, l;
+
+    ASSERT(rounds > 0, return 1);
+
+    printf("ns per lookup, best of %d rounds\n", rounds);
+    printf("%8s %6s %8s %10s %10s %10s %10s\n", "slots", "load", "keys",
+            "hit chain", "hit open", "miss chain", "miss open");
+
+    for(s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+        for(l = 0; l < (int)(sizeof(loads) / sizeof(loads[0])); l++) {
+            ASSERT(bench(sizes[s], loads[l], rounds) == SUCCESS, return 1);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,152 @@
+/* start code finders of nal.c against memchr() and a plain byte loop.
+   usage: nal_scan [AU bytes] [NALU bytes] [rounds]
+   an access unit of random NALUs, free of emulated start codes as an encoder would leave
+   it, is scanned from start code to start code by each finder the CPU runs. the best round
+   counts, to keep other load out */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* the finders are private to it */
+#include "nal.c"
+
+/******************************************************************************
+ *              DATA STRUCTURES
+ ******************************************************************************/
+struct finder_t {
+    const char *name;
+    __nal_finder_fxn fxn;
+};
+
+/******************************************************************************
+ *              PRIVATE FUNCTIONS
+ ******************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* a byte at a time, as __split_nal() of rtp.h did before the finders */
+static size_t find_sc_bytes(const unsigned char *p, size_t from, size_t len)
+{
+    size_t i;
+
+    for (i = from; i + 3 <= len; i++) {
+        if (p[i] == 0x00 && p[i + 1] == 0x00 && p[i + 2] == 0x01) {
+            return i;
+        }
+    }
+
+    return len;
+}
+
+/* random NALUs behind 4-byte start codes. '00 00 0x' with x <= 3 gets an emulation
+   prevention byte, as in a real bitstream */
+static unsigned char *make_au(size_t len, size_t nal_len)
+{
+    unsigned char *p;
+    size_t i;
+    int zeros = 0;
+
+    ASSERT(p = malloc(len), return NULL);
+
+    for (i = 0; i < len; i++) {
+        if (i % nal_len == 0 && i + 4 < len) {
+            memcpy(p + i, "\x00\x00\x00\x01", 4);
+            i += 3;
+            zeros = 0;
+            continue;
+        }
+
+        p[i] = (zeros >= 2) ? 0x03 : rand();
+        zeros = (p[i] == 0x00) ? zeros + 1 : 0;
+    }
+
+    return p;
+}
+
+static size_t scan(__nal_finder_fxn find, const unsigned char *p, size_t len)
+{
+    size_t i = 0;
+    size_t k;
+    size_t n = 0;
+
+    while ((k = find(p, i, len)) < len) {
+        i = k + 3;
+        n++;
+    }
+
+    return n;
+}
+
+/******************************************************************************
+ *              MAIN
+ ******************************************************************************/
+int main(int argc, char **argv)
+{
+    size_t len = argc > 1 ? strtoul(argv[1], NULL, 0) : 1 << 20;
+    size_t nal_len = argc > 2 ? strtoul(argv[2], NULL, 0) : 64 * 1024;
+    int rounds = argc > 3 ? atoi(argv[3]) : 200;
+    struct finder_t finders[8];
+    struct nal_table_t *table;
+    unsigned char *au;
+    size_t expect;
+    size_t n = 0;
+    double t0, ns;
+    int num = 0;
+    int i, r;
+
+    ASSERT(len > 0 && nal_len > 4 && rounds > 0, return 1);
+    ASSERT(au = make_au(len, nal_len), return 1);
+    ASSERT(table = nal_table_create(), return 1);
+
+    finders[num++] = (struct finder_t){ "bytes", find_sc_bytes };
+    finders[num++] = (struct finder_t){ "memchr", __find_sc_memchr };
+#if defined (__SSE2__)
+    finders[num++] = (struct finder_t){ "sse2", __find_sc_sse2 };
+#endif
+#if defined (__NAL_HAVE_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        finders[num++] = (struct finder_t){ "avx2", __find_sc_avx2 };
+    }
+#endif
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+    finders[num++] = (struct finder_t){ "neon", __find_sc_neon };
+#endif
+
+    expect = scan(find_sc_bytes, au, len);
+
+    printf("AU %zu bytes, %zu start codes, %d rounds\n", len, expect, rounds);
+
+    for (i = 0; i < num; i++) {
+        for (ns = 1e18, r = 0; r < rounds; r++) {
+            t0 = now_ns();
+            n = scan(finders[i].fxn, au, len);
+            ns = min(ns, now_ns() - t0);
+
+            ASSERT(n == expect, return 1);
+        }
+
+        printf("%-8s %8.1f us %6.2f GB/s\n", finders[i].name, ns / 1000, len / ns);
+    }
+
+    /* the finder nal_scan() picks, and the table it fills */
+    for (ns = 1e18, r = 0; r < rounds; r++) {
+        t0 = now_ns();
+        ASSERT(nal_scan(table, (signed char *)au, len) == SUCCESS, return 1);
+        ns = min(ns, now_ns() - t0);
+    }
+
+    ASSERT(table->num == (int)expect, return 1);
+
+    printf("%-8s %8.1f us %6.2f GB/s\n", "nal_scan", ns / 1000, len / ns);
+
+    nal_table_delete(table);
+    FREE(au);
+
+    return 0;
+}
@@ -0,0 +1,336 @@
+/* time to first frame: from PLAY to the first packet of an IDR, without and with the GOP cache.
+   usage: ttff [joins] [fps] [gop]
+   a thread submits a live stream to rtp_submit_h264_async(): an IDR access unit of 100 KB every
+   'gop' frames and P slices of 10 KB between. clients come in one after another at random points
+   of the GOP, and each leaves once the IDR reached it. the cache runs off, copying each frame,
+   and holding the submitted buffers by reference (rtsp_attr_t.gop_hold_frames) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "common.h"
+#include "rtsp_server.h"
+
+/******************************************************************************
+ *              DEFINITIONS
+ ******************************************************************************/
+#define IDR_LEN (100 * 1024)
+#define P_LEN (10 * 1024)
+#define CLIENT_PORT 22000   /* RTP of the first client. RTCP above it */
+#define GOP_CACHE_SIZE (4 * 1024 * 1024)
+#define H264_NAL_TYPE_FU_A 28
+
+/******************************************************************************
+ *              DATA STRUCTURES
+ ******************************************************************************/
+struct mode_t {
+    const char *name;
+    size_t gop_cache_size;
+    int hold;
+};
+
+struct feeder_t {
+    pthread_t thread;
+    rtsp_handle h;
+    int fps;
+    int gop;
+    volatile int stop;
+    int ret;
+};
+
+struct client_t {
+    int rtsp_fd;
+    int rtp_fd;
+    int rtcp_fd;
+};
+
+/******************************************************************************
+ *              PRIVATE DATA
+ ******************************************************************************/
+static const struct mode_t modes[] = {
+    { "off",  0,              FALSE },
+    { "copy", GOP_CACHE_SIZE, FALSE },
+    { "hold", GOP_CACHE_SIZE, TRUE },
+};
+
+static const unsigned char idr_head[] = {
+    0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x1f, 0xab,   /* SPS */
+    0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x3c, 0x80,         /* PPS */
+    0x00, 0x00, 0x00, 0x01, 0x65,                           /* IDR slice */
+};
+
+static const unsigned char p_head[] = { 0x00, 0x00, 0x00, 0x01, 0x41 };
+
+static signed char idr[sizeof(idr_head) + IDR_LEN];
+static signed char p_slice[sizeof(p_head) + P_LEN];
+
+/******************************************************************************
+ *              PRIVATE FUNCTIONS
+ ******************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void fill(signed char *buf, size_t len, const unsigned char *head, size_t head_len, unsigned int *seed)
+{
+    size_t i;
+
+    memcpy(buf, head, head_len);
+
+    /* no start code in the slice */
+    for(i = head_len; i < len; i++) {
+        buf[i] = rand_r(seed) % 255 + 1;
+    }
+}
+
+static void frame_release(signed char *buf, size_t len, void *arg)
+{
+    FREE(buf);
+}
+
+/* a copy of each frame goes to the server, which may hold it for the rest of the GOP */
+static void *feed(void *v)
+{
+    struct feeder_t *f = v;
+    struct timespec next;
+    struct timeval tv;
+    signed char *buf;
+    const signed char *src;
+    size_t len;
+    long i;
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    for(i = 0; !f->stop; i++) {
+        src = i % f->gop == 0 ? idr : p_slice;
+        len = i % f->gop == 0 ? sizeof(idr) : sizeof(p_slice);
+
+        ASSERT(buf = malloc(len), goto error);
+        memcpy(buf, src, len);
+
+        /* a live source drops what the queue refuses */
+        gettimeofday(&tv, NULL);
+        if(rtp_submit_h264_async(f->h, buf, len, &tv, frame_release, NULL) != SUCCESS) {
+            FREE(buf);
+        }
+
+        next.tv_nsec += 1000000000L / f->fps;
+        if(next.tv_nsec >= 1000000000L) {
+            next.tv_sec += 1;
+            next.tv_nsec -= 1000000000L;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    f->ret = SUCCESS;
+    return NULL;
+error:
+    f->ret = FAILURE;
+    return NULL;
+}
+
+static int udp_bind(unsigned short port)
+{
+    struct sockaddr_in addr = { sin_family: AF_INET, sin_port: htons(port) };
+    int fd;
+
+    ASSERT((fd = socket(AF_INET, SOCK_DGRAM, 0)) >= 0, return -1);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0, ({
+                ERR("bind %u failed\n", port);
+                close(fd);
+                return -1;}));
+
+    return fd;
+}
+
+/* the server starts its listeners on its own threads */
+static int rtsp_connect(void)
+{
+    struct sockaddr_in addr = { sin_family: AF_INET, sin_port: htons(SERVER_RTSP_PORT) };
+    int fd;
+    int i;
+
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for(i = 0; i < 50; i++) {
+        ASSERT((fd = socket(AF_INET, SOCK_STREAM, 0)) >= 0, return -1);
+        if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        usleep(20000);
+    }
+
+    ERR("no server on port %d\n", SERVER_RTSP_PORT);
+    return -1;
+}
+
+/* one request, and its reply headers to 'reply' */
+static int request(int fd, const char *req, char *reply, size_t size)
+{
+    struct pollfd p = { fd: fd, events: POLLIN };
+    size_t got = 0;
+    ssize_t n;
+
+    ASSERT(write(fd, req, strlen(req)) == (ssize_t)strlen(req), return FAILURE);
+
+    reply[0] = '\0';
+    while(!strstr(reply, "\r\n\r\n")) {
+        ASSERT(got < size - 1 && poll(&p, 1, 2000) > 0, return FAILURE);
+        ASSERT((n = read(fd, reply + got, size - 1 - got)) > 0, return FAILURE);
+        got += n;
+        reply[got] = '\0';
+    }
+
+    ASSERT(strncmp(reply, "RTSP/1.0 200", 12) == 0, ({
+                ERR("%s", reply);
+                return FAILURE;}));
+
+    return SUCCESS;
+}
+
+static void client_close(struct client_t *c)
+{
+    CLOSE(c->rtsp_fd);
+    CLOSE(c->rtp_fd);
+    CLOSE(c->rtcp_fd);
+}
+
+/* ms from sending PLAY to the first IDR packet, or a negative value on failure */
+static double client_ttff(int index, double timeout_ms)
+{
+    struct client_t c = { -1, -1, -1 };
+    unsigned short port = CLIENT_PORT + 2 * (index % 500);
+    unsigned char pkt[2048];
+    char req[256];
+    char reply[2048];
+    char *session;
+    struct pollfd p;
+    double t0, ms = -1;
+    ssize_t n;
+    int type;
+
+    ASSERT((c.rtp_fd = udp_bind(port)) >= 0, goto error);
+    ASSERT((c.rtcp_fd = udp_bind(port + 1)) >= 0, goto error);
+    ASSERT((c.rtsp_fd = rtsp_connect()) >= 0, goto error);
+
+    snprintf(req, sizeof(req), "SETUP rtsp://127.0.0.1/streamid=0 RTSP/1.0\r\nCSeq: 1\r\n"
+            "Transport: RTP/AVP;unicast;client_port=%u-%u\r\n\r\n", port, port + 1);
+    ASSERT(request(c.rtsp_fd, req, reply, sizeof(reply)) == SUCCESS, goto error);
+    ASSERT(session = strstr(reply, "Session: "), goto error);
+
+    snprintf(req, sizeof(req), "PLAY rtsp://127.0.0.1/ RTSP/1.0\r\nCSeq: 2\r\nSession: %llx\r\n\r\n",
+            strtoull(session + strlen("Session: "), NULL, 16));
+
+    t0 = now_ns();
+    ASSERT(request(c.rtsp_fd, req, reply, sizeof(reply)) == SUCCESS, goto error);
+
+    p.fd = c.rtp_fd;
+    p.events = POLLIN;
+
+    while(now_ns() - t0 < timeout_ms * 1e6) {
+        if(poll(&p, 1, 100) <= 0 || (n = recv(c.rtp_fd, pkt, sizeof(pkt), 0)) < 14) {
+            continue;
+        }
+
+        /* RTP header of 12 bytes, then a NALU or an FU-A indicator and header */
+        type = pkt[12] & 0x1f;
+        if(type == H264_NAL_TYPE_FU_A) {
+            type = pkt[13] & 0x1f;
+        }
+
+        /* parameter sets come ahead of it */
+        if(type == 5) {
+            ms = (now_ns() - t0) / 1e6;
+            break;
+        }
+    }
+
+    ASSERT(ms >= 0, ERR("no IDR in %.0f ms\n", timeout_ms));
+
+error:
+    client_close(&c);
+    return ms;
+}
+
+static int run(const struct mode_t *mode, int joins, int fps, int gop, unsigned int *seed)
+{
+    struct rtsp_attr_t attr;
+    struct rtsp_stat_t stat;
+    struct feeder_t feeder = { fps: fps, gop: gop };
+    double gop_ms = 1e3 * gop / fps;
+    double ms, sum = 0, worst = 0;
+    int ret = FAILURE;
+    int i;
+
+    rtsp_attr_init(&attr);
+    attr.max_con = 4;
+    attr.udp_mode = RTSP_UDP_RANGE;
+    attr.gop_cache_size = mode->gop_cache_size;
+    attr.gop_hold_frames = mode->hold ? gop : 0;
+
+    ASSERT(feeder.h = rtsp_create_attr(&attr), return FAILURE);
+    ASSERT(pthread_create(&feeder.thread, NULL, feed, &feeder) == 0, goto error);
+
+    for(i = 0; i < joins; i++) {
+        usleep((useconds_t)(rand_r(seed) % (int)(gop_ms * 1000)));
+
+        ASSERT((ms = client_ttff(i, gop_ms * 2 + 1000)) >= 0, break);
+        sum += ms;
+        worst = max(worst, ms);
+    }
+
+    feeder.stop = TRUE;
+    pthread_join(feeder.thread, NULL);
+
+    ASSERT(i == joins && feeder.ret == SUCCESS, goto error);
+    ASSERT(rtsp_get_stat(feeder.h, &stat) == SUCCESS, goto error);
+
+    printf("%-6s %10.1f %10.1f %12llu %12llu\n", mode->name, sum / joins, worst, stat.gop_starts,
+            stat.gop_frames);
+    ret = SUCCESS;
+
+error:
+    feeder.stop = TRUE;
+    rtsp_finish(feeder.h);
+    return ret;
+}
+
+/******************************************************************************
+ *              MAIN
+ ******************************************************************************/
+int main(int argc, char **argv)
+{
+    int joins = argc > 1 ? atoi(argv[1]) : 8;
+    int fps = argc > 2 ? atoi(argv[2]) : 30;
+    int gop = argc > 3 ? atoi(argv[3]) : 30;
+    unsigned int seed = 1;
+    int m;
+
+    ASSERT(joins > 0 && fps > 0 && gop > 0, return 1);
+
+    fill(idr, sizeof(idr), idr_head, sizeof(idr_head), &seed);
+    fill(p_slice, sizeof(p_slice), p_head, sizeof(p_head), &seed);
+
+    printf("%d joins, %d fps, an IDR every %d frames (%.0f ms)\n", joins, fps, gop, 1e3 * gop / fps);
+    printf("%-6s %10s %10s %12s %12s\n", "cache", "mean ms", "worst ms", "gop starts", "gop frames");
+
+    for(m = 0; m < (int)(sizeof(modes) / sizeof(modes[0])); m++) {
+        ASSERT(run(&modes[m], joins, fps, gop, &seed) == SUCCESS, return 1);
+    }
+
+    return 0;
+}
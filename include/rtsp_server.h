@@ -6,6 +6,7 @@ extern "C" {
 #endif
 #include <unistd.h>
 #include <time.h>
+#include <sys/uio.h>
 
 /******************************************************************************
  *              DEFINITIONS
@@ -14,23 +15,171 @@ extern "C" {
 #define SERVER_RTP_PORT 5004
 #define SERVER_RTCP_PORT 5025
 #define RTSP_MAXIMUM_FRAMERATE 60
-#define RTSP_MAXIMUM_CONNECTIONS 16
+#define RTSP_MAXIMUM_CONNECTIONS 16  /* default of rtsp_attr_t.max_con. not a hard limit */
 
 #define STR_RTSP_VERSION "RTSP/1.0"
 
+/* optional RTP transmit backends (rtsp_attr_t.tx_flags). each falls back to
+   plain sendmmsg() on sockets where the kernel does not offer it.
+   frames taking the zerocopy path are not gathered into GSO super-buffers */
+#define RTSP_TX_GSO         (1 << 0)    /* UDP_SEGMENT: one super-buffer per FU-A run */
+#define RTSP_TX_ZEROCOPY    (1 << 1)    /* MSG_ZEROCOPY for frames above the threshold */
+
+#define RTSP_DEFAULT_PRIORITY 10
+#define RTSP_DEFAULT_ZEROCOPY_THRESHOLD (64 * 1024)
+#define RTSP_DEFAULT_SEND_QUEUE_DEPTH 256
+#define RTSP_DEFAULT_CONNECTION_BATCH 16
+#define RTSP_DEFAULT_UDP_PORT_MIN SERVER_RTP_PORT
+#define RTSP_DEFAULT_UDP_PORT_MAX (SERVER_RTP_PORT + 1999)
+#define RTSP_DEFAULT_MCAST_PORT (SERVER_RTP_PORT + 2000)
+#define RTSP_DEFAULT_MCAST_TTL 1
+#define RTSP_DEFAULT_CONTROL_THREADS 1
+#define RTSP_DEFAULT_LISTEN_BACKLOG 128
+
 /* __rtsp_obj_t is private. you will not see it */
 typedef struct __rtsp_obj_t *rtsp_handle;
 
+/* transmission counters. 'send_calls' / 'frames' tells how many syscalls a frame costs */
+struct rtsp_stat_t {
+    unsigned long long frames;      /* frames delivered to at least one client */
+    unsigned long long packets;     /* RTP packets sent (summed over clients) */
+    unsigned long long send_calls;  /* send syscalls issued for RTP */
+    unsigned long long gso_sends;   /* messages carrying more than one segment */
+    unsigned long long zerocopy_sends;  /* messages sent with MSG_ZEROCOPY */
+    unsigned long long zerocopy_copied; /* ... of which the kernel fell back to copy */
+    unsigned long long dropped_frames;  /* frames (partially) dropped for a congested client */
+    unsigned long long dropped_packets;
+    unsigned long long congestions; /* frames a full send queue refused. each starts a drop */
+    unsigned long long resyncs;     /* drops ended on an IDR */
+    unsigned long long gop_starts;  /* sessions started at the cached IDR, with a picture at once */
+    unsigned long long gop_misses;  /* ... that had to wait for the next IDR instead */
+    unsigned long long gop_frames;  /* cached frames sent to catch up */
+    unsigned long long gop_catchups;    /* sessions of 'gop_starts' that reached the live feed */
+    unsigned long long submit_refused;  /* rtp_submit_h264_async() calls refused by a full queue */
+};
+
+/* framing of the buffer given to rtp_send_h264_format() */
+enum rtsp_nal_format_e {
+    RTSP_NAL_ANNEXB = 0,    /* '00 00 01' or '00 00 00 01' start codes */
+    RTSP_NAL_AVCC1 = 1,     /* AVCC (MP4) NALUs with a 1, 2 or 4-byte big endian length prefix */
+    RTSP_NAL_AVCC2 = 2,
+    RTSP_NAL_AVCC4 = 4,
+};
+
+/* how sessions get their server side RTP/RTCP ports (rtsp_attr_t.udp_mode) */
+enum rtsp_udp_mode_e {
+    RTSP_UDP_FIXED = 0,     /* SERVER_RTP_PORT and SERVER_RTCP_PORT, a socket pair per session */
+    RTSP_UDP_RANGE,         /* a socket pair per session on its own even/odd ports out of 
+                               [udp_port_min, udp_port_max] */
+    RTSP_UDP_SHARED,        /* one socket pair for all sessions on udp_port_min and udp_port_min + 1,
+                               sent to each client by address. RTSP_TX_ZEROCOPY is not used */
+};
+
+/* scheduling class of library threads (rtsp_thread_policy_t.sched) */
+enum rtsp_sched_e {
+    RTSP_SCHED_FIFO = 0,    /* real time at rtsp_attr_t.priority. needs CAP_SYS_NICE, and falls back
+                               to RTSP_SCHED_OTHER without it */
+    RTSP_SCHED_RR,          /* same, round robin among equal priorities */
+    RTSP_SCHED_OTHER,       /* time sharing at 'nice' */
+};
+
+/* how a kind of library thread is scheduled */
+struct rtsp_thread_policy_t {
+    enum rtsp_sched_e sched;
+    int nice;                   /* RTSP_SCHED_OTHER, also after a fallback. lower than the process'
+                                   own needs CAP_SYS_NICE */
+    unsigned long long cpus;    /* CPUs 0 to 63 the threads may run on. 0 leaves it to the scheduler */
+};
+
+/* library threads listed by rtsp_get_threads() */
+enum rtsp_thread_e {
+    RTSP_THREAD_CONTROL = 0,    /* serves RTSP requests (rtsp_attr_t.control_threads) */
+    RTSP_THREAD_SENDER,         /* sends frames given to rtp_submit_h264_async() */
+    RTSP_THREAD_WORKER,         /* send worker (rtsp_attr_t.send_workers) */
+};
+
+struct rtsp_thread_info_t {
+    enum rtsp_thread_e kind;
+    unsigned int index;         /* among the threads of its kind */
+    pid_t tid;                  /* kernel thread id, for sched_setaffinity() and the like */
+    enum rtsp_sched_e sched;    /* the class it got */
+};
+
+/* called from the sender thread once every client has consumed a buffer given
+   to rtp_submit_h264_async() */
+typedef void (*rtp_release_fxn)(signed char *buf, size_t len, void *arg);
+
+/* creation parameters. initialize by rtsp_attr_init() before touching */
+struct rtsp_attr_t {
+    unsigned int max_con;           /* connections served at once. INT_MAX at most */
+    unsigned int con_batch;         /* connections preallocated, and the growth step up to 'max_con'.
+                                       INT_MAX at most */
+    int priority;                   /* of the control threads. the sender runs one below and its workers
+                                       two below, but not below the least of their class */
+    unsigned int tx_flags;          /* RTSP_TX_* */
+    size_t zerocopy_threshold;      /* frames of this size or more use MSG_ZEROCOPY */
+    unsigned int send_queue_depth;  /* RTP packets a client may have queued before it drops
+                                       frames until the next IDR (bounded by wmem_max over
+                                       UDP, sizes the output ring when interleaved over TCP) */
+    enum rtsp_udp_mode_e udp_mode;
+    unsigned short udp_port_min;    /* RTSP_UDP_RANGE and RTSP_UDP_SHARED. even */
+    unsigned short udp_port_max;    /* RTSP_UDP_RANGE */
+    const char *mcast_group;        /* IPv4 group for SETUP with 'multicast'. the stream goes once to
+                                       the group for all such sessions. NULL refuses multicast */
+    unsigned short mcast_port;      /* even. RTCP on mcast_port + 1 */
+    unsigned char mcast_ttl;
+    size_t gop_cache_size;          /* bytes kept from the last IDR, so that PLAY starts with a picture.
+                                       a longer GOP is not cached. 0 disables */
+    unsigned int gop_hold_frames;   /* frames of rtp_submit_h264_async() the GOP cache keeps by reference
+                                       instead of a copy. their 'release' waits for the next IDR, so the
+                                       caller needs as many buffers more. 0 copies them all */
+    unsigned int send_workers;      /* threads, each on its own core, that send a frame to disjoint
+                                       shards of the sessions at once. 0 sends on the caller */
+    unsigned int control_threads;   /* threads serving RTSP requests. each has a listener of its own
+                                       on the RTSP port (SO_REUSEPORT), and the kernel spreads new
+                                       connections over them */
+    int listen_backlog;             /* connections each listener keeps waiting for accept() */
+    struct rtsp_thread_policy_t control_policy; /* the threads serving RTSP requests */
+    struct rtsp_thread_policy_t sender_policy;  /* the sender thread, and the send workers. these are
+                                                   pinned one CPU each out of 'cpus' */
+};
+
 /******************************************************************************
  *              LIBRARY FUNCTIONS
  ******************************************************************************/
-/* put virtual pointer to 'buf', which consists of 1 or more NALUs (start code required). 
+/* put virtual pointer to 'buf', which consists of 1 or more NALUs (3 or 4-byte start code required). 
    SPS and PPS parameters are automatically collected during execution. */
 
 int rtp_send_h264(rtsp_handle h,signed char *buf, size_t len, struct timeval *p_tv);
 
+/* same as rtp_send_h264(), but 'buf' is framed by 'format'. nothing is copied or re-framed */
+int rtp_send_h264_format(rtsp_handle h, signed char *buf, size_t len, enum rtsp_nal_format_e format,
+        struct timeval *p_tv);
+
+/* same as rtp_send_h264(), but the access unit is given already split: one NALU per iovec,
+   without start code nor length prefix. buffers may be scattered */
+int rtp_send_h264_iov(rtsp_handle h, const struct iovec *nals, int num, struct timeval *p_tv);
+
+/* same as rtp_send_h264(), but only queues 'buf' by reference to the sender thread and returns.
+   'release' is called when the buffer is no longer used (also for frames left at rtsp_finish()),
+   which is at the next IDR for frames the GOP cache holds (rtsp_attr_t.gop_hold_frames).
+   on failure (queue full, see rtsp_stat_t.submit_refused, or server gone) 'release' is not called 
+   and the caller keeps 'buf' */
+int rtp_submit_h264_async(rtsp_handle h, signed char *buf, size_t len, struct timeval *p_tv, 
+        rtp_release_fxn release, void *arg);
+
+/* copy transmission counters of the handle to 'p_stat' */
+int rtsp_get_stat(rtsp_handle h, struct rtsp_stat_t *p_stat);
+
+/* copy up to 'num' of the library threads to 'info'. returns how many there are, or -1 */
+int rtsp_get_threads(rtsp_handle h, struct rtsp_thread_info_t *info, int num);
+
 extern void rtsp_finish(rtsp_handle h);
 
+extern void rtsp_attr_init(struct rtsp_attr_t *attr);
+
+extern rtsp_handle rtsp_create_attr(const struct rtsp_attr_t *attr);
+
 extern rtsp_handle rtsp_create(unsigned char max_con, int priority);
 
 #if defined (__cplusplus)
@@ -2,9 +2,8 @@
 #define _RTSP_BUFFPOOL_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include "common.h"
-#include "list.h"
-#include "hash.h"
 
 #if defined (__cplusplus)
 extern "C" {
@@ -13,25 +12,43 @@ extern "C" {
 /******************************************************************************
  *              DEFINITIONS
  ******************************************************************************/
+#define __BUFPOOL_ALIGN 16
+#define __BUFPOOL_NONE 0xFFFFFFFFU  /* end of the free list */
+#define __BUFPOOL_ROUNDUP(x) (((x) + __BUFPOOL_ALIGN - 1) & ~((size_t)__BUFPOOL_ALIGN - 1))
+#define __BUFPOOL_HDR_SIZE __BUFPOOL_ROUNDUP(sizeof(struct __bufpool_elem_t))
 
 /******************************************************************************
  *              DATA STRUCTURES
  ******************************************************************************/
+/* header placed right in front of each buffer: buf -> elem is pointer arithmetic */
 struct __bufpool_elem_t {
     unsigned int    magic;
-    void *buf;
-    int ref_count;
-    int pos;
+    int ref_count;          /* atomic */
+    unsigned int pos;       /* index in the pool */
+    unsigned int next;      /* free list link (index) */
     int (*reset)(void *buf);
-    struct list_t list_entry; // free list entry
+    void *buf;
+};
+
+/* elements are carved in chunks, so a live buffer never moves when the pool grows */
+struct __bufpool_chunk_t {
+    char *mem;
+    int num;
 };
 
 struct __bufpool_t {
-    pthread_mutex_t mutex;
-    struct list_head_t free_list;
-    struct __bufpool_elem_t *elems;
-    hash_handle buf_table;
-    unsigned int num;
+    pthread_mutex_t mutex;      /* taken only to grow */
+    uint64_t free_head;         /* atomic. index of the top in low 32 bits, ABA tag in high 32 bits */
+    unsigned int num_free;      /* atomic */
+    struct __bufpool_chunk_t *chunks;
+    int num_chunks;
+    unsigned int num;   /* elements carved so far */
+    unsigned int max;
+    unsigned int batch; /* elements per chunk */
+    size_t each_size;
+    size_t stride;      /* header + buffer */
+    int (*init)(struct __bufpool_t *h, void *buf);
+    int (*reset)(void *buf);
 };
 
 typedef struct __bufpool_t *bufpool_handle;
@@ -39,11 +56,16 @@ typedef struct __bufpool_t *bufpool_handle;
 /******************************************************************************
  *              FUNCTION DECLARATIONS
  ******************************************************************************/
-static inline bufpool_handle bufpool_create(int num, void * (*bufgetter_fxn)(int i), int (*reset)(void *buf), size_t each_size);
+static inline bufpool_handle bufpool_create(int num, int max, size_t each_size, 
+        int (*init)(bufpool_handle h, void *buf), int (*reset)(void *buf));
 static void bufpool_delete(bufpool_handle h);
+static inline int __bufpool_grow(bufpool_handle h);
+static inline struct __bufpool_elem_t *__bufpool_elem(bufpool_handle h, unsigned int pos);
+static inline void __bufpool_push(bufpool_handle h, struct __bufpool_elem_t *p);
+static inline struct __bufpool_elem_t *__bufpool_pop(bufpool_handle h);
+static inline struct __bufpool_elem_t *__bufpool_take(bufpool_handle h);
 
 //static inline int bufpool_get_free(bufpool_handle h,void **p_buf);
-static inline int __bufpool_ref_manipulate(bufpool_handle h, void * buf, int val);
 static inline int bufpool_detach(bufpool_handle h, void *buf);
 static inline int bufpool_attach(bufpool_handle h, void *buf);
 static inline void bufpool_statistics(bufpool_handle h);
@@ -53,54 +75,90 @@ static inline void bufpool_statistics(bufpool_handle h);
  ******************************************************************************/
  /* to use strict-aliase compiler optimization, we cannot use void **, so use macro : completely dependent of gcc-extension :p */
 #define bufpool_get_free(__h,__p_buf) ({ \
-    __label__ __unlock;\
     int __ret = FAILURE; \
-    struct list_t *__e; \
     struct __bufpool_elem_t *__p; \
-    pthread_mutex_lock(&__h->mutex); \
-    ASSERT(__e = list_pop(&__h->free_list), goto __unlock); \
-    list_upcast(__p,__e); \
-    __p->ref_count += 1; \
-    *__p_buf = __p->buf; \
-    __ret = SUCCESS; \
-__unlock: \
-    pthread_mutex_unlock(&__h->mutex); \
+    ASSERT(__p = __bufpool_take(__h), ERR("pool %p is exhausted\n", __h)); \
+    if (__p) { \
+        *__p_buf = __p->buf; \
+        __ret = SUCCESS; \
+    } \
     __ret; \
 })
 
+/* same as bufpool_get_free(), but an exhausted pool is no error to report */
+#define bufpool_try_get(__h,__p_buf) ({ \
+    int __ret = FAILURE; \
+    struct __bufpool_elem_t *__p; \
+    if ((__p = __bufpool_take(__h))) { \
+        *__p_buf = __p->buf; \
+        __ret = SUCCESS; \
+    } \
+    __ret; \
+})
 
-static inline int __bufpool_ref_manipulate(bufpool_handle h, void *buf, int val)
+/* O(1) */
+static inline struct __bufpool_elem_t *__bufpool_elem(bufpool_handle h, unsigned int pos)
 {
-    struct __bufpool_elem_t *p;
-    
-    DASSERT(h->elems,return FAILURE);
-    DASSERT(h->num > 0,return FAILURE);
+    return (struct __bufpool_elem_t *)
+        (h->chunks[pos / h->batch].mem + (pos % h->batch) * h->stride);
+}
 
-    ASSERT(p = hash_lookup(h->buf_table,(hash_key_t) buf), return FAILURE);
+/* O(1): lock-free push to the free list */
+static inline void __bufpool_push(bufpool_handle h, struct __bufpool_elem_t *p)
+{
+    uint64_t old = __atomic_load_n(&h->free_head, __ATOMIC_RELAXED);
+    uint64_t new;
 
-    DASSERT(CHECK_MAGIC(MAGIC_BUFPOOL_ELEM,&p), return FAILURE);
-    
-    p->ref_count += val;
+    do {
+        __atomic_store_n(&p->next, (unsigned int)old, __ATOMIC_RELAXED);
+        new = ((old >> 32) + 1) << 32 | p->pos;
+    } while (!__atomic_compare_exchange_n(&h->free_head, &old, new, TRUE,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 
-    TEST(p->ref_count >= 0, ({
-        ERR("double detach at pointer %p: corrupted use of reference counting\n", buf);
-        return FAILURE;}));
+    __atomic_add_fetch(&h->num_free, 1, __ATOMIC_RELAXED);
+}
 
-    if(p->ref_count == 0) {
-        if(p->reset) {
-            ASSERT(p->reset(buf) == SUCCESS,
-                return FAILURE);
+/* O(1): lock-free pop from the free list. the tag defeats ABA; headers are never freed */
+static inline struct __bufpool_elem_t *__bufpool_pop(bufpool_handle h)
+{
+    uint64_t old = __atomic_load_n(&h->free_head, __ATOMIC_ACQUIRE);
+    uint64_t new;
+    struct __bufpool_elem_t *p;
+
+    do {
+        if ((unsigned int)old == __BUFPOOL_NONE) {
+            return NULL;
         }
 
-        ASSERT(list_push(&h->free_list,&p->list_entry) == SUCCESS,
-            return FAILURE);
-    }
+        p = __bufpool_elem(h, (unsigned int)old);
+        new = ((old >> 32) + 1) << 32 | __atomic_load_n(&p->next, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&h->free_head, &old, new, TRUE,
+                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
 
-    //DBG("%p: %d\n", buf, p->ref_count);
+    __atomic_sub_fetch(&h->num_free, 1, __ATOMIC_RELAXED);
 
-    return SUCCESS;
+    return p;
 }
 
+/* take a free element with one reference. grows the pool under the mutex when it ran dry */
+static inline struct __bufpool_elem_t *__bufpool_take(bufpool_handle h)
+{
+    struct __bufpool_elem_t *p;
+
+    if (!(p = __bufpool_pop(h))) {
+        pthread_mutex_lock(&h->mutex);
+        if (!(p = __bufpool_pop(h)) && __bufpool_grow(h) == SUCCESS) {
+            p = __bufpool_pop(h);
+        }
+        pthread_mutex_unlock(&h->mutex);
+    }
+
+    if (p) {
+        __atomic_store_n(&p->ref_count, 1, __ATOMIC_RELAXED);
+    }
+
+    return p;
+}
 
 static inline void bufpool_statistics(bufpool_handle h)
 {
@@ -113,9 +171,7 @@ static inline void bufpool_statistics(bufpool_handle h)
     int max = 50;
     char tmp[max+1];
 
-    pthread_mutex_lock(&h->mutex);
-
-    free_elems = list_length(&h->free_list);
+    free_elems = __atomic_load_n(&h->num_free, __ATOMIC_RELAXED);
     free_elems_ratio = ((float)free_elems/(float)h->num) * max; 
 
     for(i = 0; i < free_elems_ratio; i++) {
@@ -128,93 +184,130 @@ static inline void bufpool_statistics(bufpool_handle h)
 
     printf("%p[%s]%d/%d\n",h,
         tmp,free_elems,h->num);
-
-    pthread_mutex_unlock(&h->mutex);
 //#endif
 }
 
+/* O(1), lock-free. the caller must hold a reference already */
 static inline int bufpool_attach(bufpool_handle h, void *buf)
 {
-    int ret;
+    struct __bufpool_elem_t *p;
+
     DASSERT(h,return FAILURE);
 
-    pthread_mutex_lock(&h->mutex);
-    
-    ret = __bufpool_ref_manipulate(h,buf,1);
-    
-    pthread_mutex_unlock(&h->mutex);
+    p = (struct __bufpool_elem_t *)((char *)buf - __BUFPOOL_HDR_SIZE);
+
+    DASSERT(CHECK_MAGIC(MAGIC_BUFPOOL_ELEM,&p), return FAILURE);
+
+    TEST(__atomic_fetch_add(&p->ref_count, 1, __ATOMIC_RELAXED) > 0, ({
+        __atomic_sub_fetch(&p->ref_count, 1, __ATOMIC_RELAXED);
+        ERR("attach to free pointer %p: corrupted use of reference counting\n", buf);
+        return FAILURE;}));
 
-    return ret;
+    return SUCCESS;
 }
 
+/* O(1), lock-free. the last reference resets the buffer and returns it to the pool */
 static inline int bufpool_detach(bufpool_handle h, void *buf)
 {
-    int ret;
-    DASSERT(h,return FAILURE);
-
-    pthread_mutex_lock(&h->mutex);
-    
-    ret = __bufpool_ref_manipulate(h,buf,-1);
-    
-    pthread_mutex_unlock(&h->mutex);
+    struct __bufpool_elem_t *p;
+    int ref;
 
-    return ret;
-}
+    DASSERT(h,return FAILURE);
 
-static inline bufpool_handle bufpool_create(int num, void * (*bufgetter_fxn)(int i), int (*reset)(void *buf), size_t each_size)
-{
-    int i;
-    bufpool_handle nh = NULL;
+    p = (struct __bufpool_elem_t *)((char *)buf - __BUFPOOL_HDR_SIZE);
 
+    DASSERT(CHECK_MAGIC(MAGIC_BUFPOOL_ELEM,&p), return FAILURE);
 
-    DASSERT(bufgetter_fxn, return NULL);
+    ref = __atomic_sub_fetch(&p->ref_count, 1, __ATOMIC_ACQ_REL);
 
+    TEST(ref >= 0, ({
+        __atomic_add_fetch(&p->ref_count, 1, __ATOMIC_RELAXED);
+        ERR("double detach at pointer %p: corrupted use of reference counting\n", buf);
+        return FAILURE;}));
 
-    TALLOC(nh,return NULL);
+    if(ref == 0) {
+        if(p->reset) {
+            ASSERT(p->reset(buf) == SUCCESS,
+                return FAILURE);
+        }
 
+        __bufpool_push(h, p);
+    }
 
-    pthread_mutex_init(&nh->mutex,NULL);
+    return SUCCESS;
+}
 
+/* O(batch): carve one more chunk of elements. called with the mutex held */
+static inline int __bufpool_grow(bufpool_handle h)
+{
+    struct __bufpool_chunk_t *c;
+    struct __bufpool_elem_t *p;
+    int num;
+    int i;
 
-    ASSERT(nh->elems = calloc(num,sizeof(struct __bufpool_elem_t)), goto error);
+    if(h->num >= h->max) {
+        return FAILURE;
+    }
 
+    num = min(h->batch, h->max - h->num);
+    c = &h->chunks[h->num_chunks];
 
-    ASSERT(nh->buf_table = hash_create(num, each_size),
-        goto error);
+    ASSERT(c->mem = calloc(num, h->stride), return FAILURE);
 
+    for(i = 0; i < num; i++) {
+        p = (struct __bufpool_elem_t *)(c->mem + i * h->stride);
 
-    for(i = 0; i< num; i++) {
+        p->magic = MAGIC_BUFPOOL_ELEM;
+        p->pos = h->num + i;
+        p->reset = h->reset;
+        p->buf = (char *)p + __BUFPOOL_HDR_SIZE;
 
-        nh->elems[i].magic = MAGIC_BUFPOOL_ELEM;
+        if(h->init) {
+            ASSERT(h->init(h, p->buf) == SUCCESS, goto error);
+        }
+    }
 
-        nh->elems[i].pos = i;
-        nh->elems[i].reset = reset;
+    c->num = num;
+    h->num_chunks += 1;
+    h->num += num;
 
-        ASSERT(nh->elems[i].buf = bufgetter_fxn(i),
-            goto error);
+    /* publish the chunk only when it is complete */
+    for(i = num - 1; i >= 0; i--) {
+        __bufpool_push(h, (struct __bufpool_elem_t *)(c->mem + i * h->stride));
+    }
 
-        ASSERT(hash_add(nh->buf_table, (hash_key_t)nh->elems[i].buf,
-            &(nh->elems[i])) == SUCCESS,
-            goto error);
+    return SUCCESS;
+error:
+    FREE(c->mem);
+    return FAILURE;
+}
 
-        MUST(list_push(&nh->free_list, &(nh->elems[i].list_entry)) == SUCCESS,
-            goto error);
+/* preallocate 'num' buffers of 'each_size'. later the pool grows by 'num' up to 'max'.
+   'init' is called once for each new buffer, 'reset' each time it returns to the pool */
+static inline bufpool_handle bufpool_create(int num, int max, size_t each_size, 
+        int (*init)(bufpool_handle h, void *buf), int (*reset)(void *buf))
+{
+    bufpool_handle nh = NULL;
 
-#ifdef __DEBUG
-        struct __bufpool_elem_t *p;
+    DASSERT(num > 0, return NULL);
+    DASSERT(max >= num, return NULL);
+    ASSERT((unsigned int)max < __BUFPOOL_NONE, return NULL);
 
-        /* hash health check */
-        ASSERT(p = hash_lookup(nh->buf_table,(hash_key_t)(nh->elems[i].buf)), goto error);
+    TALLOC(nh,return NULL);
 
-        ASSERT(CHECK_MAGIC(MAGIC_BUFPOOL_ELEM,&p),goto error);
+    pthread_mutex_init(&nh->mutex,NULL);
 
-        ASSERT(p == &nh->elems[i], goto error);
-#endif
-    }
-    
+    nh->free_head = __BUFPOOL_NONE;
+    nh->max = max;
+    nh->batch = num;
+    nh->each_size = each_size;
+    nh->stride = __BUFPOOL_HDR_SIZE + __BUFPOOL_ROUNDUP(each_size);
+    nh->init = init;
+    nh->reset = reset;
 
-    nh->num = num;
+    ASSERT(nh->chunks = calloc((max + num - 1) / num, sizeof(struct __bufpool_chunk_t)), goto error);
 
+    ASSERT(__bufpool_grow(nh) == SUCCESS, goto error);
 
     return nh;
 error:
@@ -224,19 +317,24 @@ error:
 
 static void bufpool_delete(bufpool_handle h)
 {
-    int i;
+    struct __bufpool_chunk_t *c;
+    struct __bufpool_elem_t *p;
+    int i, j;
     if (h) {
-        if (h->elems) {
-            for(i = 0;i < h->num; i++) {
-                if(h->elems[i].reset) {
-                    h->elems[i].reset(h->elems[i].buf);
+        if (h->chunks) {
+            for(i = 0;i < h->num_chunks; i++) {
+                c = &h->chunks[i];
+                for(j = 0; j < c->num; j++) {
+                    p = (struct __bufpool_elem_t *)(c->mem + j * h->stride);
+                    if(p->reset) {
+                        p->reset(p->buf);
+                    }
                 }
+                FREE(c->mem);
             }
-            FREE(h->elems);
+            FREE(h->chunks);
         }
 
-        hash_destroy(h->buf_table);
-
         pthread_mutex_destroy(&h->mutex);
         FREE(h);
     }
@@ -105,10 +105,13 @@
 enum type_magic_e {
     MAGIC_NAL_QUEUE_ITEM = 0xdead0000,
     MAGIC_PACKET_QUEUE_ITEM,
-    MAGIC_BUFPOOL_ELEM
+    MAGIC_BUFPOOL_ELEM,
+    MAGIC_FRAME_JOB
 };
 
-#define CHECK_MAGIC(magic,ptr) (*(ptr) && (((unsigned int*)(*(ptr)))[0] == (magic)))
+/* the first word of an object, read by memcpy() so that no pointer is type-punned */
+#define READ_MAGIC(obj) ({ unsigned int __magic; memcpy(&__magic, (obj), sizeof(__magic)); __magic; })
+#define CHECK_MAGIC(magic,ptr) (*(ptr) && READ_MAGIC(*(ptr)) == (magic))
 
 #ifndef container_of
 #define container_of(type,ptr,member) ({ const typeof( ((type *)0)->member) *__mptr=(ptr); (type *) ( (char *)__mptr - offsetof(type,member));})
@@ -0,0 +1,200 @@
+#ifndef _RTSP_GOP_H
+#define _RTSP_GOP_H
+
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "nal.h"
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+/******************************************************************************
+ *              DEFINITIONS
+ ******************************************************************************/
+#define __GOP_INITIAL_FRAMES 64
+#define GOP_HELD 1  /* gop_cache_put(): the frame is kept by reference, and its owner with it */
+
+/* gives back a frame the cache held by reference */
+typedef void (*gop_release_fxn)(void *owner);
+
+/******************************************************************************
+ *              DATA STRUCTURES
+ ******************************************************************************/
+struct gop_frame_t {
+    int first;              /* index of its first NALU in 'nals' */
+    int num;
+    int idr;
+    unsigned int ts_delta;  /* timestamp step from the previous frame */
+    void *owner;            /* of the buffer its NALUs point into, or NULL when copied */
+};
+
+/* access units since the last IDR. a frame whose buffer has an owner to hold it until the
+   cache starts over is kept by reference, up to 'hold_max' of them. the others are copied to
+   one arena, since their caller takes the buffer back. the sender is the only user */
+struct gop_cache_t {
+    char *arena;
+    size_t cap;
+    size_t used;        /* of the arena */
+    size_t bytes;       /* of the GOP, held or copied. up to 'cap' */
+    struct nal_table_t *nals;   /* NALUs of the frames, in the arena or in held buffers */
+    struct gop_frame_t *frames;
+    int num;
+    int frames_cap;
+    unsigned int gen;   /* bumped on each IDR. positions of an older one are void */
+    int open;           /* the frames run without a gap from the IDR up to the last one sent */
+    int held;           /* frames with an owner */
+    int hold_max;
+    gop_release_fxn release;
+};
+
+/******************************************************************************
+ *              DECLARATIONS
+ ******************************************************************************/
+static inline struct gop_cache_t *gop_cache_create(size_t cap, int hold_max, gop_release_fxn release);
+static inline void gop_cache_delete(struct gop_cache_t *c);
+static inline int gop_cache_put(struct gop_cache_t *c, struct nal_table_t *nals, int idr, unsigned int ts_delta,
+        void *owner);
+
+/******************************************************************************
+ *              INLINE FUNCTIONS
+ ******************************************************************************/
+/* O(frames): give back the held frames and empty the cache */
+static inline void __gop_cache_clear(struct gop_cache_t *c)
+{
+    int i;
+
+    for(i = 0; i < c->num && c->held > 0; i++) {
+        if(c->frames[i].owner) {
+            c->release(c->frames[i].owner);
+            c->held--;
+        }
+    }
+
+    c->used = 0;
+    c->bytes = 0;
+    c->num = 0;
+    c->nals->num = 0;
+}
+
+static inline void gop_cache_delete(struct gop_cache_t *c)
+{
+    if(c) {
+        if(c->frames && c->nals) {
+            __gop_cache_clear(c);
+        }
+        FREE(c->arena);
+        FREE(c->frames);
+        nal_table_delete(c->nals);
+        FREE(c);
+    }
+}
+
+/* 'release' is needed only if 'hold_max' > 0 */
+static inline struct gop_cache_t *gop_cache_create(size_t cap, int hold_max, gop_release_fxn release)
+{
+    struct gop_cache_t *nh = NULL;
+
+    TALLOC(nh, return NULL);
+
+    ASSERT(hold_max == 0 || release, goto error);
+    ASSERT(nh->arena = malloc(cap), goto error);
+    ASSERT(nh->frames = calloc(__GOP_INITIAL_FRAMES, sizeof(struct gop_frame_t)), goto error);
+    ASSERT(nh->nals = nal_table_create(), goto error);
+
+    nh->cap = cap;
+    nh->frames_cap = __GOP_INITIAL_FRAMES;
+    nh->hold_max = hold_max;
+    nh->release = release;
+
+    return nh;
+error:
+    gop_cache_delete(nh);
+    return NULL;
+}
+
+/* O(n): keep the access unit. by reference when it has an 'owner' and fewer than 'hold_max'
+   frames are held, and GOP_HELD tells that the cache took 'owner'. copied otherwise. an IDR
+   starts over, and a GOP that outgrows 'cap' closes the cache until the next one */
+static inline int gop_cache_put(struct gop_cache_t *c, struct nal_table_t *nals, int idr, unsigned int ts_delta,
+        void *owner)
+{
+    struct gop_frame_t *f;
+    struct nal_unit_t *units;
+    size_t len = 0;
+    int cap;
+    int i;
+
+    if(idr) {
+        __gop_cache_clear(c);
+        c->open = TRUE;
+        if(++c->gen == 0) c->gen = 1;
+    }
+
+    if(!c->open) {
+        return SUCCESS;
+    }
+
+    for(i = 0; i < nals->num; i++) {
+        len += nals->units[i].len;
+    }
+
+    if(len > c->cap - c->bytes) {
+        DBG("GOP exceeds %zu bytes. no instant start until the next IDR\n", c->cap);
+        __gop_cache_clear(c);
+        c->open = FALSE;
+        return SUCCESS;
+    }
+
+    if(c->held == c->hold_max) {
+        owner = NULL;
+    }
+
+    if(c->num == c->frames_cap) {
+        cap = c->frames_cap * 2;
+        ASSERT(f = realloc(c->frames, cap * sizeof(struct gop_frame_t)), goto error);
+        c->frames = f;
+        c->frames_cap = cap;
+    }
+
+    if(c->nals->num + nals->num > c->nals->cap) {
+        cap = max(c->nals->cap * 2, c->nals->num + nals->num);
+        ASSERT(units = realloc(c->nals->units, cap * sizeof(struct nal_unit_t)), goto error);
+        c->nals->units = units;
+        c->nals->cap = cap;
+    }
+
+    f = &c->frames[c->num++];
+    f->first = c->nals->num;
+    f->num = nals->num;
+    f->idr = idr;
+    f->ts_delta = ts_delta;
+    f->owner = owner;
+
+    memcpy(&c->nals->units[c->nals->num], nals->units, nals->num * sizeof(struct nal_unit_t));
+    c->bytes += len;
+
+    if(owner) {
+        c->nals->num += nals->num;
+        c->held++;
+        return GOP_HELD;
+    }
+
+    for(i = 0; i < nals->num; i++) {
+        units = &c->nals->units[c->nals->num++];
+        units->ptr = (signed char *)memcpy(c->arena + c->used, nals->units[i].ptr, nals->units[i].len);
+        c->used += nals->units[i].len;
+    }
+
+    return SUCCESS;
+error:
+    __gop_cache_clear(c);
+    c->open = FALSE;
+    return FAILURE;
+}
+
+#if defined (__cplusplus)
+}
+#endif
+#endif
@@ -4,167 +4,219 @@
 #ifdef __cplusplus
 extern "C" {
 #endif
+#include <stdlib.h>
 #include "common.h"
-#include "list.h"
 
 /******************************************************************************
- *              DATA STRUCTURES
+ *              DEFINITIONS
  ******************************************************************************/
-typedef unsigned int hash_key_t;
+#define __HASH_MIN_SLOTS 8
 
-struct __hash_table {
-    struct list_head_t *pool;
-    size_t buf_size;
-    hash_key_t size;
-    hash_key_t num_items;
-};
+/******************************************************************************
+ *              DATA STRUCTURES
+ ******************************************************************************/
+/* full width. pointers go as they are */
+typedef unsigned long long hash_key_t;
 
+/* open addressing with linear (robin hood) probing over one array. an entry sits no farther
+   from its home slot than the one it passed over, so a lookup stops at the first entry
+   closer to home than it would be */
 struct __hash_entry {
-    struct list_t list_entry;
     hash_key_t key;
     void *value;
+    unsigned int dist;      /* slots from home, plus 1. 0 is a free slot */
+};
+
+struct __hash_table {
+    struct __hash_entry *slots;
+    size_t mask;            /* slots - 1. a power of two */
+    size_t num_items;
 };
 
 /******************************************************************************
  *              FUNCTION DECLARATIONS
  ******************************************************************************/
 typedef struct __hash_table *hash_handle;
-static inline hash_handle hash_create(int size, size_t buf_size);
+static inline hash_handle hash_create(int size);
 static inline void hash_destroy(hash_handle h);
 static inline int hash_exist(hash_handle h, hash_key_t key);
 static inline int hash_add(hash_handle h, hash_key_t key, void *val);
 static inline int hash_del(hash_handle h, hash_key_t key);
 static inline void *hash_lookup(hash_handle h, hash_key_t key);
-static inline hash_key_t __hash_buf(int size, hash_key_t key, size_t buf_size);
+static inline size_t __hash_home(hash_handle h, hash_key_t key);
 
 /******************************************************************************
  *              INLINE FUNCTIONS
  ******************************************************************************/
-static inline int __clean_hash_entry(struct list_t *e)
-{
-    struct __hash_entry *p;
-    list_upcast(p,e);
-
-    FREE(p);
-    return SUCCESS;
-}
-
-static inline struct __hash_entry *__new_hash_entry(hash_key_t key, void *value)
-{
-    struct __hash_entry *nh;
-    TALLOC(nh,return NULL);
-    nh->key = key;
-    nh->value = value;
-    nh->list_entry.cleaner = &__clean_hash_entry;
-    return nh;
-}
-
 static inline void hash_destroy(hash_handle h)
 {
-    int i;
     if(h){
-        if(h->pool){
-            for(i = 0;i < h->size;i++) {
-                list_destroy(&(h->pool[i]));
-            }
-            FREE(h->pool);
-        }
-
+        FREE(h->slots);
         FREE(h);
     }
 }
 
-static inline hash_handle hash_create(int size, size_t buf_size)
+/* room for 'size' keys without growing */
+static inline hash_handle hash_create(int size)
 {
     hash_handle nh = NULL;
+    size_t n = __HASH_MIN_SLOTS;
 
     DASSERT(size > 0, return NULL);
 
+    /* load factor up to 3/4 */
+    while(n * 3 < (size_t)size * 4) {
+        n <<= 1;
+    }
+
     TALLOC(nh,goto error);
 
-    ASSERT(nh->pool = calloc(size,(sizeof (struct list_head_t))),
+    ASSERT(nh->slots = calloc(n, sizeof(struct __hash_entry)),
         goto error);
 
-    nh->size = size;
-    nh->buf_size = buf_size;
+    nh->mask = n - 1;
     return nh;
 error:
     hash_destroy(nh);
     return NULL;
 }
 
-static inline int __lookup_key(struct list_t *e, void *v)
+/* the finalizer of murmur3. session ids are random already, but pointers are not */
+static inline size_t __hash_home(hash_handle h, hash_key_t key)
 {
-    hash_key_t key = *((hash_key_t *)v);
-    struct __hash_entry *p;
-    list_upcast(p,e);
-    return (p->key == key);
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+    return key & h->mask;
 }
 
-static inline struct __hash_entry *__find_entry(hash_handle h, int pos, hash_key_t key)   
+/* O(1) expected. the slot of 'key', or -1 */
+static inline long __hash_find(hash_handle h, hash_key_t key)
 {
-    struct __hash_entry *p;
-    struct list_t *e;
+    size_t pos = __hash_home(h, key);
+    unsigned int dist = 1;
+    struct __hash_entry *e;
 
-    e = list_select(&(h->pool[pos]),&__lookup_key, &key);
+    for(;;) {
+        e = &h->slots[pos];
 
-    if(e) {
-        list_upcast(p,e);
-        return p;
+        if(e->dist < dist) {
+            return -1;
+        }
+
+        if(e->key == key) {
+            return pos;
+        }
+
+        pos = (pos + 1) & h->mask;
+        dist++;
     }
+}
 
-    return NULL;
+/* take the slot of any entry nearer to its home than the one at hand, and carry that on */
+static inline void __hash_insert(hash_handle h, hash_key_t key, void *value)
+{
+    struct __hash_entry cur = { .key = key, .value = value, .dist = 1 };
+    struct __hash_entry tmp;
+    size_t pos = __hash_home(h, key);
+
+    for(;;) {
+        if(h->slots[pos].dist == 0) {
+            h->slots[pos] = cur;
+            return;
+        }
+
+        if(h->slots[pos].dist < cur.dist) {
+            tmp = h->slots[pos];
+            h->slots[pos] = cur;
+            cur = tmp;
+        }
+
+        pos = (pos + 1) & h->mask;
+        cur.dist++;
+    }
+}
+
+/* O(n): double the slots */
+static inline int __hash_grow(hash_handle h)
+{
+    struct __hash_entry *old = h->slots;
+    size_t n = h->mask + 1;
+    size_t i;
+
+    ASSERT(h->slots = calloc(n * 2, sizeof(struct __hash_entry)), ({
+            h->slots = old;
+            return FAILURE;}));
+
+    h->mask = n * 2 - 1;
+
+    for(i = 0; i < n; i++) {
+        if(old[i].dist) {
+            __hash_insert(h, old[i].key, old[i].value);
+        }
+    }
+
+    FREE(old);
+    return SUCCESS;
 }
 
 static inline int hash_exist(hash_handle h, hash_key_t key)
 {
-    int pos =  __hash_buf(h->size,key,h->buf_size);
-    return __find_entry(h,pos,key) != NULL;
+    return __hash_find(h, key) >= 0;
 }
 
 static inline void *hash_lookup(hash_handle h, hash_key_t key)
 {
-    int pos =  __hash_buf(h->size,key,h->buf_size);
-    struct __hash_entry *p;
-    return (p = __find_entry(h,pos,key))? p->value : NULL;
+    long pos = __hash_find(h, key);
+    return (pos >= 0) ? h->slots[pos].value : NULL;
 }
-    
+
+/* O(1) amortized. FAILURE when 'key' is there already */
 static inline int hash_add(hash_handle h, hash_key_t key, void *val)
 {
-    struct __hash_entry *p;
-    int pos =  __hash_buf(h->size,key,h->buf_size);
-
-    ASSERT(p = __new_hash_entry(key,val), 
+    MUST(__hash_find(h, key) < 0,
         return FAILURE);
-    
-    list_add(&(h->pool[pos]), &p->list_entry);
+
+    if((h->num_items + 1) * 4 > (h->mask + 1) * 3) {
+        ASSERT(__hash_grow(h) == SUCCESS,
+            return FAILURE);
+    }
+
+    __hash_insert(h, key, val);
 
     h->num_items += 1;
     return SUCCESS;
 }
 
+/* O(1) expected. the entries after it move back a slot, so that no tombstone is left */
 static inline int hash_del(hash_handle h, hash_key_t key)
 {
-    struct __hash_entry *p;
-    int pos =  __hash_buf(h->size,key,h->buf_size);
+    long pos = __hash_find(h, key);
+    size_t i, next;
 
-    MUST((p = __find_entry(h,pos,key)) != NULL,
+    MUST(pos >= 0,
         return FAILURE);
 
-    MUST(list_del(&(h->pool[pos]), &p->list_entry) == SUCCESS,
-        return FAILURE);
+    for(i = pos; ; i = next) {
+        next = (i + 1) & h->mask;
+
+        if(h->slots[next].dist <= 1) {
+            break;
+        }
+
+        h->slots[i] = h->slots[next];
+        h->slots[i].dist--;
+    }
+
+    h->slots[i].dist = 0;
 
     h->num_items -= 1;
 
     return SUCCESS;
 }
 
-static inline hash_key_t __hash_buf(int size, hash_key_t key, size_t buf_size)
-{
-    hash_key_t v=(key / buf_size) % size;
-    return  v;
-}
-
 #ifdef __cplusplus
 }
 #endif
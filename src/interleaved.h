@@ -0,0 +1,267 @@
+#ifndef _RTSP_INTERLEAVED_H
+#define _RTSP_INTERLEAVED_H
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <errno.h>
+#include "common.h"
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+/******************************************************************************
+ *              DEFINITIONS
+ ******************************************************************************/
+#define __INTERLEAVED_HDR_SIZE 4    /* '$', channel, 16 bit length */
+#define __INTERLEAVED_IOV_MAX 1024  /* UIO_MAXIOV */
+
+/******************************************************************************
+ *              DATA STRUCTURES
+ ******************************************************************************/
+/* bytes accepted for the rtsp tcp connection, but not taken by the socket yet. RTSP responses
+   and '$' framed packets go through the same ring, so that none cuts into another */
+struct interleaved_ring_t {
+    pthread_mutex_t mutex;
+    char *buf;
+    size_t cap;
+    size_t head;    /* first byte unsent is buf[head % cap] */
+    size_t tail;    /* both grow, and rewind once the ring is empty */
+};
+
+/******************************************************************************
+ *              DECLARATIONS
+ ******************************************************************************/
+static inline struct interleaved_ring_t *interleaved_ring_create(size_t cap);
+static inline void interleaved_ring_delete(struct interleaved_ring_t *r);
+static inline void interleaved_lock(struct interleaved_ring_t *r);
+static inline void interleaved_unlock(struct interleaved_ring_t *r);
+static inline size_t interleaved_room(struct interleaved_ring_t *r);
+static inline int interleaved_flush(struct interleaved_ring_t *r, int fd);
+static inline int interleaved_send(struct interleaved_ring_t *r, int fd, const struct iovec *iov, int iovcnt);
+static inline int interleaved_send_records(struct interleaved_ring_t *r, int fd, const struct iovec *iov, int iovcnt,
+        int per, size_t reserve);
+
+/******************************************************************************
+ *              INLINE FUNCTIONS
+ ******************************************************************************/
+static inline struct interleaved_ring_t *interleaved_ring_create(size_t cap)
+{
+    struct interleaved_ring_t *nh = NULL;
+
+    TALLOC(nh, return NULL);
+
+    ASSERT(nh->buf = malloc(cap), ({
+                FREE(nh);
+                return NULL;}));
+
+    pthread_mutex_init(&nh->mutex, NULL);
+    nh->cap = cap;
+
+    return nh;
+}
+
+static inline void interleaved_ring_delete(struct interleaved_ring_t *r)
+{
+    if(r) {
+        pthread_mutex_destroy(&r->mutex);
+        FREE(r->buf);
+        FREE(r);
+    }
+}
+
+static inline void interleaved_lock(struct interleaved_ring_t *r)
+{
+    pthread_mutex_lock(&r->mutex);
+}
+
+static inline void interleaved_unlock(struct interleaved_ring_t *r)
+{
+    pthread_mutex_unlock(&r->mutex);
+}
+
+/* O(1). call with the lock held */
+static inline size_t interleaved_room(struct interleaved_ring_t *r)
+{
+    return r->cap - (r->tail - r->head);
+}
+
+/* O(n): copy 'iov' past its first 'skip' bytes to the ring. the caller made sure it fits */
+static inline void __interleaved_put(struct interleaved_ring_t *r, const struct iovec *iov, int iovcnt, size_t skip)
+{
+    const char *src;
+    size_t len;
+    size_t off;
+    size_t n;
+    int i;
+
+    for(i = 0; i < iovcnt; i++) {
+        if(skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+
+        src = (const char *)iov[i].iov_base + skip;
+        len = iov[i].iov_len - skip;
+        skip = 0;
+
+        while(len > 0) {
+            off = r->tail % r->cap;
+            n = min(len, r->cap - off);
+
+            memcpy(r->buf + off, src, n);
+
+            r->tail += n;
+            src += n;
+            len -= n;
+        }
+    }
+}
+
+/* push the ring to the non-blocking socket until it would block. FAILURE when the peer
+   has gone. call with the lock held */
+static inline int interleaved_flush(struct interleaved_ring_t *r, int fd)
+{
+    struct iovec iov[2];
+    struct msghdr msg = {};
+    size_t off;
+    size_t len;
+    ssize_t n;
+
+    while(r->tail > r->head) {
+        off = r->head % r->cap;
+        len = r->tail - r->head;
+
+        /* the used part wraps at most once */
+        iov[0].iov_base = r->buf + off;
+        iov[0].iov_len = min(len, r->cap - off);
+        iov[1].iov_base = r->buf;
+        iov[1].iov_len = len - iov[0].iov_len;
+
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iov[1].iov_len ? 2 : 1;
+
+        n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if(n < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                return SUCCESS;
+            }
+
+            return FAILURE;
+        }
+
+        r->head += n;
+    }
+
+    /* rewind to keep writes contiguous */
+    r->head = r->tail = 0;
+
+    return SUCCESS;
+}
+
+/* the bytes of 'iov' the socket took past what the ring holds. none unless the ring drained.
+   FAILURE when the peer has gone */
+static inline ssize_t __interleaved_direct(struct interleaved_ring_t *r, int fd, const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg = {};
+    ssize_t n = 0;
+
+    if(r->tail > r->head && interleaved_flush(r, fd) != SUCCESS) {
+        return FAILURE;
+    }
+
+    if(r->tail == r->head) {
+        msg.msg_iov = (struct iovec *)iov;
+        msg.msg_iovlen = iovcnt;
+
+        do {
+            n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while(n < 0 && errno == EINTR);
+
+        if(n < 0) {
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                return FAILURE;
+            }
+            n = 0;
+        }
+    }
+
+    return n;
+}
+
+/* O(n): hand 'iov' to the socket after what the ring holds. it goes out directly when the ring
+   is empty, and only what the socket did not take is copied. the caller holds the lock and
+   made sure of interleaved_room(). FAILURE when the peer has gone */
+static inline int interleaved_send(struct interleaved_ring_t *r, int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    DASSERT(iovcnt <= __INTERLEAVED_IOV_MAX, return FAILURE);
+
+    if((n = __interleaved_direct(r, fd, iov, iovcnt)) < 0) {
+        return FAILURE;
+    }
+
+    __interleaved_put(r, iov, iovcnt, n);
+
+    return SUCCESS;
+}
+
+/* O(n): same as interleaved_send(), but 'iov' is a run of records of 'per' iovecs each, and
+   the ring keeps 'reserve' bytes free. a record the socket has started is queued to its end, 
+   and the records after the first that does not fit are left out. returns how many records 
+   were taken, or FAILURE when the peer has gone */
+static inline int interleaved_send_records(struct interleaved_ring_t *r, int fd, const struct iovec *iov, int iovcnt,
+        int per, size_t reserve)
+{
+    size_t room;
+    size_t skip;
+    size_t len;
+    ssize_t n;
+    int i, j;
+
+    DASSERT(iovcnt <= __INTERLEAVED_IOV_MAX, return FAILURE);
+    DASSERT(per > 0 && iovcnt % per == 0, return FAILURE);
+
+    if((n = __interleaved_direct(r, fd, iov, iovcnt)) < 0) {
+        return FAILURE;
+    }
+
+    room = interleaved_room(r);
+    room = room > reserve ? room - reserve : 0;
+    skip = n;
+
+    for(i = 0; i < iovcnt; i += per) {
+        for(len = 0, j = i; j < i + per; j++) {
+            len += iov[j].iov_len;
+        }
+
+        if(skip >= len) {
+            skip -= len;
+            continue;
+        }
+
+        /* the socket has the head of the record. the ring was empty, so its tail fits */
+        if(skip == 0 && len > room) {
+            break;
+        }
+
+        room -= min(room, len - skip);
+        skip = 0;
+    }
+
+    __interleaved_put(r, iov, i, n);
+
+    return i / per;
+}
+
+#if defined (__cplusplus)
+}
+#endif
+#endif
@@ -0,0 +1,261 @@
+#include "common.h"
+#include "nal.h"
+
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined (__x86_64__) || defined (__i386__)
+#include <immintrin.h>
+#define __NAL_HAVE_AVX2
+#endif
+
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/******************************************************************************
+ *              PRIVATE DEFINITIONS
+ ******************************************************************************/
+typedef size_t (*__nal_finder_fxn)(const unsigned char *p, size_t from, size_t len);
+
+/******************************************************************************
+ *              PRIVATE FUNCTIONS
+ ******************************************************************************/
+/* portable: let memchr() (vectorized by libc) hunt for the 0x01 byte, then look back */
+static size_t __find_sc_memchr(const unsigned char *p, size_t from, size_t len)
+{
+    const unsigned char *q;
+    size_t i = from;
+    size_t j;
+
+    while (i + 3 <= len) {
+        if (!(q = memchr(p + i + 2, 0x01, len - i - 2))) {
+            break;
+        }
+
+        j = q - p;
+
+        if (p[j - 1] == 0x00 && p[j - 2] == 0x00) {
+            return j - 2;
+        }
+
+        /* next 0x01 must come after this one */
+        i = j - 1;
+    }
+
+    return len;
+}
+
+#if defined (__SSE2__)
+static size_t __find_sc_sse2(const unsigned char *p, size_t from, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a, b, c;
+    size_t i = from;
+    int mask;
+
+    /* compare 16 positions at once: p[i] == 0, p[i+1] == 0, p[i+2] == 1 */
+    while (i + 18 <= len) {
+        a = _mm_loadu_si128((const __m128i *)(p + i));
+        b = _mm_loadu_si128((const __m128i *)(p + i + 1));
+        c = _mm_loadu_si128((const __m128i *)(p + i + 2));
+
+        mask = _mm_movemask_epi8(_mm_and_si128(_mm_and_si128(
+                        _mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)), _mm_cmpeq_epi8(c, one)));
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+
+        i += 16;
+    }
+
+    return __find_sc_memchr(p, i, len);
+}
+#endif
+
+#if defined (__NAL_HAVE_AVX2)
+__attribute__((target("avx2")))
+static size_t __find_sc_avx2(const unsigned char *p, size_t from, size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    __m256i a, b, c;
+    size_t i = from;
+    unsigned int mask;
+
+    while (i + 34 <= len) {
+        a = _mm256_loadu_si256((const __m256i *)(p + i));
+        b = _mm256_loadu_si256((const __m256i *)(p + i + 1));
+        c = _mm256_loadu_si256((const __m256i *)(p + i + 2));
+
+        mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(
+                        _mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero)), _mm256_cmpeq_epi8(c, one)));
+
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+
+        i += 32;
+    }
+
+    return __find_sc_memchr(p, i, len);
+}
+#endif
+
+#if defined (__ARM_NEON) || defined (__ARM_NEON__)
+static size_t __find_sc_neon(const unsigned char *p, size_t from, size_t len)
+{
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+    uint8x16_t a, b, c, m;
+    uint64x2_t m64;
+    size_t i = from;
+
+    while (i + 18 <= len) {
+        a = vld1q_u8(p + i);
+        b = vld1q_u8(p + i + 1);
+        c = vld1q_u8(p + i + 2);
+
+        m = vandq_u8(vandq_u8(vceqq_u8(a, zero), vceqq_u8(b, zero)), vceqq_u8(c, one));
+        m64 = vreinterpretq_u64_u8(m);
+
+        if (vgetq_lane_u64(m64, 0) | vgetq_lane_u64(m64, 1)) {
+            /* hit somewhere in these 16 positions */
+            return __find_sc_memchr(p, i, i + 18);
+        }
+
+        i += 16;
+    }
+
+    return __find_sc_memchr(p, i, len);
+}
+#endif
+
+static inline __nal_finder_fxn __select_finder(void)
+{
+#if defined (__NAL_HAVE_AVX2)
+    if (__builtin_cpu_supports("avx2")) {
+        return __find_sc_avx2;
+    }
+#endif
+#if defined (__SSE2__)
+    return __find_sc_sse2;
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+    return __find_sc_neon;
+#else
+    return __find_sc_memchr;
+#endif
+}
+
+static inline int __nal_table_add(struct nal_table_t *table, signed char *ptr, size_t len)
+{
+    struct nal_unit_t *units;
+    struct nal_unit_t *unit;
+
+    /* empty NALU between adjacent start codes */
+    if (len == 0) return SUCCESS;
+
+    if (table->num == table->cap) {
+        ASSERT(units = realloc(table->units, table->cap * 2 * sizeof(struct nal_unit_t)), return FAILURE);
+        table->units = units;
+        table->cap *= 2;
+    }
+
+    unit = &table->units[table->num];
+    unit->ptr = ptr;
+    unit->len = len;
+    unit->type = ptr[0] & 0x1F;
+    unit->nri = ptr[0] & 0x60;
+    table->num += 1;
+
+    return SUCCESS;
+}
+
+/******************************************************************************
+ *              PUBLIC FUNCTIONS
+ ******************************************************************************/
+int nal_scan(struct nal_table_t *table, signed char *buf, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    __nal_finder_fxn find = __select_finder();
+    size_t i = 0;
+    size_t k;
+    size_t end;
+    size_t start = 0;
+    int open = FALSE;
+
+    DASSERT(table, return FAILURE);
+    DASSERT(buf, return FAILURE);
+
+    table->num = 0;
+
+    while ((k = find(p, i, len)) < len) {
+        i = k + 3;
+
+        if (open) {
+            /* leading zero of a 4-byte start code and trailing_zero_8bits belong to no NALU */
+            end = k;
+            while (end > start && p[end - 1] == 0x00) end--;
+
+            ASSERT(__nal_table_add(table, &buf[start], end - start) == SUCCESS, return FAILURE);
+        }
+
+        start = i;
+        open = TRUE;
+    }
+
+    if (open) {
+        ASSERT(__nal_table_add(table, &buf[start], len - start) == SUCCESS, return FAILURE);
+    }
+
+    return SUCCESS;
+}
+
+int nal_scan_avcc(struct nal_table_t *table, signed char *buf, size_t len, unsigned int length_size)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    size_t i = 0;
+    size_t nal_len;
+    unsigned int j;
+
+    DASSERT(table, return FAILURE);
+    DASSERT(buf, return FAILURE);
+    ASSERT(length_size == 1 || length_size == 2 || length_size == 4, return FAILURE);
+
+    table->num = 0;
+
+    while (i < len) {
+        ASSERT(len - i >= length_size, return FAILURE);
+
+        for (nal_len = 0, j = 0; j < length_size; j++) {
+            nal_len = (nal_len << 8) | p[i++];
+        }
+
+        ASSERT(nal_len <= len - i, return FAILURE);
+
+        ASSERT(__nal_table_add(table, &buf[i], nal_len) == SUCCESS, return FAILURE);
+
+        i += nal_len;
+    }
+
+    return SUCCESS;
+}
+
+int nal_scan_iov(struct nal_table_t *table, const struct iovec *iov, int iovcnt)
+{
+    int i;
+
+    DASSERT(table, return FAILURE);
+    DASSERT(iov || iovcnt == 0, return FAILURE);
+
+    table->num = 0;
+
+    for (i = 0; i < iovcnt; i++) {
+        ASSERT(__nal_table_add(table, iov[i].iov_base, iov[i].iov_len) == SUCCESS, return FAILURE);
+    }
+
+    return SUCCESS;
+}
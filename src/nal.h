@@ -0,0 +1,82 @@
+#ifndef _RTSP_NAL_H
+#define _RTSP_NAL_H
+
+#if defined (__cplusplus)
+extern "C" {
+#endif
+
+#include <sys/uio.h>
+
+#include "common.h"
+
+/******************************************************************************
+ *              DEFINITIONS 
+ ******************************************************************************/
+#define __NAL_TABLE_INITIAL_UNITS 32
+
+/******************************************************************************
+ *              DATA STRUCTURES
+ ******************************************************************************/
+struct nal_unit_t {
+    signed char *ptr;   /* NAL header byte, start code or length prefix excluded */
+    size_t len;
+    unsigned char type; /* nal_unit_type */
+    unsigned char nri;  /* nal_ref_idc, left in place (0x60 mask) */
+};
+
+/* NAL descriptors of an access unit. keeps its capacity among frames */
+struct nal_table_t {
+    struct nal_unit_t *units;
+    int num;
+    int cap;
+};
+
+/******************************************************************************
+ *              DECLARATIONS
+ ******************************************************************************/
+/* O(n): find every start code ('00 00 01' or '00 00 00 01') of 'buf' in one vectorized pass 
+   and describe its NALUs in 'table' */
+int nal_scan(struct nal_table_t *table, signed char *buf, size_t len);
+
+/* O(NALUs): walk AVCC NALUs prefixed by a big endian length of 'length_size' (1, 2 or 4) bytes */
+int nal_scan_avcc(struct nal_table_t *table, signed char *buf, size_t len, unsigned int length_size);
+
+/* O(NALUs): describe NALUs the caller has already split, one per iovec */
+int nal_scan_iov(struct nal_table_t *table, const struct iovec *iov, int iovcnt);
+
+
+static inline struct nal_table_t *nal_table_create(void);
+static inline void nal_table_delete(struct nal_table_t *table);
+
+/******************************************************************************
+ *              INLINE FUNCTIONS
+ ******************************************************************************/
+static inline void nal_table_delete(struct nal_table_t *table)
+{
+    if(table) {
+        FREE(table->units);
+        FREE(table);
+    }
+}
+
+static inline struct nal_table_t *nal_table_create(void)
+{
+    struct nal_table_t *nh = NULL;
+
+    TALLOC(nh, return NULL);
+
+    ASSERT(nh->units = calloc(__NAL_TABLE_INITIAL_UNITS, sizeof(struct nal_unit_t)), goto error);
+
+    nh->cap = __NAL_TABLE_INITIAL_UNITS;
+
+    return nh;
+error:
+    nal_table_delete(nh);
+    return NULL;
+}
+
+#if defined (__cplusplus)
+}
+#endif
+
+#endif
@@ -12,18 +12,43 @@
  ******************************************************************************/
 
 static inline int __rtcp_send_sr(struct connection_item_t *con);
+static inline int __rtcp_send_interleaved(struct connection_item_t *con, void *buf, size_t len);
 
 
 /******************************************************************************
  *              INLINE FUNCTIONS
  ******************************************************************************/
+/* '$' framed on the rtcp channel, behind the packets in the ring. a report that does not fit 
+   is left to the next period */
+static inline int __rtcp_send_interleaved(struct connection_item_t *con, void *buf, size_t len)
+{
+    unsigned char prefix[__INTERLEAVED_HDR_SIZE] = {'$', con->rtcp_channel, (len >> 8) & 0xFF, len & 0xFF};
+    struct iovec iov[2] = {{prefix, sizeof(prefix)}, {buf, len}};
+    int ret;
+
+    interleaved_lock(con->ring);
+
+    ret = interleaved_flush(con->ring, con->client_fd);
+
+    if (ret == SUCCESS && interleaved_room(con->ring) >= sizeof(prefix) + len + __RTSP_TX_BUF_SIZE) {
+        ret = interleaved_send(con->ring, con->client_fd, iov, 2);
+    }
+
+    interleaved_unlock(con->ring);
+
+    TEST(ret == SUCCESS, ({
+                ERR("send:%s\n",strerror(errno));
+                return FAILURE;}));
+
+    return SUCCESS;
+}
+
 static inline int __rtcp_send_sr(struct connection_item_t *con)
 {
     struct timeval tv;
     unsigned int ts_h; 
     unsigned int ts_l; 
     int send_bytes;
-    struct sockaddr_in to_addr;
 
     ASSERT(gettimeofday(&tv,NULL) == 0, return FAILURE);
 
@@ -38,13 +63,19 @@ static inline int __rtcp_send_sr(struct connection_item_t *con)
             psent: htonl(con->rtcp_packet_cnt),
             osent: htonl(con->rtcp_octet)}}};
 
-    to_addr = con->addr;
-    to_addr.sin_port = con->client_port_rtcp;
+    if (con->interleaved) {
+        ASSERT(__rtcp_send_interleaved(con, &rtcp, 36) == SUCCESS, return FAILURE);
+        goto sent;
+    }
 
-    ASSERT((send_bytes = send(con->server_rtcp_fd,&(rtcp),36,0)) == 36, ({
+    /* a shared socket is not connected */
+    ASSERT((send_bytes = sendto(con->server_rtcp_fd,&(rtcp),36,0,
+                    con->udp_shared ? &con->rtcp_peer.sa : NULL,
+                    con->udp_shared ? sizeof(con->rtcp_peer.in) : 0)) == 36, ({
                 ERR("send:%d:%s¥n",send_bytes,strerror(errno));
                 return FAILURE;}));
 
+sent:
     con->rtcp_packet_cnt = 0;
     con->rtcp_octet = 0;
     con->rtcp_tick = con->rtcp_tick_org;
@@ -5,6 +5,8 @@
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <linux/errqueue.h>
 
 #include "rtsp_server.h"
 #include "common.h"
@@ -17,274 +19,744 @@
 #include "rtcp.h"
 #include "bufpool.h"
 #include "mime.h"
+#include "nal.h"
 
 /******************************************************************************
  *              PRIVATE DEFINITIONS
  ******************************************************************************/
-//static void *rtpThrFxn(void *v);
-static inline int __rtp_send_h264(struct nal_rtp_t *rtp, struct list_head_t *trans_list);
-static inline int __rtp_send_eachconnection_h264(struct list_t *e, void *v);
-static inline int __rtp_send_h264(struct nal_rtp_t *rtp, struct list_head_t *trans_list);
-static inline int __rtp_setup_transfer(struct list_t *e, void *v);
-static inline int __transfer_nal(struct list_head_t *trans_list, signed char *nalptr, size_t nalsize);
-static inline int __retrieve_sprop(rtsp_handle h, signed char *buf, size_t len);
+struct __transfer_set_t;
+
+static inline int __rtp_flush_eachconnection_h264(struct connection_item_t *con, struct __transfer_set_t *trans_set);
+static inline int __rtp_flush_interleaved(struct connection_item_t *con, struct __transfer_set_t *trans_set);
+static inline int __rtp_flush_batch(struct connection_item_t *con, struct __transfer_set_t *trans_set);
+static inline int __rtp_gop_burst(struct connection_item_t *con, struct __transfer_set_t *trans_set);
+static inline int __rtp_advance_timestamp(struct connection_item_t *con, struct __transfer_set_t *trans_set);
+static inline int __rtp_zerocopy_poll(struct connection_item_t *con, struct __transfer_set_t *trans_set);
+static inline int __rtcp_poll(struct connection_item_t *con, struct __transfer_set_t *trans_set);
+static inline int __packetize_nal(struct __rtp_batch_t *batch, signed char *nalptr, size_t nalsize);
+static inline int __packetize_frame(struct __rtp_batch_t *batch, struct nal_table_t *nals);
+static inline int __retrieve_sprop(rtsp_handle h, struct nal_table_t *nals);
+
+/* where __rtp_send_frame() finds the NALUs of an access unit */
+struct __frame_src_t {
+    enum rtsp_nal_format_e format;
+    signed char *buf;
+    size_t len;                 /* total bytes, also for 'iov' */
+    const struct iovec *iov;    /* pre-split NALUs when set. 'buf' is unused */
+    int iovcnt;
+    void *owner;    /* of 'buf' till its release, which the GOP cache may take over. NULL when the
+                       caller takes 'buf' back on return */
+};
+
+static inline int __index_frame(struct nal_table_t *nals, struct __frame_src_t *src);
 
 struct __transfer_set_t {
-    struct list_head_t list_head;
+    struct session_snapshot_t *sessions;    /* PLAYING sessions of this frame */
+    int first;      /* ... served here: [first, last) */
+    int last;
     rtsp_handle h;
+    struct __rtp_batch_t *batch;
+    struct __rtp_batch_t *gop_batch;
+    size_t len;
+    int idr;    /* access unit has an IDR slice */
+    struct rtsp_stat_t stat;
 };
 
 /******************************************************************************
  *              PRIVATE FUNCTIONS
  ******************************************************************************/
-
-static inline int __transfer_nal(struct list_head_t *trans_list, signed char *nalptr, size_t nalsize)
+static inline int __packetize_nal(struct __rtp_batch_t *batch, signed char *nalptr, size_t nalsize)
 {
-    struct nal_rtp_t rtp;
     unsigned int nri = nalptr[0] & 0x60;
     unsigned int pt  = nalptr[0] & 0x1F;
-    rtp_hdr_t *p_header = &(rtp.packet.header);
-    signed char *payload = rtp.packet.payload;
-
-    p_header->version = 2;
-    p_header->p = 0;
-    p_header->x = 0;
-    p_header->cc = 0;
-    p_header->pt = 96 & 0x7F;
+    signed char fu[2];
 
     if(nalsize <= __RTP_MAXPAYLOADSIZE){
         /* single packet */
         /* SPS, PPS, SEI is not marked */
-        if(pt != 7 && pt != 8 && pt != 6) { 
-            p_header->m = 1;
-        } else {
-            p_header->m = 0;
-        }
-
-        memcpy(payload, nalptr, nalsize);
-
-        rtp.rtpsize = nalsize + sizeof(rtp_hdr_t);
-
-        ASSERT(__rtp_send_h264(&rtp,trans_list) == SUCCESS, return FAILURE);
+        ASSERT(__rtp_batch_add_payload(batch, (pt != 7 && pt != 8 && pt != 6), 
+                    NULL, 0, nalptr, nalsize) == SUCCESS, return FAILURE);
     }  else  {
 
         nalptr += 1;
         nalsize -= 1;
 
-        payload[0] = 28;
-        payload[0] |= nri;
-        payload[1] = pt;
-        payload[1] |= 1 << 7;
+        /* first fragment has start bit */
+        fu[0] = 28 | nri;
+        fu[1] = pt | (1 << 7);
 
-        /* send fragmented nal */
+        /* fragmented nal */
         while(nalsize > __RTP_MAXPAYLOADSIZE - 2){
 
-            p_header->m = 0;
-
-            memcpy(&(payload[2]), nalptr, __RTP_MAXPAYLOADSIZE - 2);
-
-            rtp.rtpsize = sizeof(rtp_hdr_t) + __RTP_MAXPAYLOADSIZE;
+            ASSERT(__rtp_batch_add_payload(batch, 0, 
+                        fu, 2, nalptr, __RTP_MAXPAYLOADSIZE - 2) == SUCCESS, return FAILURE);
 
             nalptr += __RTP_MAXPAYLOADSIZE - 2;
             nalsize -= __RTP_MAXPAYLOADSIZE - 2;
 
-            ASSERT(__rtp_send_h264(&rtp,trans_list) == SUCCESS, return FAILURE);
-
-            /* intended xor. blame vim :( */
-            payload[1] &= 0xFF ^ (1<<7); 
+            fu[1] = pt;
         }
 
-        /* send trailing nal */
-        p_header->m = 1;
-
-        payload[1] |= 1 << 6;
+        /* trailing nal has end bit */
+        fu[1] = pt | (1 << 6);
 
-        /* intended xor. blame vim :( */
-        payload[1] &= 0xFF ^ (1<<7);
+        ASSERT(__rtp_batch_add_payload(batch, 1, 
+                    fu, 2, nalptr, nalsize) == SUCCESS, return FAILURE);
+    }
 
-        rtp.rtpsize = nalsize + sizeof(rtp_hdr_t);
+    return SUCCESS;
+}
 
-        memcpy(&(payload[2]), nalptr, nalsize);
+/* O(n): the whole access unit, NALU by NALU */
+static inline int __packetize_frame(struct __rtp_batch_t *batch, struct nal_table_t *nals)
+{
+    struct nal_unit_t *nal;
+    int i;
 
-        ASSERT(__rtp_send_h264(&rtp, trans_list) == SUCCESS, return FAILURE);
+    for (i = 0; i < nals->num; i++) {
+        nal = &nals->units[i];
 
+        ASSERT(__packetize_nal(batch,nal->ptr,nal->len) == SUCCESS, return FAILURE);
     }
 
     return SUCCESS;
 }
 
-static inline int __rtp_send_eachconnection_h264(struct list_t *e, void *v)
+/* the connection could not take the rest of the frame. drop it for this connection only,
+   and keep dropping until the next IDR so that the decoder resyncs on a clean picture */
+static inline int __rtp_drop(struct connection_item_t *con, struct __transfer_set_t *trans_set, int packets, int ret)
 {
-    int send_bytes;
-    struct connection_item_t *con;
-    struct transfer_item_t *trans;
-    struct nal_rtp_t *rtp = v;
+    if(con->con_state != __CON_S_PLAYING) {
+        DBG("connection state changed before send\n");
+        return SUCCESS;
+    }
 
-    list_upcast(trans,e); 
+    if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)){
+        trans_set->stat.congestions += 1;
+    } else {
+        ERR("sendmmsg:%d:%s\n",ret,strerror(errno));
+    }
 
-    MUST(con = trans->con, return FAILURE);
+    con->wait_idr = TRUE;
+    con->drop_frames += 1;
+    con->drop_packets += packets;
 
-    rtp->packet.header.seq = htons(con->rtp_seq);
-    rtp->packet.header.ts = htonl(con->rtp_timestamp);
-    rtp->packet.header.ssrc = htonl(con->ssrc);
-    con->rtp_seq += 1;
+    trans_set->stat.dropped_frames += 1;
+    trans_set->stat.dropped_packets += packets;
 
-    send_bytes = send(con->server_rtp_fd,&(rtp->packet),rtp->rtpsize,0);
-    
-    if(send_bytes == rtp->rtpsize) {
-        con->rtcp_packet_cnt += 1;
-        con->rtcp_octet += rtp->rtpsize;
-        return SUCCESS;
-    } 
+    return SUCCESS;
+}
 
-    if(con->con_state != __CON_S_PLAYING) {
-        DBG("connection state changed before send\n");
-        return SUCCESS;
+static inline void __rtp_account(struct connection_item_t *con, struct __transfer_set_t *trans_set, 
+        int packets, unsigned int octets, int flags)
+{
+    con->rtcp_packet_cnt += packets;
+    con->rtcp_octet += octets;
+    trans_set->stat.packets += packets;
+
+    if(flags & MSG_ZEROCOPY) {
+        /* the kernel numbers each zerocopy message per socket */
+        con->zc_issued += 1;
+        trans_set->stat.zerocopy_sends += 1;
     }
-
-    if(send_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)){
-        ERR("EAGAIN\n");
-        return FAILURE;
-    } 
-    
-    ERR("send:%d:%s\n",send_bytes,strerror(errno));
-    return FAILURE;
 }
 
-static inline int __rtp_send_h264(struct nal_rtp_t *rtp, struct list_head_t *trans_list)
+/* MSG_ZEROCOPY pins the headers until completion, so the connection needs its own */
+static inline int __rtp_zerocopy_headers(struct connection_item_t *con, int num)
 {
-    return list_map_inline(trans_list,(__rtp_send_eachconnection_h264), rtp);
+    rtp_hdr_t *headers;
+
+    if(con->zc_headers_cap < num) {
+        ASSERT(headers = realloc(con->zc_headers, num * sizeof(rtp_hdr_t)), return FAILURE);
+        con->zc_headers = headers;
+        con->zc_headers_cap = num;
+    }
+
+    return SUCCESS;
 }
 
+/* a session that has just started catches up from the GOP cache first */
+static inline int __rtp_flush_eachconnection_h264(struct connection_item_t *con, struct __transfer_set_t *trans_set)
+{
+    if(con->gop_pos >= 0) {
+        return __rtp_gop_burst(con, trans_set);
+    }
+
+    return __rtp_flush_batch(con, trans_set);
+}
 
-static inline int __rtp_setup_transfer(struct list_t *e, void *v)
+/* O(cached frames): replay the GOP from its IDR with the same seq/ts line as the live frames.
+   at most half of 'send_queue_depth' packets a frame, so the burst itself is not dropped. 
+   the live frame is the last cached one, so reaching the end joins the live feed */
+static inline int __rtp_gop_burst(struct connection_item_t *con, struct __transfer_set_t *trans_set)
 {
-    struct connection_item_t *con;
-    struct __transfer_set_t *trans_set = v;
-    struct transfer_item_t *trans;
-    unsigned int  timestamp_offset;
-    int ret = FAILURE;
+    rtsp_handle h = trans_set->h;
+    struct gop_cache_t *gop = h->gop;
+    struct gop_frame_t *f;
+    struct nal_unit_t *nal;
+    struct __transfer_set_t sub = {sessions: trans_set->sessions, h: h, batch: trans_set->gop_batch, stat: trans_set->stat};
+    unsigned int budget = max(h->attr.send_queue_depth / 2, 1);
+    unsigned int sent = 0;
+    int ret = SUCCESS;
+    int i;
+
+    /* a new GOP began since. it starts with the live frame */
+    if(con->gop_gen != gop->gen) {
+        con->gop_pos = 0;
+        con->gop_gen = gop->gen;
+    }
 
-    list_upcast(con,e);
+    /* no whole GOP to start from. join live and wait for the next IDR */
+    if(!gop->open || con->gop_pos >= gop->num) {
+        if(con->gop_pos == 0) {
+            trans_set->stat.gop_misses += 1;
+        }
+        con->gop_pos = -1;
+        con->wait_idr = TRUE;
+        __rtp_advance_timestamp(con, trans_set);
+        return __rtp_flush_batch(con, trans_set);
+    }
 
-    MUST(bufpool_attach(con->pool, con) == SUCCESS,
-        return FAILURE);
+    if(con->gop_pos == 0) {
+        sub.stat.gop_starts += 1;
+    }
 
-    if(con->con_state == __CON_S_PLAYING) {
+    while(ret == SUCCESS && con->gop_pos < gop->num && sent < budget) {
+        f = &gop->frames[con->gop_pos++];
 
-        ASSERT(bufpool_get_free(trans_set->h->transfer_pool, &trans) == SUCCESS, ({
-            ERR("transfer object resouce starvation detected. possibly connection limits are wrongfully setup\n");
-            goto error;}));
+        __rtp_batch_reset(sub.batch);
 
-        MUST(bufpool_attach(con->pool, con) == SUCCESS,
-            return FAILURE);
+        for(i = 0; i < f->num && ret == SUCCESS; i++) {
+            nal = &gop->nals->units[f->first + i];
+            ASSERT(__packetize_nal(sub.batch, nal->ptr, nal->len) == SUCCESS, ret = FAILURE);
+        }
+
+        if(ret != SUCCESS) {
+            break;
+        }
 
-        trans->con = con;
+        __rtp_batch_prepare(sub.batch);
 
-        MUST(list_push(&trans_set->list_head,&trans->list_entry) == SUCCESS,
-            goto error);
+        con->rtp_timestamp += f->ts_delta;
+        /* never zerocopy: the connection stamps its headers again before completion */
+        sub.len = 0;
+        sub.idr = f->idr;
 
-        timestamp_offset = trans_set->h->stat.ts_offset;
+        ret = __rtp_flush_batch(con, &sub);
 
-        con->rtp_timestamp = ((unsigned int)con->rtp_timestamp + timestamp_offset);
+        sent += sub.batch->num;
+        sub.stat.gop_frames += 1;
     }
 
-    ret = SUCCESS;
+    if(con->gop_pos >= gop->num) {
+        sub.stat.gop_catchups += 1;
+        con->gop_pos = -1;
+    }
 
-error:
-    ASSERT(bufpool_detach(con->pool, con) == SUCCESS, ret = FAILURE);
+    trans_set->stat = sub.stat;
 
     return ret;
 }
 
-static inline int __retrieve_sprop(rtsp_handle h, signed char *buf, size_t len)
+/* stamp headers for the connection, then push the whole batch by sendmmsg(),
+   as GSO super-buffers when the socket allows. never fails on a congested or
+   gone client: the frame is dropped for that connection only */
+static inline int __rtp_flush_batch(struct connection_item_t *con, struct __transfer_set_t *trans_set)
 {
-    signed char *nalptr;
-    size_t single_len;
-    mime_encoded_handle base64 = NULL;
-    mime_encoded_handle base16 = NULL;
-    unsigned int pt;
-    
-    /* check SPS is set */
-    if(!(h->sprop_sps_b64)){ 
-        nalptr = buf;
-        single_len = 0;
-
-        while (__split_nal(buf,&nalptr,&single_len,len) == SUCCESS) {
-            pt = nalptr[0] & 0x1F;
-            if(pt == H264_NAL_TYPE_SPS) {
-                ASSERT(base64 = mime_base64_create((char *)&(nalptr[0]),single_len), return FAILURE);
-                ASSERT(base16 = mime_base16_create((char *)&(nalptr[1]),3), return FAILURE);
-
-                DASSERT(base16->base == 16, return FAILURE);
-                DASSERT(base64->base == 64, return FAILURE);
-
-                /* optimistic lock */
-                rtsp_lock(h);
-                if(h->sprop_sps_b64) {
-                    DBG("sps is set by another thread?\n");
-                    mime_encoded_delete(base64);
-                } else {
-                    h->sprop_sps_b64 = base64;
-                }
-                
-                if(h->sprop_sps_b16) {
-                    DBG("sps is set by another thread?\n");
-                    mime_encoded_delete(base16);
-                } else {
-                    h->sprop_sps_b16 = base16;
+    int i;
+    int sent = 0;
+    int pushed = 0;
+    int ret;
+    int flags = 0;
+    struct __rtp_batch_t *batch = trans_set->batch;
+    rtp_hdr_t *headers = batch->headers;
+    rtp_hdr_t tmpl = {version: 2, p: 0, x: 0, cc: 0, pt: 96 & 0x7F, m: 0};
+
+    if((con->tx_caps & RTSP_TX_ZEROCOPY) && trans_set->len >= trans_set->h->attr.zerocopy_threshold) {
+        ASSERT(__rtp_zerocopy_headers(con, batch->num) == SUCCESS, return FAILURE);
+        headers = con->zc_headers;
+        flags |= MSG_ZEROCOPY;
+    }
+
+    if(con->wait_idr) {
+        if(!trans_set->idr) {
+            /* sequence still advances so that the receiver sees the loss */
+            con->rtp_seq += batch->num;
+            con->drop_frames += 1;
+            con->drop_packets += batch->num;
+            trans_set->stat.dropped_frames += 1;
+            trans_set->stat.dropped_packets += batch->num;
+            return SUCCESS;
+        }
+
+        trans_set->stat.resyncs += 1;
+        con->wait_idr = FALSE;
+    }
+
+    tmpl.ts = htonl(con->rtp_timestamp);
+    tmpl.ssrc = htonl(con->ssrc);
+
+    con->rtp_seq = __rtp_batch_stamp(batch, headers, &tmpl, con->rtp_seq);
+
+    if(con->interleaved) {
+        return __rtp_flush_interleaved(con, trans_set);
+    }
+
+    __rtp_batch_address(batch, con->udp_shared ? &con->rtp_peer.in : NULL);
+
+    /* gso plan is worth only when some FU-A run is gathered. zerocopy pins every vector
+       as a page fragment, so a super-buffer would overflow MAX_SKB_FRAGS (EMSGSIZE) */
+    if((con->tx_caps & RTSP_TX_GSO) && !(flags & MSG_ZEROCOPY) && batch->gso_num < batch->num) {
+        while(sent < batch->gso_num) {
+            ret = sendmmsg(con->server_rtp_fd, &(batch->gso_msgs[sent]), 
+                    min(batch->gso_num - sent, __RTP_SENDMMSG_MAX), flags);
+
+            trans_set->stat.send_calls += 1;
+
+            if(ret == -1 && (errno == EIO || errno == EINVAL || errno == EMSGSIZE)) {
+                /* segmentation refused on this route, or segments above its MTU as a 
+                   real interface may have. rest goes by plain path */
+                ERR("GSO refused:%s\n",strerror(errno));
+                con->tx_caps &= ~RTSP_TX_GSO;
+                break;
+            }
+
+            if(ret <= 0) return __rtp_drop(con, trans_set, batch->num - pushed, ret);
+
+            for(i = sent; i < sent + ret; i++) {
+                __rtp_account(con, trans_set, batch->gso_counts[i], batch->gso_msgs[i].msg_len, flags);
+
+                if(batch->gso_counts[i] > 1) {
+                    trans_set->stat.gso_sends += 1;
                 }
-                rtsp_unlock(h);
+
+                pushed += batch->gso_counts[i];
             }
 
+            sent += ret;
+        }
+    }
+
+    sent = pushed;
+
+    while(sent < batch->num) {
+        ret = sendmmsg(con->server_rtp_fd, &(batch->msgs[sent]), 
+                min(batch->num - sent, __RTP_SENDMMSG_MAX), flags);
+
+        trans_set->stat.send_calls += 1;
+
+        if(ret <= 0) return __rtp_drop(con, trans_set, batch->num - sent, ret);
+
+        for(i = sent; i < sent + ret; i++) {
+            __rtp_account(con, trans_set, 1, batch->msgs[i].msg_len, flags);
+        }
+
+        sent += ret;
+    }
+
+    return SUCCESS;
+}
+
+/* '$' framed packets over the rtsp connection. the sender never blocks on a slow client and
+   no packet is cut. with a backlog in the ring the frame goes there as a whole or is dropped.
+   without, the socket takes what it can and the rest is queued while it fits, so a frame 
+   larger than the ring still goes out. room for the responses of the rtsp thread is kept aside */
+static inline int __rtp_flush_interleaved(struct connection_item_t *con, struct __transfer_set_t *trans_set)
+{
+    struct __rtp_batch_t *batch = trans_set->batch;
+    unsigned int octets = 0;
+    int sent;
+    int num;
+    int ret;
+    int i;
+
+    if(!batch->tcp_ready) {
+        __rtp_batch_prepare_tcp(batch);
+    }
+
+    for(i = 0; i < batch->num; i++) {
+        batch->tcp_prefixes[i * __INTERLEAVED_HDR_SIZE + 1] = con->rtp_channel;
+    }
+
+    interleaved_lock(con->ring);
+
+    ret = interleaved_flush(con->ring, con->client_fd);
+
+    if(ret == SUCCESS && con->ring->tail > con->ring->head 
+            && interleaved_room(con->ring) < batch->tcp_len + __RTSP_TX_BUF_SIZE) {
+        errno = ENOBUFS;
+        ret = FAILURE;
+    }
+
+    for(sent = 0; ret == SUCCESS && sent < batch->num; sent += num) {
+        num = min(batch->num - sent, __INTERLEAVED_IOV_MAX / 4);
+        ret = interleaved_send_records(con->ring, con->client_fd, &(batch->tcp_iovs[sent * 4]), num * 4, 
+                4, __RTSP_TX_BUF_SIZE);
+
+        trans_set->stat.send_calls += 1;
+
+        if(ret < 0) {
+            break;
+        }
+
+        if(ret < num) {
+            /* the rest of the frame does not fit */
+            sent += ret;
+            errno = ENOBUFS;
+            ret = FAILURE;
+            break;
         }
 
-        base64 = NULL;
-        base16 = NULL;
+        ret = SUCCESS;
     }
 
-    /* check PPS is set */
-    if(!(h->sprop_pps_b64)){
-        nalptr = buf;
-        single_len = 0;
-        while (__split_nal(buf,&nalptr,&single_len,len) == SUCCESS) {
-            pt = nalptr[0] & 0x1F;
+    interleaved_unlock(con->ring);
 
-            if(pt == H264_NAL_TYPE_PPS) {
-                ASSERT(single_len >= 4, return FAILURE);
-                ASSERT(base64 = mime_base64_create((char *)&(nalptr[0]),single_len), return FAILURE);
+    for(i = 0; i < sent * 4; i++) {
+        octets += batch->tcp_iovs[i].iov_len;
+    }
 
-                DASSERT(base64->base == 64, return FAILURE);
+    if(ret != SUCCESS) {
+        __rtp_account(con, trans_set, sent, octets - sent * __INTERLEAVED_HDR_SIZE, 0);
+        return __rtp_drop(con, trans_set, batch->num - sent, ret);
+    }
 
-                /* optimistic lock */
-                rtsp_lock(h);
-                if(h->sprop_pps_b64) {
-                    DBG("pps is set by another thread?\n");
-                    mime_encoded_delete(base64);
-                } else {
-                    h->sprop_pps_b64 = base64;
-                }
-                rtsp_unlock(h);
+    __rtp_account(con, trans_set, batch->num, batch->tcp_len - batch->num * __INTERLEAVED_HDR_SIZE, 0);
+
+    return SUCCESS;
+}
+
+/* wait until the kernel released every MSG_ZEROCOPY buffer of the connection,
+   since the caller takes its frame back when we return. completions that are late
+   still come, so a timeout only turns zerocopy off for the connection. those lost for
+   good must not hold the other sessions, so the wait is bounded: the kernel keeps its
+   own references to the pages, and the connection resyncs on the next IDR in case the
+   caller writes over them */
+static inline int __rtp_zerocopy_poll(struct connection_item_t *con, struct __transfer_set_t *trans_set)
+{
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    struct msghdr msg;
+    struct pollfd pfd;
+    struct timespec now;
+    char control[128];
+    unsigned int range;
+    long long deadline = 0;
+    long long now_ms;
+
+    while((int)(con->zc_issued - con->zc_completed) > 0) {
+        CLEAR(msg);
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if(recvmsg(con->server_rtp_fd, &msg, MSG_ERRQUEUE) == -1) {
+            ASSERT(errno == EAGAIN || errno == EWOULDBLOCK, ({
+                        ERR("recvmsg:%s\n",strerror(errno));
+                        return FAILURE;}));
+
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            now_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+
+            if(deadline == 0) {
+                deadline = now_ms + __RTP_ZEROCOPY_GIVEUP_MS;
+            }
+
+            if(now_ms >= deadline) {
+                ERR("zerocopy completions lost (%u pending). given up\n", 
+                        con->zc_issued - con->zc_completed);
+                con->tx_caps &= ~RTSP_TX_ZEROCOPY;
+                con->zc_completed = con->zc_issued;
+                con->wait_idr = TRUE;
+                break;
+            }
+
+            /* error queue readiness is always reported as POLLERR */
+            pfd.fd = con->server_rtp_fd;
+            pfd.events = 0;
+
+            if(poll(&pfd, 1, min(deadline - now_ms, __RTP_ZEROCOPY_TIMEOUT_MS)) == 0 && (con->tx_caps & RTSP_TX_ZEROCOPY)) {
+                ERR("zerocopy completion timeout (%u pending). copying from now on\n", 
+                        con->zc_issued - con->zc_completed);
+                con->tx_caps &= ~RTSP_TX_ZEROCOPY;
+            }
+            continue;
+        }
+
+        for(cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+
+            if(serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            /* [ee_info, ee_data] is the range of completed messages */
+            range = serr->ee_data - serr->ee_info + 1;
+            con->zc_completed += range;
+
+            if(serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                trans_set->stat.zerocopy_copied += range;
             }
         }
-        rtsp_lock(h);
-        rtsp_unlock(h);
-        base64 = NULL;
     }
 
     return SUCCESS;
 }
 
-static inline int __rtcp_poll(struct list_t *e, void *v)
+/* O(n): 'nal' is no longer the parameter set published as 'cur' */
+static inline int __sprop_changed(const struct nal_unit_t *cur, const struct nal_unit_t *nal)
 {
-    struct connection_item_t *con;
-    struct transfer_item_t *trans;
+    return cur->len != nal->len || memcmp(cur->ptr, nal->ptr, nal->len) != 0;
+}
 
-    list_upcast(trans, e);
-    MUST(con = trans->con, return FAILURE);
-    
+/* O(n): a copy of 'nal' to 'copy', to be swapped in by __sprop_exchange() */
+static inline int __sprop_copy(struct nal_unit_t *copy, const struct nal_unit_t *nal)
+{
+    *copy = *nal;
+    ASSERT(copy->ptr = malloc(nal->len), return FAILURE);
+    memcpy(copy->ptr, nal->ptr, nal->len);
+
+    return SUCCESS;
+}
+
+/* O(1): swap the parameter sets of the handle with 'sps' and its encodings, 'pps' and its
+   encoding, those that are given. twice undoes it. rtsp lock */
+static inline void __sprop_exchange(rtsp_handle h, struct nal_unit_t *sps, mime_encoded_handle *sps_b64,
+        mime_encoded_handle *sps_b16, struct nal_unit_t *pps, mime_encoded_handle *pps_b64)
+{
+    struct nal_unit_t unit;
+    mime_encoded_handle old;
+
+    if(sps) {
+        unit = h->sprop_sps;
+        h->sprop_sps = *sps;
+        *sps = unit;
+
+        old = h->sprop_sps_b64;
+        h->sprop_sps_b64 = *sps_b64;
+        *sps_b64 = old;
+
+        old = h->sprop_sps_b16;
+        h->sprop_sps_b16 = *sps_b16;
+        *sps_b16 = old;
+    }
+
+    if(pps) {
+        unit = h->sprop_pps;
+        h->sprop_pps = *pps;
+        *pps = unit;
+
+        old = h->sprop_pps_b64;
+        h->sprop_pps_b64 = *pps_b64;
+        *pps_b64 = old;
+    }
+}
+
+/* O(n): the first SPS and PPS of the access unit against those in the SDP. it is published
+   again on any difference. all that can fail is done first, then both sets change together
+   with the SDP, or none does and the next access unit tries again */
+static inline int __retrieve_sprop(rtsp_handle h, struct nal_table_t *nals)
+{
+    struct nal_unit_t *sps = NULL;
+    struct nal_unit_t *pps = NULL;
+    struct nal_unit_t sps_copy = {};
+    struct nal_unit_t pps_copy = {};
+    mime_encoded_handle sps_b64 = NULL;
+    mime_encoded_handle sps_b16 = NULL;
+    mime_encoded_handle pps_b64 = NULL;
+    int ret = FAILURE;
+    int i;
+
+    for (i = 0; i < nals->num; i++) {
+        if(nals->units[i].type == H264_NAL_TYPE_SPS && !sps) {
+            sps = &nals->units[i];
+        }
+
+        if(nals->units[i].type == H264_NAL_TYPE_PPS && !pps) {
+            pps = &nals->units[i];
+        }
+    }
+
+    if(sps && !__sprop_changed(&h->sprop_sps, sps)) {
+        sps = NULL;
+    }
+
+    if(pps && !__sprop_changed(&h->sprop_pps, pps)) {
+        pps = NULL;
+    }
+
+    if(!sps && !pps) {
+        return SUCCESS;
+    }
+
+    if(sps) {
+        ASSERT(sps->len >= 4, goto error);
+        ASSERT(sps_b64 = mime_base64_create((char *)sps->ptr, sps->len), goto error);
+        ASSERT(sps_b16 = mime_base16_create((char *)&(sps->ptr[1]), 3), goto error);
+        ASSERT(__sprop_copy(&sps_copy, sps) == SUCCESS, goto error);
+    }
+
+    if(pps) {
+        ASSERT(pps->len >= 4, goto error);
+        ASSERT(pps_b64 = mime_base64_create((char *)pps->ptr, pps->len), goto error);
+        ASSERT(__sprop_copy(&pps_copy, pps) == SUCCESS, goto error);
+    }
+
+    /* the old ones come back to be freed after */
+    rtsp_lock(h);
+    __sprop_exchange(h, sps ? &sps_copy : NULL, &sps_b64, &sps_b16, pps ? &pps_copy : NULL, &pps_b64);
+    ret = __sdp_publish(h);
+    if(ret != SUCCESS) {
+        __sprop_exchange(h, sps ? &sps_copy : NULL, &sps_b64, &sps_b16, pps ? &pps_copy : NULL, &pps_b64);
+    }
+    rtsp_unlock(h);
+
+    ASSERT(ret == SUCCESS, ERR("sdp is not updated\n"));
+
+error:
+    mime_encoded_delete(sps_b64);
+    mime_encoded_delete(sps_b16);
+    mime_encoded_delete(pps_b64);
+    FREE(sps_copy.ptr);
+    FREE(pps_copy.ptr);
+
+    return ret;
+}
+
+static inline int __index_frame(struct nal_table_t *nals, struct __frame_src_t *src)
+{
+    if(src->iov) {
+        return nal_scan_iov(nals, src->iov, src->iovcnt);
+    }
+
+    switch(src->format) {
+        case RTSP_NAL_ANNEXB:
+            return nal_scan(nals, src->buf, src->len);
+        case RTSP_NAL_AVCC1:
+        case RTSP_NAL_AVCC2:
+        case RTSP_NAL_AVCC4:
+            return nal_scan_avcc(nals, src->buf, src->len, src->format);
+        default:
+            ERR("unknown NAL format %d\n", src->format);
+            return FAILURE;
+    }
+}
+
+/* O(n): call 'fxn' on each session of the frame */
+static inline int __session_map(struct __transfer_set_t *trans_set,
+        int (*fxn)(struct connection_item_t *con, struct __transfer_set_t *trans_set))
+{
+    int i;
+
+    for(i = trans_set->first; i < trans_set->last; i++) {
+        ASSERT(fxn(trans_set->sessions->cons[i], trans_set) == SUCCESS, return FAILURE);
+    }
+
+    return SUCCESS;
+}
+
+/* O(sessions served): the packetized frame to each session of the transfer set */
+static inline int __rtp_deliver(struct __transfer_set_t *trans_set)
+{
+    ASSERT(__session_map(trans_set,(__rtp_advance_timestamp)) == SUCCESS, return FAILURE);
+
+    ASSERT(__session_map(trans_set,(__rtp_flush_eachconnection_h264)) == SUCCESS, return FAILURE);
+
+    ASSERT(__session_map(trans_set,(__rtp_zerocopy_poll)) == SUCCESS, return FAILURE);
+
+    ASSERT(__session_map(trans_set,(__rtcp_poll)) == SUCCESS, return FAILURE);
+
+    return SUCCESS;
+}
+
+static inline void __rtp_add_stat(struct rtsp_stat_t *dst, const struct rtsp_stat_t *src)
+{
+    dst->frames += src->frames;
+    dst->packets += src->packets;
+    dst->send_calls += src->send_calls;
+    dst->gso_sends += src->gso_sends;
+    dst->zerocopy_sends += src->zerocopy_sends;
+    dst->zerocopy_copied += src->zerocopy_copied;
+    dst->dropped_frames += src->dropped_frames;
+    dst->dropped_packets += src->dropped_packets;
+    dst->congestions += src->congestions;
+    dst->resyncs += src->resyncs;
+    dst->gop_starts += src->gop_starts;
+    dst->gop_misses += src->gop_misses;
+    dst->gop_frames += src->gop_frames;
+    dst->gop_catchups += src->gop_catchups;
+    dst->submit_refused += src->submit_refused;
+}
+
+/* publish the frame to the send workers and wait until all of them let go of it, since the 
+   caller takes its buffer back when we return. O(workers) besides the sends */
+static inline int __rtp_fan_out(struct __transfer_set_t *trans_set)
+{
+    rtsp_handle h = trans_set->h;
+    struct __rtp_frame_t *frame = &h->frame;
+    unsigned int i;
+    int ret;
+
+    pthread_mutex_lock(&h->work_mutex);
+
+    /* workers leave only when no frame is waiting for them */
+    if(gbl_get_quit(h->pool->sharedp->gbl)) {
+        pthread_mutex_unlock(&h->work_mutex);
+        return FAILURE;
+    }
+
+    frame->batch = trans_set->batch;
+    frame->sessions = trans_set->sessions;
+    frame->len = trans_set->len;
+    frame->idr = trans_set->idr;
+    frame->ret = SUCCESS;
+    frame->ref_count = h->attr.send_workers;
+    frame->seq += 1;
+
+    pthread_cond_broadcast(&h->work_cond);
+
+    while(frame->ref_count > 0) {
+        pthread_cond_wait(&h->done_cond, &h->work_mutex);
+    }
+
+    ret = frame->ret;
+
+    /* the workers are idle until the next frame */
+    for(i = 0; i < h->attr.send_workers; i++) {
+        __rtp_add_stat(&trans_set->stat, &h->workers[i]->stat);
+        memset(&h->workers[i]->stat, 0, sizeof(struct rtsp_stat_t));
+    }
+
+    pthread_mutex_unlock(&h->work_mutex);
+
+    return ret;
+}
+
+static inline int __rtp_advance_timestamp(struct connection_item_t *con, struct __transfer_set_t *trans_set)
+{
+    /* the burst keeps the time line of the cached frames */
+    if(con->gop_pos >= 0) {
+        return SUCCESS;
+    }
+
+    con->rtp_timestamp = ((unsigned int)con->rtp_timestamp + trans_set->h->stat.ts_offset);
+
+    return SUCCESS;
+}
+
+static inline void __rtp_update_stat(rtsp_handle h, struct rtsp_stat_t *p_stat)
+{
+    rtsp_lock(h);
+    __rtp_add_stat(&h->tx_stat, p_stat);
+    rtsp_unlock(h);
+}
+
+static inline int __rtcp_poll(struct connection_item_t *con, struct __transfer_set_t *trans_set)
+{
     if((con->rtcp_tick)-- == 0) {
-        ASSERT(__rtcp_send_sr(con) == SUCCESS, return FAILURE);
+        /* a failing client must not stop reports to the others. retry next period */
+        TEST(__rtcp_send_sr(con) == SUCCESS, ({
+            con->rtcp_tick = con->rtcp_tick_org;
+            return SUCCESS;}));
 
         /* postcondition check */
         DASSERT(con->rtcp_tick == con->rtcp_tick_org, return FAILURE);
@@ -293,51 +765,280 @@ static inline int __rtcp_poll(struct list_t *e, void *v)
     }
     return SUCCESS;
 }
+static int __rtp_send_frame(rtsp_handle h, struct __frame_src_t *src, struct timeval *p_tv)
+{
+    int i;
+    int kept;
+    int ret = FAILURE;
+    struct __transfer_set_t trans = {};
+
+    pthread_mutex_lock(&h->send_mutex);
+
+    __get_timestamp_offset(&h->stat, p_tv);
+
+    trans.h = h;
+    trans.batch = h->batch;
+    trans.gop_batch = h->gop_batch;
+    trans.len = src->len;
+    __rtp_batch_reset(trans.batch);
+
+    /* PLAYING sessions as last published by the rtsp thread. no lock, no pinning per frame */
+    trans.sessions = __session_snapshot_acquire(h);
+
+    /* parse the access unit once. parameter sets, the GOP cache and packetization share the table.
+       also without viewers, so that DESCRIBE follows a change of the parameter sets */
+    ASSERT(__index_frame(h->nals,src) == SUCCESS, goto error);
+
+    for (i = 0; i < h->nals->num; i++) {
+        if(h->nals->units[i].type == H264_NAL_TYPE_IDR) {
+            trans.idr = TRUE;
+        }
+    }
+
+    /* kept even without viewers, for the first one */
+    if(h->gop) {
+        kept = gop_cache_put(h->gop, h->nals, trans.idr, h->stat.ts_offset, src->owner);
+        TEST(kept != FAILURE, ERR("GOP cache failed. no instant start until the next IDR\n"));
+        if(kept == GOP_HELD) {
+            src->owner = NULL;
+        }
+    }
+
+    ASSERT(__retrieve_sprop(h,h->nals) == SUCCESS, goto error);
+    
+    if(trans.sessions->num > 0) {
+
+        /* packetize whole access unit first */
+        ASSERT(__packetize_frame(trans.batch,h->nals) == SUCCESS, goto error);
+
+        /* then flush it to each connection, here or by the workers */
+        if(h->attr.send_workers > 0) {
+            ASSERT(__rtp_fan_out(&trans) == SUCCESS, goto error);
+        } else {
+            __rtp_batch_prepare(trans.batch);
+
+            trans.first = 0;
+            trans.last = trans.sessions->num;
+
+            ASSERT(__rtp_deliver(&trans) == SUCCESS, goto error);
+        }
+
+        trans.stat.frames = 1;
+    } 
+
+    ret = SUCCESS;
+
+error:
+    __session_snapshot_release(h);
+
+    __rtp_update_stat(h, &trans.stat);
+
+    pthread_mutex_unlock(&h->send_mutex);
+
+    return ret;
+}
+
+/******************************************************************************
+ *                  THREAD CALLBACKS
+ ******************************************************************************/
+void *rtpThrFxn(void *v)
+{
+    thread_handle           h = v;
+    rtsp_handle             rh = h->sharedp->param_shared;
+    void                    *status = THREAD_FAILURE;
+    struct frame_job_t      *job;
+    struct __frame_src_t    src = {};
+
+    DASSERT(thread_check_isoleted_job(h) == SUCCESS, goto error);
+
+    thread_sync_init(h);
+
+    while (!gbl_get_quit(h->sharedp->gbl)) {
+
+        FIFO_GET(rh->submit_fifo, &job, MAGIC_FRAME_JOB);
+
+        src.format = RTSP_NAL_ANNEXB;
+        src.buf = job->buf;
+        src.len = job->len;
+        src.owner = job;
+
+        /* a broken frame must not stop the stream */
+        TEST(__rtp_send_frame(rh, &src, &job->tv) == SUCCESS, 
+                ERR("dropped submitted frame %p\n", job->buf));
+
+        /* unless the GOP cache holds it */
+        if(src.owner) {
+            __frame_job_release(job);
+        }
+    }
+
+cleanup:
+    status = THREAD_SUCCESS;
+error:
+    /* Make sure the other threads aren't waiting for us */
+    thread_sync_cleanup(h);
+
+    return status;
+}
+
+/* sends each published frame to its shard of the sessions */
+void *rtpWorkerThrFxn(void *v)
+{
+    thread_handle           h = v;
+    rtsp_handle             rh = h->sharedp->param_shared;
+    struct __rtp_worker_t   *w = h->param_priv;
+    struct __rtp_frame_t    *frame = &rh->frame;
+    struct __transfer_set_t trans;
+    void                    *status = THREAD_FAILURE;
+    int                     ret;
+
+    /* pinned at creation (__worker_policy()) */
+    DASSERT(thread_check_isoleted_job(h) == SUCCESS, goto error);
+
+    thread_sync_init(h);
+
+    pthread_mutex_lock(&rh->work_mutex);
+
+    for(;;) {
+        while(frame->seq == w->seq && !gbl_get_quit(h->sharedp->gbl)) {
+            pthread_cond_wait(&rh->work_cond, &rh->work_mutex);
+        }
+
+        if(frame->seq == w->seq) {
+            break;
+        }
+
+        w->seq = frame->seq;
+
+        memset(&trans, 0, sizeof(trans));
+        trans.h = rh;
+        trans.sessions = frame->sessions;
+        trans.first = (unsigned long long)frame->sessions->num * w->index / rh->attr.send_workers;
+        trans.last = (unsigned long long)frame->sessions->num * (w->index + 1) / rh->attr.send_workers;
+        trans.batch = w->batch;
+        trans.gop_batch = w->gop_batch;
+        trans.len = frame->len;
+        trans.idr = frame->idr;
+
+        pthread_mutex_unlock(&rh->work_mutex);
+
+        ret = SUCCESS;
+        if(trans.first < trans.last) {
+            ret = __rtp_batch_copy(trans.batch, frame->batch);
+            if(ret == SUCCESS) {
+                ret = __rtp_deliver(&trans);
+            }
+        }
+
+        pthread_mutex_lock(&rh->work_mutex);
+
+        w->stat = trans.stat;
+
+        if(ret != SUCCESS) {
+            frame->ret = FAILURE;
+        }
+
+        if(--frame->ref_count == 0) {
+            pthread_cond_signal(&rh->done_cond);
+        }
+    }
+
+    pthread_mutex_unlock(&rh->work_mutex);
+
+    status = THREAD_SUCCESS;
+error:
+    /* Make sure the other threads aren't waiting for us */
+    thread_sync_cleanup(h);
+
+    return status;
+}
+
 /******************************************************************************
  *              PUBLIC FUNCTIONS
  ******************************************************************************/
 int rtp_send_h264(rtsp_handle h,signed char *buf, size_t len, struct timeval *p_tv)
 {
-    signed char *nalptr = buf;
-    size_t single_len = 0;
-    int ret = FAILURE;
-    struct __transfer_set_t trans = {};
+    return rtp_send_h264_format(h, buf, len, RTSP_NAL_ANNEXB, p_tv);
+}
+
+int rtp_send_h264_format(rtsp_handle h, signed char *buf, size_t len, enum rtsp_nal_format_e format,
+        struct timeval *p_tv)
+{
+    struct __frame_src_t src = {};
 
     /* checkout RTP packet */
     DASSERT(h, return FAILURE);
     DASSERT(p_tv, return FAILURE);
 
+    if(gbl_get_quit(h->pool->sharedp->gbl)) {
+        ERR("server threads have gone already. call rtsp_finish()\n");
+        return FAILURE;
+    }
+
+    src.format = format;
+    src.buf = buf;
+    src.len = len;
+
+    return __rtp_send_frame(h, &src, p_tv);
+}
+
+int rtp_send_h264_iov(rtsp_handle h, const struct iovec *nals, int num, struct timeval *p_tv)
+{
+    struct __frame_src_t src = {};
+    int i;
+
+    DASSERT(h, return FAILURE);
+    DASSERT(p_tv, return FAILURE);
+    DASSERT(nals || num == 0, return FAILURE);
 
     if(gbl_get_quit(h->pool->sharedp->gbl)) {
         ERR("server threads have gone already. call rtsp_finish()\n");
         return FAILURE;
     }
-    
-    __get_timestamp_offset(&h->stat, p_tv);
 
-    
-    ASSERT(__retrieve_sprop(h,buf,len) == SUCCESS, goto error);
+    src.iov = nals;
+    src.iovcnt = num;
 
-    trans.h = h;
+    for (i = 0; i < num; i++) {
+        src.len += nals[i].iov_len;
+    }
 
-    /* setup transmission objecl t*/
-    ASSERT(list_map_inline(&h->con_list,(__rtp_setup_transfer),&trans) == SUCCESS, goto error);
-    
-    if(trans.list_head.list) {
+    return __rtp_send_frame(h, &src, p_tv);
+}
 
-        while (__split_nal(buf,&nalptr,&single_len,len) == SUCCESS) {
-            
-            ASSERT(__transfer_nal(&(trans.list_head),nalptr,single_len) == SUCCESS, goto error);
+int rtp_submit_h264_async(rtsp_handle h, signed char *buf, size_t len, struct timeval *p_tv, 
+        rtp_release_fxn release, void *arg)
+{
+    struct frame_job_t *job = NULL;
+    struct rtsp_stat_t stat = {};
 
-        }
+    DASSERT(h, return FAILURE);
+    DASSERT(p_tv, return FAILURE);
+    DASSERT(release, return FAILURE);
 
-        ASSERT(list_map_inline(&(trans.list_head),(__rtcp_poll), NULL) == SUCCESS, goto error);
-    } 
+    if(gbl_get_quit(h->pool->sharedp->gbl)) {
+        ERR("server threads have gone already. call rtsp_finish()\n");
+        return FAILURE;
+    }
 
-    ret = SUCCESS;
+    /* the caller outpaces the sender. counted, since it may go on for every frame */
+    if(bufpool_try_get(h->job_pool, &job) != SUCCESS) {
+        stat.submit_refused = 1;
+        __rtp_update_stat(h, &stat);
+        return FAILURE;
+    }
 
-error:
-    list_destroy(&(trans.list_head));
+    job->buf = buf;
+    job->len = len;
+    job->tv = *p_tv;
+    job->release = release;
+    job->arg = arg;
 
-    return ret;
+    /* callers on several threads may put at the same time */
+    TEST(fifo_put(h->submit_fifo, job) == SUCCESS, ({
+        job->release = NULL;
+        ASSERT(bufpool_detach(h->job_pool, job) == SUCCESS, ERR("job detach failed\n"));
+        return FAILURE;}));
+
+    return SUCCESS;
 }
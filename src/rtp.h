@@ -9,58 +9,368 @@ extern "C" {
  *              DEFINITIONS 
  ******************************************************************************/
 #define __RTP_MAXPAYLOADSIZE 1460
+#define __RTP_BATCH_INITIAL_PACKETS 64
+#define __RTP_SENDMMSG_MAX 1024 /* UIO_MAXIOV */
+#define __RTP_PACKETSIZE (sizeof(rtp_hdr_t) + __RTP_MAXPAYLOADSIZE)
+#define __RTP_GSO_MAX_SEGMENTS (65507 / __RTP_PACKETSIZE) /* must fit in one IP datagram */
+#define __RTP_ZEROCOPY_TIMEOUT_MS 100     /* a connection copies after this long without completions */
+#define __RTP_ZEROCOPY_GIVEUP_MS 1000     /* ... and its pending completions are given up after this */
+
+/* older libc headers may lack these */
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
 
 /******************************************************************************
  *              DATA STRUCTURES
  ******************************************************************************/
-struct nal_rtp_t {
-    struct {
-        rtp_hdr_t header;
-        signed char payload[__RTP_MAXPAYLOADSIZE];
-    } packet;
-    int    rtpsize;
-    struct list_t list_entry;
+/* payload of an RTP packet. immutable after packetization and shared among connections.
+   'data' points into the caller's buffer: bitstream bytes are never copied */
+struct rtp_payload_desc_t {
+    signed char *data;
+    unsigned int len;
+    unsigned int marker;
+    unsigned int fu_len;    /* 0 (single NAL) or 2 (FU-A) */
+    signed char fu[2];      /* FU indicator, FU header */
+};
+
+/* UDP_SEGMENT control message of a GSO super-buffer */
+struct __rtp_gso_ctrl_t {
+    union {
+        char buf[CMSG_SPACE(sizeof(unsigned short))];
+        struct cmsghdr align;
+    } u;
+};
+
+/* packets of a whole access unit. payloads are built once, then each connection
+   only rewrites its 12-byte headers and flushes {header, FU, payload} by sendmmsg().
+   'gso_msgs' is the same packets with each FU-A run gathered into super-buffers */
+struct __rtp_batch_t {
+    struct rtp_payload_desc_t *payloads;
+    rtp_hdr_t *headers;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;     /* 3 vectors per packet */
+    struct mmsghdr *gso_msgs;
+    struct __rtp_gso_ctrl_t *gso_ctrls;
+    int *gso_counts;        /* packets in each gso message */
+    struct sockaddr_in *peer;   /* destination put in the messages. NULL on connected sockets */
+    unsigned char *tcp_prefixes;    /* '$' framing, 4 bytes per packet */
+    struct iovec *tcp_iovs;         /* 4 vectors per packet: prefix, header, FU, payload */
+    size_t tcp_len;                 /* bytes of the '$' framed packets */
+    int tcp_ready;                  /* tcp vectors are built for this frame */
+    int gso_num;
+    int num;
+    int cap;
 };
 
 /******************************************************************************
  *              DECLARATIONS
  ******************************************************************************/
-static inline int __split_nal(signed char *buf, signed char **nalptr, size_t *p_len, size_t max_len);
+static inline struct __rtp_batch_t *__rtp_batch_create(void);
+static inline void __rtp_batch_delete(struct __rtp_batch_t *batch);
+static inline void __rtp_batch_reset(struct __rtp_batch_t *batch);
+static inline int __rtp_batch_copy(struct __rtp_batch_t *dst, const struct __rtp_batch_t *src);
+static inline int __rtp_batch_add_payload(struct __rtp_batch_t *batch, unsigned int marker,
+        signed char *fu, unsigned int fu_len, signed char *data, size_t len);
+static inline void __rtp_batch_prepare_gso(struct __rtp_batch_t *batch);
+static inline void __rtp_batch_prepare(struct __rtp_batch_t *batch);
+static inline unsigned short __rtp_batch_stamp(struct __rtp_batch_t *batch, rtp_hdr_t *headers, rtp_hdr_t *tmpl, unsigned short seq);
+static inline void __rtp_batch_address(struct __rtp_batch_t *batch, struct sockaddr_in *peer);
+static inline void __rtp_batch_prepare_tcp(struct __rtp_batch_t *batch);
 
 /******************************************************************************
  *              INLINE FUNCTIONS
  ******************************************************************************/
-static inline int __split_nal(signed char *buf, signed char **nalptr, size_t *p_len, size_t max_len)
+static inline void __rtp_batch_delete(struct __rtp_batch_t *batch)
 {
-    int i;
-    int start = -1;
-
-    for(i = (*nalptr) - buf + *p_len;i<max_len-5;i++) {
-        if(buf[i] == 0x00 &&
-                buf[i+1] == 0x00 &&
-                buf[i+2] == 0x00 &&
-                buf[i+3] == 0x01) {
-            if(start == -1){
-                i += 4;
-                start = i;
-            } else {
-                *nalptr = &(buf[start]);
-                while(buf[i-1] == 0) i--;
-                *p_len = i - start;
-                return SUCCESS;
+    if(batch) {
+        FREE(batch->payloads);
+        FREE(batch->headers);
+        FREE(batch->msgs);
+        FREE(batch->iovs);
+        FREE(batch->gso_msgs);
+        FREE(batch->gso_ctrls);
+        FREE(batch->gso_counts);
+        FREE(batch->tcp_prefixes);
+        FREE(batch->tcp_iovs);
+        FREE(batch);
+    }
+}
+
+static inline int __rtp_batch_grow(struct __rtp_batch_t *batch, int cap)
+{
+    struct rtp_payload_desc_t *payloads;
+    rtp_hdr_t *headers;
+    struct mmsghdr *msgs;
+    struct iovec *iovs;
+    struct __rtp_gso_ctrl_t *gso_ctrls;
+    int *gso_counts;
+    unsigned char *prefixes;
+
+    ASSERT(payloads = realloc(batch->payloads, cap * sizeof(struct rtp_payload_desc_t)), return FAILURE);
+    batch->payloads = payloads;
+
+    ASSERT(headers = realloc(batch->headers, cap * sizeof(rtp_hdr_t)), return FAILURE);
+    batch->headers = headers;
+
+    ASSERT(msgs = realloc(batch->msgs, cap * sizeof(struct mmsghdr)), return FAILURE);
+    batch->msgs = msgs;
+
+    ASSERT(iovs = realloc(batch->iovs, cap * 3 * sizeof(struct iovec)), return FAILURE);
+    batch->iovs = iovs;
+
+    ASSERT(msgs = realloc(batch->gso_msgs, cap * sizeof(struct mmsghdr)), return FAILURE);
+    batch->gso_msgs = msgs;
+
+    ASSERT(gso_ctrls = realloc(batch->gso_ctrls, cap * sizeof(struct __rtp_gso_ctrl_t)), return FAILURE);
+    batch->gso_ctrls = gso_ctrls;
+
+    ASSERT(gso_counts = realloc(batch->gso_counts, cap * sizeof(int)), return FAILURE);
+    batch->gso_counts = gso_counts;
+
+    ASSERT(prefixes = realloc(batch->tcp_prefixes, cap * __INTERLEAVED_HDR_SIZE), return FAILURE);
+    batch->tcp_prefixes = prefixes;
+
+    ASSERT(iovs = realloc(batch->tcp_iovs, cap * 4 * sizeof(struct iovec)), return FAILURE);
+    batch->tcp_iovs = iovs;
+
+    batch->cap = cap;
+
+    return SUCCESS;
+}
+
+static inline struct __rtp_batch_t *__rtp_batch_create(void)
+{
+    struct __rtp_batch_t *nh = NULL;
+
+    TALLOC(nh, return NULL);
+
+    ASSERT(__rtp_batch_grow(nh, __RTP_BATCH_INITIAL_PACKETS) == SUCCESS, goto error);
+
+    return nh;
+error:
+    __rtp_batch_delete(nh);
+    return NULL;
+}
+
+static inline void __rtp_batch_reset(struct __rtp_batch_t *batch)
+{
+    batch->num = 0;
+}
+
+/* O(packets): a prepared copy of the descriptors, to stamp headers and messages of its own.
+   the payloads are shared */
+static inline int __rtp_batch_copy(struct __rtp_batch_t *dst, const struct __rtp_batch_t *src)
+{
+    if(dst->cap < src->num) {
+        ASSERT(__rtp_batch_grow(dst, src->cap) == SUCCESS, return FAILURE);
+    }
+
+    memcpy(dst->payloads, src->payloads, src->num * sizeof(struct rtp_payload_desc_t));
+    dst->num = src->num;
+
+    __rtp_batch_prepare(dst);
+
+    return SUCCESS;
+}
+
+/* O(1) amortized: append a payload of optional FU bytes followed by 'len' bytes at 'data'.
+   nothing is copied, so 'data' must stay untouched until the batch is flushed.
+   the batch keeps its capacity among frames */
+static inline int __rtp_batch_add_payload(struct __rtp_batch_t *batch, unsigned int marker,
+        signed char *fu, unsigned int fu_len, signed char *data, size_t len)
+{
+    struct rtp_payload_desc_t *desc;
+
+    DASSERT(fu_len <= 2, return FAILURE);
+
+    if(batch->num == batch->cap) {
+        ASSERT(__rtp_batch_grow(batch, batch->cap * 2) == SUCCESS, return FAILURE);
+    }
+
+    desc = &(batch->payloads[(batch->num)++]);
+    desc->data = data;
+    desc->len = len;
+    desc->marker = marker;
+    desc->fu_len = fu_len;
+
+    if(fu_len > 0) {
+        memcpy(desc->fu, fu, fu_len);
+    }
+
+    return SUCCESS;
+}
+
+/* O(n): gather each FU-A run into super-buffers segmented by the kernel. all segments
+   but the last one of a message must be full sized, and FU-A packets use all 3 vectors
+   so that a run is contiguous in 'iovs' */
+static inline void __rtp_batch_prepare_gso(struct __rtp_batch_t *batch)
+{
+    int i = 0;
+    int j;
+    int n = 0;
+    unsigned short segment = __RTP_PACKETSIZE;
+    struct mmsghdr *msg;
+    struct cmsghdr *cm;
+
+    while(i < batch->num) {
+        j = i + 1;
+
+        if(batch->payloads[i].fu_len > 0) {
+            while(j < batch->num && j - i < __RTP_GSO_MAX_SEGMENTS 
+                    && batch->payloads[j].fu_len > 0
+                    && batch->payloads[j - 1].fu_len + batch->payloads[j - 1].len == __RTP_MAXPAYLOADSIZE) {
+                j++;
             }
         }
+
+        msg = &(batch->gso_msgs[n]);
+        *msg = batch->msgs[i];
+
+        if(j - i > 1) {
+            msg->msg_hdr.msg_iovlen = (j - i) * 3;
+            msg->msg_hdr.msg_control = batch->gso_ctrls[n].u.buf;
+            msg->msg_hdr.msg_controllen = sizeof(batch->gso_ctrls[n].u.buf);
+
+            cm = CMSG_FIRSTHDR(&(msg->msg_hdr));
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(segment));
+            memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+        }
+
+        batch->gso_counts[n++] = j - i;
+        i = j;
     }
 
-    if(start == -1) {
-        /* malformed NAL */
-        return FAILURE;
+    batch->gso_num = n;
+}
+
+/* O(n): point message vectors at the headers and payloads. call after packetization
+   is done, since growing the batch moves them */
+static inline void __rtp_batch_prepare(struct __rtp_batch_t *batch)
+{
+    int i;
+    int n;
+    struct iovec *iov;
+    struct rtp_payload_desc_t *desc;
+
+    for(i = 0; i < batch->num; i++) {
+        iov = &(batch->iovs[i * 3]);
+        desc = &(batch->payloads[i]);
+        n = 0;
+
+        iov[n].iov_base = &(batch->headers[i]);
+        iov[n++].iov_len = sizeof(rtp_hdr_t);
+
+        if(desc->fu_len > 0) {
+            iov[n].iov_base = desc->fu;
+            iov[n++].iov_len = desc->fu_len;
+        }
+
+        iov[n].iov_base = desc->data;
+        iov[n++].iov_len = desc->len;
+
+        CLEAR(batch->msgs[i]);
+        batch->msgs[i].msg_hdr.msg_iov = iov;
+        batch->msgs[i].msg_hdr.msg_iovlen = n;
     }
 
-    *nalptr = &(buf[start]);
-    *p_len = max_len + 2 - start;
+    batch->peer = NULL;
+    batch->tcp_ready = FALSE;
 
-    return SUCCESS;
+    __rtp_batch_prepare_gso(batch);
+}
+
+/* O(n): '$' framed vectors of the packets for interleaved connections. built once a frame,
+   on the first of them. the channel is stamped per connection */
+static inline void __rtp_batch_prepare_tcp(struct __rtp_batch_t *batch)
+{
+    int i;
+    size_t len;
+    unsigned char *prefix;
+    struct iovec *iov;
+    struct rtp_payload_desc_t *desc;
+
+    batch->tcp_len = 0;
+
+    for(i = 0; i < batch->num; i++) {
+        prefix = &(batch->tcp_prefixes[i * __INTERLEAVED_HDR_SIZE]);
+        iov = &(batch->tcp_iovs[i * 4]);
+        desc = &(batch->payloads[i]);
+        len = sizeof(rtp_hdr_t) + desc->fu_len + desc->len;
+
+        prefix[0] = '$';
+        prefix[2] = (len >> 8) & 0xFF;
+        prefix[3] = len & 0xFF;
+
+        iov[0].iov_base = prefix;
+        iov[0].iov_len = __INTERLEAVED_HDR_SIZE;
+        iov[1].iov_base = &(batch->headers[i]);
+        iov[1].iov_len = sizeof(rtp_hdr_t);
+        iov[2].iov_base = desc->fu;
+        iov[2].iov_len = desc->fu_len;  /* empty vectors are fine */
+        iov[3].iov_base = desc->data;
+        iov[3].iov_len = desc->len;
+
+        batch->tcp_len += __INTERLEAVED_HDR_SIZE + len;
+    }
+
+    batch->tcp_ready = TRUE;
+}
+
+/* O(n) when the destination changes, else O(1). messages to a connected socket have none */
+static inline void __rtp_batch_address(struct __rtp_batch_t *batch, struct sockaddr_in *peer)
+{
+    int i;
+
+    if(batch->peer == peer) {
+        return;
+    }
+
+    for(i = 0; i < batch->num; i++) {
+        batch->msgs[i].msg_hdr.msg_name = peer;
+        batch->msgs[i].msg_hdr.msg_namelen = peer ? sizeof(struct sockaddr_in) : 0;
+    }
+
+    for(i = 0; i < batch->gso_num; i++) {
+        batch->gso_msgs[i].msg_hdr.msg_name = peer;
+        batch->gso_msgs[i].msg_hdr.msg_namelen = peer ? sizeof(struct sockaddr_in) : 0;
+    }
+
+    batch->peer = peer;
+}
+
+/* O(n): stamp per-connection 'headers' from 'tmpl' and point the messages at them.
+   only seq and marker vary among packets */
+static inline unsigned short __rtp_batch_stamp(struct __rtp_batch_t *batch, rtp_hdr_t *headers, rtp_hdr_t *tmpl, unsigned short seq)
+{
+    int i;
+
+    for(i = 0; i < batch->num; i++) {
+        headers[i] = *tmpl;
+        headers[i].m = batch->payloads[i].marker;
+        headers[i].seq = htons(seq);
+        batch->iovs[i * 3].iov_base = &(headers[i]);
+        seq += 1;
+    }
+
+    return seq;
 }
 
 #if defined (__cplusplus)
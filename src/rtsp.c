@@ -5,6 +5,8 @@
 #include <netdb.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdarg.h>
+#include <limits.h>
 #include "rtsp_server.h"
 #include "common.h"
 #include "rtsp.h"
@@ -29,6 +31,9 @@
 #define __STR_TEARDOWN  "TEARDOWN"
 #define __STR_TRANSPORT  "TRANSPORT"
 #define __STR_CLIENTPORT  "client_port"
+#define __STR_INTERLEAVED  "interleaved"
+#define __STR_AVP_TCP  "RTP/AVP/TCP"
+#define __STR_MULTICAST  "multicast"
 #define __STR_SESSION  "SESSION"
 #define __STR_PAUSE "PAUSE"
 #define __STR_RECORDING "RECORDING"
@@ -42,21 +47,38 @@
 #define __RESPONCE_STR_MOVEDPERM "301 Moved Permanently"
 #define __RESPONCE_STR_SERVERERROR "500 Internal Server Error"
 #define __RESPONCE_STR_OPTIONUNSUPPORTED "551 Option not supported"
+#define __RESPONCE_STR_UNSUPPORTEDTRANSPORT "461 Unsupported Transport"
+#define __RESPONCE_STR_SESSIONNOTFOUND "454 Session Not Found"
 
-#define __PARSE_ERROR(p) do {ERR("cannot parse '%s' in %s\n", buf, __FUNCTION__); p->parser_state = __PARSER_S_ERROR;}while(0)
+/* canned parts of the responses. they go out by reference */
+#define __CANNED_PUBLIC "Public: OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE\r\n"
+#define __CANNED_SDP_HEADERS "Content-Type: application/sdp\r\nContent-Length: %d\r\n\r\n"
+
+#define __REPLY_STATUS(p, s) __reply_status(p, "RTSP/1.0 " s __TERM "CSeq: ", sizeof("RTSP/1.0 " s __TERM "CSeq: ") - 1)
+#define __REPLY_CANNED(p, s) __reply_append(p, s, sizeof(s) - 1)
+
+#define __PARSE_ERROR(p) do {ERR("cannot parse '%.*s' in %s\n", (int)len, line, __FUNCTION__); p->parser_state = __PARSER_S_ERROR;}while(0)
 
 /******************************************************************************
  *              PRIVATE DECLARATION
  ******************************************************************************/
-static inline int __bind_rtp(struct connection_item_t *con );
-static inline int __bind_rtcp(struct connection_item_t *con );
-static inline int __bind_tcp(unsigned short port);
-
-static void __parse_head(struct connection_item_t *p, char *buf);
-static void __parse_cseq(struct connection_item_t *p, char *buf);
-static void __parse_transport(struct connection_item_t *p, char *buf);
-static void __parse_session(struct connection_item_t *p, char *buf);
-static void __parse_range(struct connection_item_t *p, char *buf);
+static inline int __bind_udp(struct connection_item_t *con, rtsp_handle h);
+static inline int __bind_udp_shared(rtsp_handle h);
+static inline void __unbind_udp(struct connection_item_t *con);
+static inline int __bind_interleaved(struct connection_item_t *con, rtsp_handle h);
+static inline int __bind_multicast(struct connection_item_t *con, rtsp_handle h);
+static inline int __mcast_create(rtsp_handle h);
+static inline void __mcast_delete(rtsp_handle h);
+static inline struct __rtp_worker_t *__worker_create(rtsp_handle h, unsigned int index);
+static inline void __workers_delete(rtsp_handle h);
+static inline struct sock_epoll_t *__control_create(rtsp_handle h);
+static inline int __bind_tcp(unsigned short port, int backlog);
+
+static void __parse_head(struct connection_item_t *p, char *line, size_t len);
+static void __parse_cseq(struct connection_item_t *p, char *line, size_t len);
+static void __parse_transport(struct connection_item_t *p, char *line, size_t len);
+static void __parse_session(struct connection_item_t *p, char *line, size_t len);
+static void __parse_range(struct connection_item_t *p, char *line, size_t len);
 
 static void __method_options(struct connection_item_t *p, rtsp_handle h);
 static void __method_describe(struct connection_item_t *p, rtsp_handle h);
@@ -65,25 +87,43 @@ static void __method_play(struct connection_item_t *p, rtsp_handle h);
 static void __method_pause(struct connection_item_t *p, rtsp_handle h);
 static void __method_record(struct connection_item_t *p, rtsp_handle h);
 static void __method_error(struct connection_item_t *p, rtsp_handle h);
+static void __reply(struct connection_item_t *p, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static int __reply_append(struct connection_item_t *p, const void *base, size_t len);
+static int __reply_append_sdp(struct connection_item_t *p, struct sdp_blob_t *sdp);
+static void __reply_status(struct connection_item_t *p, const char *status, size_t len);
+static int __reply_flush(struct connection_item_t *p);
+static int __reply_flush_ring(struct connection_item_t *p);
+static inline void __reply_sent(struct connection_item_t *p);
+static inline int __reply_pending(struct connection_item_t *p);
 
 static void *rtspThrFxn(void *v);
 
-static inline int __connection_list_add(bufpool_handle con_pool, struct list_head_t *head,int fd, struct sockaddr_in addr);
+static inline int __connection_list_add(bufpool_handle con_pool, struct list_head_t *head,int fd, struct sockaddr_in addr,
+        struct connection_item_t **p_con);
 static int __connection_reset(void *v);
-static inline int __accept_proc_sock(rtsp_handle h, int server_fd, struct sock_select_t *p_socks);
-static int __message_proc_sock(struct list_t *e, void *p);
-static inline int __set_select_sock(struct list_t *p, void *param);
-static inline int __find_fd_max(struct list_head_t *head);
-
-static inline bufpool_handle __connectionpool_create(int num);
+static inline int __accept_proc_sock(rtsp_handle h, struct sock_epoll_t *p_socks);
+static int __request_proc(struct connection_item_t *con, rtsp_handle h);
+static int __message_proc_sock(struct connection_item_t *con, rtsp_handle h);
+static inline int __epoll_add(int epfd, int fd, unsigned int events, void *ptr);
+static int __session_publish(rtsp_handle h);
+static int __session_reclaim(rtsp_handle h);
+static inline int __session_list(struct connection_item_t *p, rtsp_handle h);
+static inline void __session_unlist(struct connection_item_t *p, rtsp_handle h);
+static inline struct connection_item_t *__session_find(struct connection_item_t *p, rtsp_handle h);
+
+static inline bufpool_handle __connectionpool_create(int num, int max);
 static int __connection_is_dead(struct list_t *l);
+static int __connection_forget(struct list_t *l, void *v);
+static inline int __connection_sweep(struct sock_epoll_t *p_socks);
 
 /******************************************************************************
  *              PRIVATE DATA
  ******************************************************************************/
-/* parser finite state machine jump table */
-static void (*__state_table[__METHOD_COUNT][__PARSER_S_COUNT]) (struct connection_item_t *p, char *buf) = 
-{[__METHOD_OPTIONS] = {
+/* parser finite state machine jump table. every request starts at [__METHOD_NONE][__PARSER_S_INIT] */
+static void (*__state_table[__METHOD_COUNT][__PARSER_S_COUNT]) (struct connection_item_t *p, char *line, size_t len) = 
+{[__METHOD_NONE] = {
+    [__PARSER_S_INIT] = __parse_head},
+[__METHOD_OPTIONS] = {
     [__PARSER_S_HEAD] = __parse_cseq,
     [__PARSER_S_CSEQ] = NULL},
 [__METHOD_DESCRIBE] = {
@@ -111,81 +151,149 @@ static void (*__state_table[__METHOD_COUNT][__PARSER_S_COUNT]) (struct connectio
     [__PARSER_S_CSEQ] = __parse_session,
     [__PARSER_S_SESSION] = NULL}};
 
-static struct connection_item_t __connection_pool[RTSP_MAXIMUM_CONNECTIONS] = {};
-
-static struct transfer_item_t __transfer_pool[RTSP_MAXIMUM_CONNECTIONS] = {};
-
 /******************************************************************************
  *              PRIVATE FUNCTIONS
  ******************************************************************************/
-static void *__bufgetter_connection(int i)
+static int __connection_init(bufpool_handle pool, void *v)
 {
-    return (void *)&(__connection_pool[i]);
-}
+    struct connection_item_t *p = v;
 
-static inline bufpool_handle __connectionpool_create(int num)
-{
-    bufpool_handle h = bufpool_create(num, (__bufgetter_connection), (__connection_reset), sizeof(struct connection_item_t));
+    p->pool = pool;
+    p->con_state = __CON_S_DISCONNECTED;
 
-    if (h) {
-        int i;
-        for(i = 0; i < num; i++) {
-            __connection_pool[i].pool = h;
-            __connection_pool[i].con_state = __CON_S_DISCONNECTED;
-        }
-    }
+    return SUCCESS;
+}
 
-    return h;
+static inline bufpool_handle __connectionpool_create(int num, int max)
+{
+    return bufpool_create(num, max, sizeof(struct connection_item_t), (__connection_init), (__connection_reset));
 }
 
-static void *__bufgetter_trans(int i)
+static int __job_init(bufpool_handle pool, void *v)
 {
-    return (void *)&(__transfer_pool[i]);
+    struct frame_job_t *p = v;
+
+    p->magic = MAGIC_FRAME_JOB;
+    p->pool = pool;
+
+    return SUCCESS;
 }
 
-static inline bufpool_handle __transpool_create(int num)
+/* no-op on a regular detach. on pool deletion it hands back frames the sender thread never took */
+static int __job_reset(void *v)
 {
-    bufpool_handle h = bufpool_create(num, (__bufgetter_trans), NULL, sizeof(struct transfer_item_t));
+    struct frame_job_t *p = v;
+    rtp_release_fxn release = p->release;
 
-    if (h) {
-        int i;
-        for(i = 0; i < num; i++) {
-            __transfer_pool[i].pool = h;
-            __transfer_pool[i].list_entry.cleaner = (__transfer_item_cleaner);
-        }
+    p->release = NULL;
+
+    if(release) {
+        release(p->buf, p->len, p->arg);
     }
 
-    return h;
+    return SUCCESS;
+}
+
+/* the queue, and the frames the GOP cache holds. the pool grows by 'num' up to 'max' */
+static inline bufpool_handle __jobpool_create(int num, int max)
+{
+    return bufpool_create(num, max, sizeof(struct frame_job_t), (__job_init), (__job_reset));
+}
+
+/* a submitted frame the GOP cache let go of */
+static void __gop_job_release(void *owner)
+{
+    __frame_job_release(owner);
 }
 
 /******************************************************************************
  *              PARSER IMPLEMENTATIONS
  ******************************************************************************/
-static void __parse_head(struct connection_item_t *p, char *buf)
+/* O(n): value of header 'name' in 'line' with leading blanks skipped. FALSE for another header */
+static inline int __header_value(const char *line, size_t len, const char *name, size_t name_len,
+        const char **p_val, size_t *p_len)
+{
+    if (len <= name_len || line[name_len] != ':' || strncasecmp(line, name, name_len) != 0) {
+        return FALSE;
+    }
+
+    line += name_len + 1;
+    len -= name_len + 1;
+
+    while (len > 0 && (*line == ' ' || *line == '\t')) {
+        line++;
+        len--;
+    }
+
+    *p_val = line;
+    *p_len = len;
+
+    return TRUE;
+}
+
+/* O(n): number at the front of a slice. returns the count of digits consumed */
+static inline size_t __slice_to_ull(const char *s, size_t len, int base, unsigned long long *p_val)
 {
+    unsigned long long val = 0;
+    int digit;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (s[i] >= '0' && s[i] <= '9')                     digit = s[i] - '0';
+        else if (base == 16 && s[i] >= 'a' && s[i] <= 'f')  digit = s[i] - 'a' + 10;
+        else if (base == 16 && s[i] >= 'A' && s[i] <= 'F')  digit = s[i] - 'A' + 10;
+        else break;
+
+        val = val * base + digit;
+    }
+
+    *p_val = val;
+
+    return i;
+}
 
-    if (SCMP(__STR_OPTIONS,buf))            { p->method = __METHOD_OPTIONS;
-    } else if (SCMP(__STR_DESCRIBE,buf))    { p->method = __METHOD_DESCRIBE;
-    } else if (SCMP(__STR_SETUP, buf))      { p->method = __METHOD_SETUP;
-    } else if (SCMP(__STR_PLAY, buf))       { p->method = __METHOD_PLAY;
-    } else if (SCMP(__STR_RECORDING, buf))  { p->method = __METHOD_RECORDING;
-    } else if (SCMP(__STR_PAUSE, buf))      { p->method = __METHOD_PAUSE;
-    } else if (SCMP(__STR_TEARDOWN, buf))   { p->method = __METHOD_TEARDOWN;
+/* O(1): the method is told by the length of its token first */
+static void __parse_head(struct connection_item_t *p, char *line, size_t len)
+{
+    char *end = memchr(line, ' ', len);
+    size_t n = end ? (size_t)(end - line) : len;
+
+#define __IS_METHOD(s) (n == sizeof(s) - 1 && strncasecmp(line, s, n) == 0)
+    switch (n) {
+        case sizeof(__STR_PLAY) - 1:
+            if (__IS_METHOD(__STR_PLAY))            p->method = __METHOD_PLAY;
+            break;
+        case sizeof(__STR_SETUP) - 1:
+            if (__IS_METHOD(__STR_SETUP))           p->method = __METHOD_SETUP;
+            else if (__IS_METHOD(__STR_PAUSE))      p->method = __METHOD_PAUSE;
+            break;
+        case sizeof(__STR_OPTIONS) - 1:
+            if (__IS_METHOD(__STR_OPTIONS))         p->method = __METHOD_OPTIONS;
+            break;
+        case sizeof(__STR_DESCRIBE) - 1:
+            if (__IS_METHOD(__STR_DESCRIBE))        p->method = __METHOD_DESCRIBE;
+            else if (__IS_METHOD(__STR_TEARDOWN))   p->method = __METHOD_TEARDOWN;
+            break;
+        case sizeof(__STR_RECORDING) - 1:
+            if (__IS_METHOD(__STR_RECORDING))       p->method = __METHOD_RECORDING;
+            break;
     }
+#undef __IS_METHOD
 
     p->parser_state = __PARSER_S_HEAD;
 }
 
-static void __parse_cseq(struct connection_item_t *p, char *buf)
+static void __parse_cseq(struct connection_item_t *p, char *line, size_t len)
 {
-    char *tok;
-    char *last;
+    unsigned long long cseq;
+    const char *val;
+    size_t n;
 
-    if (SCMP(__STR_CSEQ,buf)) {
-        ASSERT(tok = strtok_r(buf,": ",&last), goto error); 
-        ASSERT(tok = strtok_r(NULL,": ",&last), goto error);
-        ASSERT((p->cseq = atoi(tok)) > 0, goto error);
+    if (__header_value(line, len, __STR_CSEQ, sizeof(__STR_CSEQ) - 1, &val, &n)) {
+        ASSERT(__slice_to_ull(val, n, 10, &cseq) > 0, goto error);
+        ASSERT(cseq > 0 && cseq <= 0x7FFFFFFF, goto error);
 
+        p->cseq = (int)cseq;
         p->parser_state = __PARSER_S_CSEQ;
     }
 
@@ -194,16 +302,14 @@ error:
     __PARSE_ERROR(p);
 }
 
-static void __parse_session(struct connection_item_t *p, char *buf)
+static void __parse_session(struct connection_item_t *p, char *line, size_t len)
 {
     unsigned long long session_id;
-    char *tok;
-    char *last;
+    const char *val;
+    size_t n;
 
-    if (SCMP(__STR_SESSION,buf)) {
-        ASSERT(tok = strtok_r(buf,": ",&last), goto error);
-        ASSERT(tok = strtok_r(NULL,": ",&last), goto error);
-        ASSERT(sscanf(tok,"%llx",&session_id) > 0, goto error);
+    if (__header_value(line, len, __STR_SESSION, sizeof(__STR_SESSION) - 1, &val, &n)) {
+        ASSERT(__slice_to_ull(val, n, 16, &session_id) > 0, goto error);
 
         p->given_session_id = session_id;
         p->parser_state= __PARSER_S_SESSION;
@@ -214,26 +320,75 @@ error:
     __PARSE_ERROR(p);
 }
 
-static void __parse_range(struct connection_item_t *p, char *buf)
+static void __parse_range(struct connection_item_t *p, char *line, size_t len)
 {
     p->parser_state = __PARSER_S_RANGE;
 }
 
 
-static void __parse_transport(struct connection_item_t *p, char *buf)
+static void __parse_transport(struct connection_item_t *p, char *line, size_t len)
 {
-    char *tok;
-    char *last;
+    unsigned long long port;
+    const char *val;
+    const char *end;
+    size_t n;
+    size_t k;
+    size_t m;
+
+    if (__header_value(line, len, __STR_TRANSPORT, sizeof(__STR_TRANSPORT) - 1, &val, &n)) {
+        /* walk the ';' separated parameters */
+        for (; n > 0; val = end + 1, n -= k + 1) {
+            end = memchr(val, ';', n);
+            k = end ? (size_t)(end - val) : n;
+            end = val + k;
+
+            while (k > 0 && *val == ' ') {
+                val++; n--; k--;
+            }
 
-    if (SCMP(__STR_TRANSPORT,buf)) {
-        for(tok = strtok_r(buf,"; ",&last); tok != NULL; tok = strtok_r(NULL,"; ",&last)) {
-            if (SCMP(__STR_CLIENTPORT,tok)) {
+            if (k >= sizeof(__STR_CLIENTPORT) && SCMP(__STR_CLIENTPORT "=", val)) {
+                /* 5 digits at most, so that a long one does not wrap into range */
+                m = __slice_to_ull(val + sizeof(__STR_CLIENTPORT), k - sizeof(__STR_CLIENTPORT), 10, &port);
+                ASSERT(m > 0 && m <= 5 && port > 0 && port <= 65535, goto error);
+                p->client_port_rtp = port;
+                /* RTCP on the next port unless told (RFC 2326 12.39) */
+                p->client_port_rtcp = port + 1;
 
-                ASSERT(sscanf(tok, __STR_CLIENTPORT "=%u-%u", &p->client_port_rtp,&p->client_port_rtcp) > 0,
-                        goto error);
+                m += sizeof(__STR_CLIENTPORT);
+                if (m < k && val[m] == '-') {
+                    m = __slice_to_ull(val + m + 1, k - m - 1, 10, &port);
+                    ASSERT(m > 0 && m <= 5 && port > 0 && port <= 65535, goto error);
+                    p->client_port_rtcp = port;
+                }
 
+                ASSERT(p->client_port_rtcp <= 65535, goto error);
+
+                p->parser_state = __PARSER_S_TRANSPORT;
+            } else if (k > sizeof(__STR_INTERLEAVED) && SCMP(__STR_INTERLEAVED "=", val)) {
+                ASSERT(m = __slice_to_ull(val + sizeof(__STR_INTERLEAVED), k - sizeof(__STR_INTERLEAVED), 10, &port), goto error);
+                ASSERT(port < 255, goto error);
+                p->client_channel_rtp = port;
+                p->client_channel_rtcp = port + 1;
+
+                m += sizeof(__STR_INTERLEAVED);
+                if (m < k && val[m] == '-' && __slice_to_ull(val + m + 1, k - m - 1, 10, &port) > 0 && port < 256) {
+                    p->client_channel_rtcp = port;
+                }
+
+                p->client_tcp = TRUE;
                 p->parser_state = __PARSER_S_TRANSPORT;
+            } else if (k == sizeof(__STR_AVP_TCP) - 1 && SCMP(__STR_AVP_TCP, val)) {
+                /* channels may be left to the server */
+                p->client_channel_rtp = 0;
+                p->client_channel_rtcp = 1;
+                p->client_tcp = TRUE;
+                p->parser_state = __PARSER_S_TRANSPORT;
+            } else if (k == sizeof(__STR_MULTICAST) - 1 && SCMP(__STR_MULTICAST, val)) {
+                p->client_multicast = TRUE;
+                p->parser_state = __PARSER_S_TRANSPORT;
+            }
 
+            if (end == val + n) {
                 break;
             }
         }
@@ -243,28 +398,236 @@ error:
     __PARSE_ERROR(p);
 }
 
+/* O(1): take 'len' bytes more in the staged responses. contiguous bytes share one iovec */
+static int __reply_append(struct connection_item_t *p, const void *base, size_t len)
+{
+    struct iovec *last;
+
+    if (p->tx_iovcnt > 0) {
+        last = &p->tx_iov[p->tx_iovcnt - 1];
+
+        if ((char *)last->iov_base + last->iov_len == base) {
+            last->iov_len += len;
+            return SUCCESS;
+        }
+    }
+
+    ASSERT(p->tx_iovcnt < __RTSP_TX_IOV, return FAILURE);
+
+    p->tx_pin[p->tx_iovcnt] = NULL;
+    p->tx_iov[p->tx_iovcnt].iov_base = (void *)base;
+    p->tx_iov[p->tx_iovcnt].iov_len = len;
+    p->tx_iovcnt++;
+
+    return SUCCESS;
+}
+
+/* O(1): stage 'sdp' in an iovec of its own, which keeps it alive until the iovec is out. 
+   the sdp may be replaced between pipelined requests */
+static int __reply_append_sdp(struct connection_item_t *p, struct sdp_blob_t *sdp)
+{
+    ASSERT(p->tx_iovcnt < __RTSP_TX_IOV, return FAILURE);
+
+    __atomic_add_fetch(&sdp->ref_count, 1, __ATOMIC_RELAXED);
+
+    p->tx_pin[p->tx_iovcnt] = sdp;
+    p->tx_iov[p->tx_iovcnt].iov_base = sdp->data;
+    p->tx_iov[p->tx_iovcnt].iov_len = sdp->len;
+    p->tx_iovcnt++;
+
+    return SUCCESS;
+}
+
+/* O(n): let go of the sdp pinned by the staged iovecs [first, last) */
+static inline void __reply_unpin(struct connection_item_t *p, int first, int last)
+{
+    int i;
+
+    for (i = first; i < last; i++) {
+        __sdp_blob_release(p->tx_pin[i]);
+        p->tx_pin[i] = NULL;
+    }
+}
+
+/* responses are staged in the connection and written out together by __reply_flush() */
+static void __reply(struct connection_item_t *p, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(p->tx_buf + p->tx_len, sizeof(p->tx_buf) - p->tx_len, fmt, ap);
+    va_end(ap);
+
+    ASSERT(n >= 0 && n < (int)(sizeof(p->tx_buf) - p->tx_len), ({
+                ERR("response exceeds %zu bytes\n", sizeof(p->tx_buf));
+                return;}));
+
+    ASSERT(__reply_append(p, p->tx_buf + p->tx_len, n) == SUCCESS, return);
+
+    p->tx_len += n;
+}
+
+/* O(1): status line and CSeq, without printf */
+static void __reply_status(struct connection_item_t *p, const char *status, size_t len)
+{
+    char num[12];
+    char *dst = p->tx_buf + p->tx_len;
+    unsigned int cseq = p->cseq;
+    int i = sizeof(num);
+    size_t n;
+
+    do {
+        num[--i] = '0' + cseq % 10;
+        cseq /= 10;
+    } while (cseq > 0);
+
+    n = len + (sizeof(num) - i) + sizeof(__TERM) - 1;
+
+    ASSERT(n < sizeof(p->tx_buf) - p->tx_len, ({
+                ERR("response exceeds %zu bytes\n", sizeof(p->tx_buf));
+                return;}));
+
+    memcpy(dst, status, len);
+    memcpy(dst + len, num + i, sizeof(num) - i);
+    memcpy(dst + len + sizeof(num) - i, __TERM, sizeof(__TERM) - 1);
+
+    ASSERT(__reply_append(p, dst, n) == SUCCESS, return);
+
+    p->tx_len += n;
+}
+
+/* one writev for every staged response. what the socket cannot take now stays staged, 
+   and the rest goes out on EPOLLOUT. FAILURE when the peer has gone */
+static int __reply_flush(struct connection_item_t *p)
+{
+    struct msghdr msg = {};
+    struct iovec *iov;
+    ssize_t n;
+
+    if (p->ring) {
+        return __reply_flush_ring(p);
+    }
+
+    while (p->tx_iov_first < p->tx_iovcnt) {
+        msg.msg_iov = &p->tx_iov[p->tx_iov_first];
+        msg.msg_iovlen = p->tx_iovcnt - p->tx_iov_first;
+
+        /* sendmsg() is writev() which does not raise SIGPIPE */
+        n = sendmsg(p->client_fd, &msg, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return SUCCESS;
+            }
+
+            ERR("sendmsg:%s\n", strerror(errno));
+            __connection_hangup(p);
+            return FAILURE;
+        }
+
+        /* skip what has been sent */
+        while (n > 0) {
+            iov = &p->tx_iov[p->tx_iov_first];
+
+            if ((size_t)n < iov->iov_len) {
+                iov->iov_base = (char *)iov->iov_base + n;
+                iov->iov_len -= n;
+                break;
+            }
+
+            n -= iov->iov_len;
+            __reply_unpin(p, p->tx_iov_first, p->tx_iov_first + 1);
+            p->tx_iov_first++;
+        }
+    }
+
+    __reply_sent(p);
+
+    return SUCCESS;
+}
+
+/* interleaved connections share the socket with the sender, whose packets must not be cut. 
+   the staged responses go to the ring as a whole once it has room, or wait for EPOLLOUT */
+static int __reply_flush_ring(struct connection_item_t *p)
+{
+    size_t len = 0;
+    int ret;
+    int i;
+
+    for (i = p->tx_iov_first; i < p->tx_iovcnt; i++) {
+        len += p->tx_iov[i].iov_len;
+    }
+
+    interleaved_lock(p->ring);
+
+    ret = interleaved_flush(p->ring, p->client_fd);
+
+    if (ret == SUCCESS && len > 0 && interleaved_room(p->ring) >= len) {
+        ret = interleaved_send(p->ring, p->client_fd, 
+                &p->tx_iov[p->tx_iov_first], p->tx_iovcnt - p->tx_iov_first);
+
+        if (ret == SUCCESS) {
+            /* copied or sent. nothing refers to the staged bytes any more */
+            __reply_sent(p);
+        }
+    }
+
+    interleaved_unlock(p->ring);
+
+    TEST(ret == SUCCESS, ({
+                ERR("sendmsg:%s\n", strerror(errno));
+                __connection_hangup(p);
+                return FAILURE;}));
+
+    return SUCCESS;
+}
+
+/* O(1): the staged responses are out */
+static inline void __reply_sent(struct connection_item_t *p)
+{
+    __reply_unpin(p, p->tx_iov_first, p->tx_iovcnt);
+
+    p->tx_len = 0;
+    p->tx_iov_first = 0;
+    p->tx_iovcnt = 0;
+}
+
+/* O(1): responses are left over since the socket was full */
+static inline int __reply_pending(struct connection_item_t *p)
+{
+    return p->tx_iov_first < p->tx_iovcnt;
+}
+
 static void __method_options(struct connection_item_t *p, rtsp_handle h)
 {
-    fprintf(p->fp_tcp_write, "RTSP/1.0 200 OK\r\n"
-            "CSeq: %d\r\n"
-            "Public: OPTIONS, DESCRIBE, SETUP, TEARDOWN, PLAY, PAUSE\r\n"
-            "\r\n", p->cseq);
+    __REPLY_STATUS(p, __RESPONCE_STR_OK);
+    __REPLY_CANNED(p, __CANNED_PUBLIC __TERM);
 }
 
-static void __method_describe(struct connection_item_t *p, rtsp_handle h)
+/* render once per change of the parameter sets. DESCRIBE sends the blob as it is */
+int __sdp_publish(rtsp_handle h)
 {
     char sdp[__RTSP_TCP_BUF_SIZE];
+    struct sdp_blob_t *blob;
+    struct sdp_blob_t *old;
+    int len;
+    int n;
 
     if(h->sprop_sps_b64 && h->sprop_sps_b16 && h->sprop_pps_b64) {
-        DASSERT(h->sprop_sps_b64->result, return);
-        DASSERT(h->sprop_sps_b16->result, return);
-        DASSERT(h->sprop_pps_b64->result, return);
+        DASSERT(h->sprop_sps_b64->result, return FAILURE);
+        DASSERT(h->sprop_sps_b16->result, return FAILURE);
+        DASSERT(h->sprop_pps_b64->result, return FAILURE);
 
         DBG("SPS BASE64:%s\n",h->sprop_sps_b64->result);
         DBG("SPS BASE16:%s\n",h->sprop_sps_b16->result);
         DBG("PPS BASE64:%s\n",h->sprop_pps_b64->result);
 
-        snprintf(sdp, __RTSP_TCP_BUF_SIZE- 1,
+        len = snprintf(sdp, sizeof(sdp),
                 "v=0\r\n"
                 "o=- 0 0 IN IP4 127.0.0.1\r\n"
                 "s=librtsp\r\n"
@@ -281,7 +644,7 @@ static void __method_describe(struct connection_item_t *p, rtsp_handle h)
                 h->sprop_sps_b64->result,
                 h->sprop_pps_b64->result);
     } else {
-        strncpy(sdp,
+        len = snprintf(sdp, sizeof(sdp),
                 "v=0\r\n"
                 "o=- 0 0 IN IP4 127.0.0.1\r\n"
                 "s=librtsp\r\n"
@@ -291,34 +654,114 @@ static void __method_describe(struct connection_item_t *p, rtsp_handle h)
                 "m=video 0 RTP/AVP 96\r\n"
                 "a=rtpmap:96 H264/90000\r\n"
                 "a=fmtp:96 packetization-mode=1\r\n"
-                "a=control:streamid=0\r\n", __RTSP_TCP_BUF_SIZE - 1);
+                "a=control:streamid=0\r\n");
+    }
+
+    ASSERT(len > 0 && len < (int)sizeof(sdp), return FAILURE);
+
+    n = snprintf(NULL, 0, __CANNED_SDP_HEADERS, len);
+
+    ASSERT(blob = malloc(sizeof(struct sdp_blob_t) + n + len + 1), return FAILURE);
+
+    snprintf(blob->data, n + 1, __CANNED_SDP_HEADERS, len);
+    memcpy(blob->data + n, sdp, len);
+
+    blob->ref_count = 1;
+    blob->len = n + len;
+
+    old = h->sdp;
+    blob->version = old ? old->version + 1 : 0;
+    h->sdp = blob;
+
+    /* responses still staged keep the old one alive */
+    __sdp_blob_release(old);
+
+    return SUCCESS;
+}
+
+static void __method_describe(struct connection_item_t *p, rtsp_handle h)
+{
+    DASSERT(h->sdp, return);
+
+    /* the status line and the blob take an iovec each. __message_proc_sock() flushes long before
+       the table runs short, so headers without a body would be a bug. answered 500 instead */
+    if (p->tx_iovcnt > __RTSP_TX_IOV - 2) {
+        ERR("no iovec left for the sdp\n");
+        __method_error(p, h);
+        return;
     }
 
-    fprintf(p->fp_tcp_write, "RTSP/1.0 200 OK\r\n"
-            "CSeq: %d\r\n"
-            "Content-Type: application/sdp\r\n"
-            "Content-Length: %d\r\n"
-            "\r\n"
-            "%s"
-            , p->cseq,strlen(sdp),sdp);
+    __REPLY_STATUS(p, __RESPONCE_STR_OK);
+    ASSERT(__reply_append_sdp(p, h->sdp) == SUCCESS, ERR("sdp is not staged\n"));
 }
 
 static void __method_setup(struct connection_item_t *p, rtsp_handle h)
 {
-    /* make randomized session id */
-    p->session_id = __get_random_llu(&h->ctx);
+    /* the sender is using the transport */
+    if (p->con_state == __CON_S_PLAYING) {
+        __REPLY_STATUS(p, __RESPONCE_STR_METHODINVAL);
+        __REPLY_CANNED(p, __TERM);
+        return;
+    }
+
+    /* unicast UDP is sent to the ports the client tells */
+    if (!p->client_multicast && !p->client_tcp && p->client_port_rtp == 0) {
+        __REPLY_STATUS(p, __RESPONCE_STR_UNSUPPORTEDTRANSPORT);
+        __REPLY_CANNED(p, __TERM);
+        return;
+    }
+
+    /* make randomized session id, by which any rtsp thread finds the session */
+    if (__session_list(p, h) != SUCCESS) {
+        __method_error(p, h);
+        return;
+    }
 
     p->ssrc = (unsigned int)(__get_random_llu(&h->ctx));
 
     DBG("created session id %llx\n", p->session_id);
-    p->server_port_rtp = SERVER_RTP_PORT;
-    p->server_port_rtcp = SERVER_RTCP_PORT;
 
-    fprintf(p->fp_tcp_write, "RTSP/1.0 200 OK\r\n"
-            "CSeq: %d\r\n"
-            "Session: %llx\r\n"
+    if (p->client_multicast) {
+        if (__bind_multicast(p, h) != SUCCESS) {
+            __REPLY_STATUS(p, __RESPONCE_STR_UNSUPPORTEDTRANSPORT);
+            __REPLY_CANNED(p, __TERM);
+            return;
+        }
+
+        /* the group stream is the same for everyone. its transport is rendered once */
+        __REPLY_STATUS(p, __RESPONCE_STR_OK);
+        __reply(p, "Session: %llx\r\n", p->session_id);
+        __reply_append(p, h->mcast_transport, h->mcast_transport_len);
+
+        p->con_state = __CON_S_READY;
+        return;
+    }
+
+    if (p->client_tcp) {
+        if (__bind_interleaved(p, h) != SUCCESS) {
+            __method_error(p, h);
+            return;
+        }
+
+        __REPLY_STATUS(p, __RESPONCE_STR_OK);
+        __reply(p, "Session: %llx\r\n"
+                "Transport: RTP/AVP/TCP;unicast;interleaved=%u-%u\r\n"
+                "\r\n" , p->session_id,
+                p->rtp_channel, p->rtcp_channel);
+
+        p->con_state = __CON_S_READY;
+        return;
+    }
+
+    if (__bind_udp(p, h) != SUCCESS) {
+        __method_error(p, h);
+        return;
+    }
+
+    __REPLY_STATUS(p, __RESPONCE_STR_OK);
+    __reply(p, "Session: %llx\r\n"
             "Transport: RTP/AVP/UDP;unicast;client_port=%u-%u;server_port=%u-%u\r\n"
-            "\r\n" , p->cseq, p->session_id,
+            "\r\n" , p->session_id,
             p->client_port_rtp, p->client_port_rtcp,
             p->server_port_rtp, p->server_port_rtcp);
 
@@ -327,50 +770,116 @@ static void __method_setup(struct connection_item_t *p, rtsp_handle h)
 
 static void __method_pause(struct connection_item_t *p, rtsp_handle h)
 {
-    fprintf(p->fp_tcp_write, "RTSP/1.0 "__RESPONCE_STR_METHODNOTALLOWED "\r\n");
+    __REPLY_STATUS(p, __RESPONCE_STR_METHODNOTALLOWED);
+    __REPLY_CANNED(p, __TERM);
 
 }
 static void __method_record(struct connection_item_t *p, rtsp_handle h)
 {
-    fprintf(p->fp_tcp_write, "RTSP/1.0 " __RESPONCE_STR_METHODNOTALLOWED "\r\n");
+    __REPLY_STATUS(p, __RESPONCE_STR_METHODNOTALLOWED);
+    __REPLY_CANNED(p, __TERM);
 
 }
 static void __method_error(struct connection_item_t *p, rtsp_handle h)
 {
-    fprintf(p->fp_tcp_write, "RTSP/1.0 " __RESPONCE_STR_SERVERERROR "\r\n");
+    __REPLY_STATUS(p, __RESPONCE_STR_SERVERERROR);
+    __REPLY_CANNED(p, __TERM);
 
 }
 
+/* 's' is the session, which may have been set up over another connection than 'p' */
 static void __method_play(struct connection_item_t *p, rtsp_handle h)
 {
-    fprintf(p->fp_tcp_write, "RTSP/1.0 200 OK\r\n"
-            "CSeq: %d\r\n"
-            "Session: %llx\r\n"
-            "\r\n" , p->cseq, p->session_id);
+    struct connection_item_t *s;
+    enum __connection_state_e state;
+
+    if ((s = __session_find(p, h)) == NULL) {
+        __REPLY_STATUS(p, __RESPONCE_STR_SESSIONNOTFOUND);
+        __REPLY_CANNED(p, __TERM);
+        return;
+    }
+
+    state = __atomic_load_n(&s->con_state, __ATOMIC_SEQ_CST);
+
+    /* transport is given by SETUP */
+    if (state == __CON_S_DISCONNECTED || (s->server_rtp_fd == 0 && !s->interleaved && !s->multicast)) {
+        __REPLY_STATUS(p, __RESPONCE_STR_METHODINVAL);
+        __REPLY_CANNED(p, __TERM);
+        return;
+    }
+
+    /* the sender owns the stream state of a PLAYING session */
+    if (state == __CON_S_PLAYING) {
+        __REPLY_STATUS(p, __RESPONCE_STR_OK);
+        __reply(p, "Session: %llx\r\n\r\n", s->session_id);
+        return;
+    }
+
+    s->zc_issued = 0;
+    s->zc_completed = 0;
+    s->wait_idr = FALSE;
+    s->gop_pos = h->gop ? 0 : -1;
+    s->drop_frames = 0;
+    s->drop_packets = 0;
+
+    s->rtp_timestamp = rand_r(&h->ctx);
+    s->rtp_seq = rand_r(&h->ctx);
+    s->rtcp_octet = 0; 
+    s->rtcp_packet_cnt= 0; 
+    s->rtcp_tick_org = 150; // TODO: must be variant
+    s->rtcp_tick = s->rtcp_tick_org;
+
+    /* the first report must not overtake the staged response. the sender makes it */
+    if (s->interleaved) {
+        s->rtcp_tick = 0;
+    }
+
+    /* the thread of the session may hang it up meanwhile */
+    if (!__atomic_compare_exchange_n(&s->con_state, &state, __CON_S_PLAYING, FALSE, 
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        __REPLY_STATUS(p, __RESPONCE_STR_SESSIONNOTFOUND);
+        __REPLY_CANNED(p, __TERM);
+        return;
+    }
+
+    h->sessions_changed = TRUE;
 
-    ASSERT(__bind_rtcp(p) == SUCCESS, return );
-    ASSERT(__bind_rtp(p) == SUCCESS, return );
-    p->rtp_timestamp = rand_r(&h->ctx);
-    p->rtp_seq = rand_r(&h->ctx);
-    p->rtcp_octet = 0; 
-    p->rtcp_packet_cnt= 0; 
-    p->rtcp_tick_org = 150; // TODO: must be variant
-    p->rtcp_tick = p->rtcp_tick_org;
+    __REPLY_STATUS(p, __RESPONCE_STR_OK);
+    __reply(p, "Session: %llx\r\n\r\n", s->session_id);
 
-    p->con_state = __CON_S_PLAYING;
+    /* the group has a single report, made by the sender */
+    if (s->multicast || s->interleaved) {
+        return;
+    }
 
-    ASSERT(__rtcp_send_sr(p) == SUCCESS, return );
+    ASSERT(__rtcp_send_sr(s) == SUCCESS, return );
 
 }
 
 static int __method_teardown(struct connection_item_t *p, rtsp_handle h)
 {
-    fprintf(p->fp_tcp_write, "RTSP/1.0 200 OK\r\n"
-            "CSeq: %d\r\n"
-            "Session: %llx\r\n"
-            "\r\n" , p->cseq, p->session_id);
+    struct connection_item_t *s;
+    enum __connection_state_e state;
 
-    p->con_state = __CON_S_INIT;
+    if ((s = __session_find(p, h)) == NULL) {
+        __REPLY_STATUS(p, __RESPONCE_STR_SESSIONNOTFOUND);
+        __REPLY_CANNED(p, __TERM);
+        return SUCCESS;
+    }
+
+    __REPLY_STATUS(p, __RESPONCE_STR_OK);
+    __reply(p, "Session: %llx\r\n\r\n", s->session_id);
+
+    /* a session hung up meanwhile is swept by its thread */
+    state = __atomic_load_n(&s->con_state, __ATOMIC_SEQ_CST);
+
+    if (state != __CON_S_DISCONNECTED && 
+            __atomic_compare_exchange_n(&s->con_state, &state, __CON_S_INIT, FALSE, 
+                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) && state == __CON_S_PLAYING) {
+        h->sessions_changed = TRUE;
+    }
+
+    __session_unlist(s, h);
 
 
     return SUCCESS;
@@ -381,66 +890,138 @@ static int __method_teardown(struct connection_item_t *p, rtsp_handle h)
  *              METHOD IMPLEMENTATIONS
  ******************************************************************************/
 
-static int __message_proc_sock(struct list_t *e, void *p)
+/* SETUP and PLAY rewrite what the sender reads of the session, which it may do until no snapshot 
+   lists it. both leave a PLAYING session alone. called under rtsp_lock */
+static inline int __request_waits(struct connection_item_t *con, rtsp_handle h)
 {
-    struct connection_item_t *con;
-    void (*next_fxn)(struct connection_item_t *p, char *buf) = __parse_head;
-    struct sock_select_t *socks = p;
-    char buf[__RTSP_TCP_BUF_SIZE];
-    rtsp_handle h = NULL;
+    struct connection_item_t *s;
+
+    if (con->parser_state == __PARSER_S_ERROR) {
+        return FALSE;
+    }
 
-    DASSERT(socks, return FAILURE);
-    MUST(h = socks->h_rtsp, return FAILURE);
+    switch (con->method) {
+        case __METHOD_SETUP: s = con; break;
+        case __METHOD_PLAY: s = __session_find(con, h); break;
+        default: return FALSE;
+    }
+
+    return s && s->snap_pins > 0 && __atomic_load_n(&s->con_state, __ATOMIC_SEQ_CST) != __CON_S_PLAYING;
+}
+
+/* answer the request parsed on 'con'. __REQUEST_DEFERRED leaves it parsed for a later call */
+static int __request_proc(struct connection_item_t *con, rtsp_handle h)
+{
+    /* methods touch what the rtsp threads share. the socket I/O is done unlocked */
+    rtsp_lock(h);
+
+    if (__request_waits(con, h)) {
+        /* the current snapshot may list it still */
+        if (!con->request_deferred) {
+            DBG("request waits for the sender to let go of the session\n");
+            h->sessions_changed = TRUE;
+        }
+        con->request_deferred = TRUE;
+        rtsp_unlock(h);
+        return __REQUEST_DEFERRED;
+    }
+
+    con->request_deferred = FALSE;
+
+    if (con->parser_state == __PARSER_S_ERROR) {
+
+        __method_error(con,h);
+
+    } else {
+
+        switch(con->method){
+            case __METHOD_OPTIONS: __method_options(con, h);break;
+            case __METHOD_DESCRIBE: __method_describe(con, h);break;
+            case __METHOD_SETUP: __method_setup(con, h);break;
+            case __METHOD_PLAY: __method_play(con, h);break;
+            case __METHOD_PAUSE: __method_pause(con, h);break;
+            case __METHOD_RECORDING: __method_record(con, h);break;
+            case __METHOD_TEARDOWN: __method_teardown(con, h);break;
+            case __METHOD_NONE: __method_error(con, h);break;
+            default: ERR("unexpected method state\n"); rtsp_unlock(h); return FAILURE;
+        }
+
+    }
 
-    list_upcast(con,e);
+    rtsp_unlock(h);
+
+    con->parser_state = __PARSER_S_INIT;
+    con->method = __METHOD_NONE;
+    con->client_tcp = FALSE;
+    con->client_multicast = FALSE;
+    con->client_port_rtp = 0;
+    con->client_port_rtcp = 0;
+    con->given_session_id = 0;
+
+    return SUCCESS;
+}
+
+static int __message_proc_sock(struct connection_item_t *con, rtsp_handle h)
+{
+    void (*next_fxn)(struct connection_item_t *p, char *line, size_t len);
+    char *line;
+    size_t len;
+    int ret;
+
+    DASSERT(con, return FAILURE);
+    DASSERT(h, return FAILURE);
 
     if (con->con_state == __CON_S_DISCONNECTED) {
         ERR("zombie connection detected: report to author\n");
         return SUCCESS;
     }
 
-    if (FD_ISSET(con->client_fd, &(socks->rfds))) {
-
-        con->parser_state = __PARSER_S_INIT;
-        con->method = __METHOD_NONE;
+    /* the peer has not taken the previous responses yet. read no more until EPOLLOUT */
+    if (__reply_flush(con) != SUCCESS || __reply_pending(con)) {
+        return SUCCESS;
+    }
 
-        next_fxn = __parse_head;
+    /* a request still waiting comes before what follows it */
+    if (con->request_deferred && (ret = __request_proc(con, h)) != SUCCESS) {
+        return ret == __REQUEST_DEFERRED ? SUCCESS : FAILURE;
+    }
 
+    /* edge triggered: serve requests until the socket runs dry. a request cut by the read 
+       keeps its parser state in the connection until the rest arrives */
+    do {
         /* parse line by line. hereafter parser is switched according to the finite state machine */
-        while(__read_line(con, buf)) {
-            if (next_fxn) {
-                next_fxn(con, buf);
-                next_fxn = __state_table[con->method][con->parser_state];
+        while (__read_line(con, &line, &len)) {
+            if (len > 0) {
+                if ((next_fxn = __state_table[con->method][con->parser_state])) {
+                    next_fxn(con, line, len);
+                }
+                continue;
             }
-        }
 
-        if (con->parser_state == __PARSER_S_ERROR) {
-
-            __method_error(con,h);
-
-        } else {
+            /* a stray blank line between requests */
+            if (con->parser_state == __PARSER_S_INIT) {
+                continue;
+            }
 
-            switch(con->method){
-                case __METHOD_OPTIONS: __method_options(con, h);break;
-                case __METHOD_DESCRIBE: __method_describe(con, h);break;
-                case __METHOD_SETUP: __method_setup(con, h);break;
-                case __METHOD_PLAY: __method_play(con, h);break;
-                case __METHOD_PAUSE: __method_pause(con, h);break;
-                case __METHOD_RECORDING: __method_record(con, h);break;
-                case __METHOD_TEARDOWN: __method_teardown(con, h);break;
-                case __METHOD_NONE: 
-                    /* state DISCONNECTED connections should be gabage collected immediately.
-                       but sending thread might watches the connection right now.
-                       so the connection might live at here */
-                    ASSERT(con->con_state == __CON_S_DISCONNECTED, return FAILURE); 
-                    break;
-                default: ERR("unexpected method state\n"); return FAILURE;
+            if ((ret = __request_proc(con, h)) != SUCCESS) {
+                return ret == __REQUEST_DEFERRED ? SUCCESS : FAILURE;
             }
 
+            /* pipelined requests are answered together. flush early only when staging runs short */
+            if (sizeof(con->tx_buf) - con->tx_len < __RTSP_TX_RESERVE || con->tx_iovcnt > __RTSP_TX_IOV / 2) {
+                if (__reply_flush(con) != SUCCESS || __reply_pending(con)) {
+                    return SUCCESS;
+                }
+            }
         }
 
-        fflush(con->fp_tcp_write);
-    } 
+        /* until drained. when the peer has gone, the connection is swept by the caller */
+    } while (__rx_fill(con) > 0);
+
+    if (con->con_state != __CON_S_DISCONNECTED) {
+        __reply_flush(con);
+    }
+
     return SUCCESS;
 
 }
@@ -459,24 +1040,44 @@ static int __connection_reset(void *v)
         DBG("force connection to close\n");
     }
 
-    FCLOSE(p->fp_tcp_read);
-    FCLOSE(p->fp_tcp_write);
+    if(p->drop_frames > 0) {
+        DBG("connection dropped %u frames (%llu packets)\n", p->drop_frames, p->drop_packets);
+    }
+
     CLOSE(p->client_fd);
 
     p->client_fd = 0;
     p->con_state = __CON_S_DISCONNECTED;
-
-    if (p->server_rtcp_fd != 0) {
-        CLOSE(p->server_rtcp_fd);
-        p->server_rtcp_fd = 0;
-    }
-
-    if (p->server_rtp_fd != 0) {
-        CLOSE(p->server_rtp_fd);
-        p->server_rtp_fd = 0;
-    }
+    p->parser_state = __PARSER_S_INIT;
+    p->method = __METHOD_NONE;
+
+    p->rx_head = 0;
+    p->rx_tail = 0;
+    p->rx_scan = 0;
+    __reply_unpin(p, p->tx_iov_first, p->tx_iovcnt);
+    p->tx_len = 0;
+    p->tx_iov_first = 0;
+    p->tx_iovcnt = 0;
+
+    __unbind_udp(p);
+
+    /* the sender holds no reference any more */
+    interleaved_ring_delete(p->ring);
+    p->ring = NULL;
+    p->interleaved = FALSE;
+    p->client_tcp = FALSE;
+    p->rx_skip = 0;
+    p->multicast = FALSE;
+    p->client_multicast = FALSE;
+
+    p->zc_issued = 0;
+    p->zc_completed = 0;
+    FREE(p->zc_headers);
+    p->zc_headers_cap = 0;
 
     p->given_session_id = 0;
+    p->session_listed = FALSE;
+    p->request_deferred = FALSE;
     p->cseq = 0;
 
     ctx = p->rtp_timestamp;
@@ -489,14 +1090,18 @@ static int __connection_reset(void *v)
 }
 
     static inline int
-__connection_list_add(bufpool_handle con_pool, struct list_head_t *head,int fd, struct sockaddr_in addr)
+__connection_list_add(bufpool_handle con_pool, struct list_head_t *head,int fd, struct sockaddr_in addr,
+        struct connection_item_t **p_con)
 {
     DASSERT(head,return FAILURE);
     DASSERT(fd > 0, return FAILURE);
 
     struct connection_item_t *p = NULL;
 
-    ASSERT(bufpool_get_free(con_pool, &p) == SUCCESS,return FAILURE);
+    /* 'fd' is ours from now on, also on failure */
+    ASSERT(bufpool_get_free(con_pool, &p) == SUCCESS, ({
+                close(fd);
+                return FAILURE;}));
 
     DASSERT(p, return FAILURE);
 
@@ -505,67 +1110,171 @@ __connection_list_add(bufpool_handle con_pool, struct list_head_t *head,int fd,
     p->addr=addr;
     p->client_fd=fd;
 
-    ASSERT((p->fp_tcp_read = fdopen(fd,"r")), goto error);
-    ASSERT((p->fp_tcp_write = fdopen(fd,"w")), goto error);
-
     p->con_state = __CON_S_INIT;
+    p->parser_state = __PARSER_S_INIT;
+    p->method = __METHOD_NONE;
 
-    return list_add(head,&(p->list_entry));
-error:
-    __connection_reset(&p->list_entry);
-    return FAILURE;
-}
+    *p_con = p;
 
-static inline int __find_fd_max(struct list_head_t *head)
-{
-    struct list_t *p;
-    struct connection_item_t *c;
-    int m = -1;
-    p = head->list;
-    while(p) {
-        list_upcast(c,p);
-        if (c->con_state != __CON_S_DISCONNECTED) {
-            m = max(c->client_fd,m);
-        }
-        p = p->next;
-    }
-    return m;
+    /* O(1): order of connections does not matter */
+    return list_push(head,&(p->list_entry));
 }
 
-static inline int __set_select_sock(struct list_t *p, void *param)
+static inline int __epoll_add(int epfd, int fd, unsigned int events, void *ptr)
 {
-    struct connection_item_t *c;
-    struct sock_select_t *socks = param;
+    struct epoll_event ev = {};
 
-    list_upcast(c,p);
+    ev.events = events | EPOLLET;
+    ev.data.ptr = ptr;
 
-    FD_SET(c->client_fd, &(socks->rfds));
+    ASSERT(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == 0, ({
+                ERR("epoll_ctl:%s\n",strerror(errno));
+                return FAILURE;}));
 
     return SUCCESS;
 }
 
-static inline int __bind_tcp(unsigned short port)
+/* O(n): publish the PLAYING sessions for the sender. called by an rtsp thread under rtsp_lock */
+static int __session_publish(rtsp_handle h)
 {
-    int server_fd = 0;
-    struct sockaddr_in addr;
-    int tmp = 1;
-
-    /* setup serve rsocket */
-    ASSERT((server_fd = socket(AF_INET,SOCK_STREAM,0)) > 0, ({
-                ERR("socket:%s\n",strerror(errno));
-                goto error;}));
+    struct session_snapshot_t *snap;
+    struct session_snapshot_t *old;
+    struct connection_item_t *c;
+    struct list_t *e;
+    unsigned int t;
+    int num = 0;
+    int group = 0;
+
+    for(t = 0; t < h->attr.control_threads; t++) {
+        for(e = h->ctls[t]->con_list.list; e; e = e->next) {
+            list_upcast(c,e);
+            if(c->con_state == __CON_S_PLAYING) {
+                if(c->multicast) group++;
+                else num++;
+            }
+        }
+    }
 
-    setsockopt(server_fd,SOL_SOCKET,SO_REUSEADDR,&tmp,sizeof(tmp));
+    ASSERT(snap = calloc(1, sizeof(struct session_snapshot_t) + (num + 1) * sizeof(struct connection_item_t *)), 
+            return FAILURE);
 
-    addr.sin_port=htons(port);
-    addr.sin_addr.s_addr=htonl(INADDR_ANY);
-    addr.sin_family=AF_INET;
+    /* multicast sessions are served once by the group stream */
+    if(group > 0) {
+        snap->cons[snap->num++] = h->mcast;
+    }
 
-    ASSERT(bind(server_fd,(struct sockaddr *)&addr,sizeof(addr)) == 0, ({
+    for(t = 0; t < h->attr.control_threads; t++) {
+        for(e = h->ctls[t]->con_list.list; e; e = e->next) {
+            list_upcast(c,e);
+            /* sessions start under the lock, so there are no more than counted */
+            if(c->con_state == __CON_S_PLAYING && !c->multicast) {
+                /* the snapshot keeps the connection alive even after it is swept out */
+                if(bufpool_attach(c->pool, c) == SUCCESS) {
+                    c->snap_pins++;
+                    snap->cons[snap->num++] = c;
+                }
+            }
+        }
+    }
+
+    old = h->sessions;
+    snap->version = old->version + 1;
+
+    __atomic_store_n(&h->sessions, snap, __ATOMIC_SEQ_CST);
+
+    old->next_retired = h->retired;
+    h->retired = old;
+
+    DBG("sessions v%llu: %d playing, %d in the group\n", snap->version, num, group);
+
+    __session_reclaim(h);
+
+    return SUCCESS;
+}
+
+/* free retired snapshots unless the sender still reads one. TRUE when some are left */
+static int __session_reclaim(rtsp_handle h)
+{
+    struct session_snapshot_t **pp = &h->retired;
+    struct session_snapshot_t *p;
+    struct session_snapshot_t *hazard = __atomic_load_n(&h->hazard, __ATOMIC_SEQ_CST);
+
+    while((p = *pp)) {
+        if(p == hazard) {
+            pp = &p->next_retired;
+            continue;
+        }
+
+        *pp = p->next_retired;
+        __session_snapshot_delete(p);
+    }
+
+    return h->retired != NULL;
+}
+
+/* O(1): list the session under a fresh id. called under rtsp_lock */
+static inline int __session_list(struct connection_item_t *p, rtsp_handle h)
+{
+    __session_unlist(p, h);
+
+    do {
+        p->session_id = __get_random_llu(&h->ctx);
+    } while (p->session_id == 0 || hash_exist(h->session_table, p->session_id));
+
+    ASSERT(hash_add(h->session_table, p->session_id, p) == SUCCESS, return FAILURE);
+
+    p->session_listed = TRUE;
+
+    return SUCCESS;
+}
+
+static inline void __session_unlist(struct connection_item_t *p, rtsp_handle h)
+{
+    if (p->session_listed) {
+        MUST(hash_del(h->session_table, p->session_id) == SUCCESS, 
+                ERR("session %llx is not listed\n", p->session_id));
+        p->session_listed = FALSE;
+    }
+}
+
+/* the session named by the Session header, on whichever connection it was set up, or that of 
+   'p' without one. NULL when no such session is listed. called under rtsp_lock */
+static inline struct connection_item_t *__session_find(struct connection_item_t *p, rtsp_handle h)
+{
+    if (p->given_session_id == 0 || (p->session_listed && p->given_session_id == p->session_id)) {
+        return p;
+    }
+
+    return hash_lookup(h->session_table, p->given_session_id);
+}
+
+/* every rtsp thread binds one, and the kernel hands each new connection to one of them */
+static inline int __bind_tcp(unsigned short port, int backlog)
+{
+    int server_fd = 0;
+    union __sockaddr_t addr = {};
+    int tmp = 1;
+
+    /* setup serve rsocket */
+    ASSERT((server_fd = socket(AF_INET,SOCK_STREAM,0)) > 0, ({
+                ERR("socket:%s\n",strerror(errno));
+                goto error;}));
+
+    setsockopt(server_fd,SOL_SOCKET,SO_REUSEADDR,&tmp,sizeof(tmp));
+
+    ASSERT(setsockopt(server_fd,SOL_SOCKET,SO_REUSEPORT,&tmp,sizeof(tmp)) == 0, ({
+                ERR("setsockopt:%s\n",strerror(errno));
+                goto error;}));
+
+    addr.in.sin_port=htons(port);
+    addr.in.sin_addr.s_addr=htonl(INADDR_ANY);
+    addr.in.sin_family=AF_INET;
+
+    ASSERT(bind(server_fd,&addr.sa,sizeof(addr.in)) == 0, ({
                 ERR("bind:%s\n",strerror(errno));
                 goto error;}));
 
-    ASSERT(listen(server_fd,5) >= 0, ({
+    ASSERT(listen(server_fd,backlog) >= 0, ({
                 ERR("listen:%s\n",strerror(errno));
                 goto error;}));
 
@@ -578,129 +1287,403 @@ error:
     return FAILURE;
 }
 
-static inline int __bind_rtp(struct connection_item_t *con )
+/* enable requested transmit backends the kernel offers on 'fd' */
+static inline unsigned int __probe_tx_caps(int fd, unsigned int tx_flags)
 {
-    int server_fd = -1;
-    struct sockaddr_in addr = {};
+    unsigned int caps = 0;
     int tmp;
 
-    /* reset socket */
-    if (con->server_rtp_fd != 0) {
-        CLOSE(con->server_rtp_fd);
-        //FCLOSE(con->fp_rtp_write);
-        con->server_rtp_fd = 0;
+    if (tx_flags & RTSP_TX_GSO) {
+        /* probe only. segment size is given to each message */
+        tmp = sizeof(rtp_hdr_t) + __RTP_MAXPAYLOADSIZE;
+        if (setsockopt(fd,SOL_UDP,UDP_SEGMENT,&tmp,sizeof(tmp)) == 0) {
+            tmp = 0;
+            setsockopt(fd,SOL_UDP,UDP_SEGMENT,&tmp,sizeof(tmp));
+            caps |= RTSP_TX_GSO;
+        } else {
+            DBG("UDP_SEGMENT unavailable:%s\n",strerror(errno));
+        }
     }
-    /* setup serve rsocket */
-    ASSERT((server_fd = socket(AF_INET,SOCK_DGRAM,0)) > 0, ({
+
+    if (tx_flags & RTSP_TX_ZEROCOPY) {
+        tmp = 1;
+        if (setsockopt(fd,SOL_SOCKET,SO_ZEROCOPY,&tmp,sizeof(tmp)) == 0) {
+            caps |= RTSP_TX_ZEROCOPY;
+        } else {
+            DBG("SO_ZEROCOPY unavailable:%s\n",strerror(errno));
+        }
+    }
+
+    return caps;
+}
+
+static inline int __udp_socket(unsigned short port, int reuse)
+{
+    int fd;
+    union __sockaddr_t addr = {};
+    int tmp;
+
+    ASSERT((fd = socket(AF_INET,SOCK_DGRAM | SOCK_CLOEXEC,0)) > 0, ({
                 ERR("socket:%s\n",strerror(errno));
-                goto error;}));
+                return FAILURE;}));
 
-    addr.sin_port=htons(con->server_port_rtp);
-    addr.sin_addr.s_addr=htonl(INADDR_ANY);
-    addr.sin_family=AF_INET;
-    
-    tmp = 1;
-    setsockopt(server_fd,SOL_SOCKET,SO_REUSEADDR,&tmp,sizeof(tmp));
+    addr.in.sin_port=htons(port);
+    addr.in.sin_addr.s_addr=htonl(INADDR_ANY);
+    addr.in.sin_family=AF_INET;
 
-    ASSERT(bind(server_fd,(struct sockaddr *)&addr,sizeof(addr)) == 0, ({
-                ERR("bind:%s\n",strerror(errno));
-                goto error;}));
+    if (reuse) {
+        tmp = 1;
+        setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,&tmp,sizeof(tmp));
+    }
 
-    addr = con->addr;
-    addr.sin_port=htons(con->client_port_rtp);
+    /* silent. a port in use is no error while looking for a free pair */
+    if (bind(fd,&addr.sa,sizeof(addr.in)) != 0) {
+        close(fd);
+        return FAILURE;
+    }
 
-    ASSERT(connect(server_fd,(struct sockaddr *)&addr,sizeof(addr)) == 0, ({
-                ERR("connect:%s\n",strerror(errno));
-                goto error;}));
+    return fd;
+}
+
+/* the rtp socket may hold packets of 'send_queue_depth' sessions at most */
+static inline int __udp_setup_rtp(int fd, unsigned int sessions, const struct rtsp_attr_t *attr)
+{
+    int tmp;
 
     /* set the socket to non-blocking */
     tmp = 1;
-    ASSERT(ioctl(server_fd,FIONBIO, &tmp) != -1, ({
+    ASSERT(ioctl(fd,FIONBIO, &tmp) != -1, ({
                 ERR("ioctl:%s\n",strerror(errno));
-                goto error;}));
+                return FAILURE;}));
 
-    con->server_rtp_fd = server_fd;
+    /* bound the send queue of the client */
+    tmp = min((unsigned long long)attr->send_queue_depth * __RTP_PACKETSIZE * sessions, 0x7FFFFFFFULL);
+    TEST(setsockopt(fd,SOL_SOCKET,SO_SNDBUF,&tmp,sizeof(tmp)) == 0,
+            ERR("setsockopt:%s\n",strerror(errno)));
 
     return SUCCESS;
-error:
-    if (server_fd > 0) close(server_fd);
-    return FAILURE;
 }
 
-static inline int __bind_rtcp(struct connection_item_t *con )
+static inline void __unbind_udp(struct connection_item_t *con)
+{
+    /* shared sockets are closed with the handle */
+    if (con->udp_shared) {
+        con->server_rtp_fd = 0;
+        con->server_rtcp_fd = 0;
+        con->udp_shared = FALSE;
+    }
+
+    CLOSE(con->server_rtp_fd);
+    CLOSE(con->server_rtcp_fd);
+
+    con->tx_caps = 0;
+}
+
+/* the ring holds what the socket cannot take of 'send_queue_depth' packets, and room for 
+   the responses on top. O(1) */
+static inline int __bind_interleaved(struct connection_item_t *con, rtsp_handle h)
 {
-    int server_fd = -1;
-    struct sockaddr_in addr = {};
+    __unbind_udp(con);
+
+    if (con->ring == NULL) {
+        ASSERT(con->ring = interleaved_ring_create(
+                    h->attr.send_queue_depth * (__INTERLEAVED_HDR_SIZE + __RTP_PACKETSIZE) + __RTSP_TX_BUF_SIZE),
+                return FAILURE);
+    }
+
+    con->rtp_channel = con->client_channel_rtp;
+    con->rtcp_channel = con->client_channel_rtcp;
+    con->interleaved = TRUE;
+    con->multicast = FALSE;
+
+    return SUCCESS;
+}
+
+/* O(1): the session only joins the group stream. FAILURE when the handle has none */
+static inline int __bind_multicast(struct connection_item_t *con, rtsp_handle h)
+{
+    if (h->mcast == NULL) {
+        return FAILURE;
+    }
+
+    __unbind_udp(con);
+
+    con->interleaved = FALSE;
+    con->multicast = TRUE;
+
+    return SUCCESS;
+}
+
+/* the group stream is a connection that is always PLAYING, with sockets connected to the 
+   group. the sender flushes it as any other, once a frame however many sessions watch */
+static inline int __mcast_create(rtsp_handle h)
+{
+    const struct rtsp_attr_t *attr = &h->attr;
+    struct connection_item_t *con;
+    unsigned char ttl = attr->mcast_ttl;
     int tmp;
 
-    /* reset socket */
-    if (con->server_rtcp_fd != 0) {
+    TALLOC(con, return FAILURE);
+    h->mcast = con;
+
+    con->rtp_peer.in.sin_family = AF_INET;
+    con->rtp_peer.in.sin_port = htons(attr->mcast_port);
+
+    ASSERT(inet_pton(AF_INET, attr->mcast_group, &con->rtp_peer.in.sin_addr) == 1 
+            && IN_MULTICAST(ntohl(con->rtp_peer.in.sin_addr.s_addr)), ({
+                ERR("not a multicast group: %s\n", attr->mcast_group);
+                return FAILURE;}));
+
+    con->rtcp_peer = con->rtp_peer;
+    con->rtcp_peer.in.sin_port = htons(attr->mcast_port + 1);
+
+    ASSERT((con->server_rtp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) > 0, ({
+                ERR("socket:%s\n",strerror(errno));
+                con->server_rtp_fd = 0;
+                return FAILURE;}));
+
+    ASSERT((con->server_rtcp_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) > 0, ({
+                ERR("socket:%s\n",strerror(errno));
+                con->server_rtcp_fd = 0;
+                return FAILURE;}));
+
+    tmp = ttl;
+    ASSERT(setsockopt(con->server_rtp_fd, IPPROTO_IP, IP_MULTICAST_TTL, &tmp, sizeof(tmp)) == 0 
+            && setsockopt(con->server_rtcp_fd, IPPROTO_IP, IP_MULTICAST_TTL, &tmp, sizeof(tmp)) == 0, ({
+                ERR("setsockopt:%s\n",strerror(errno));
+                return FAILURE;}));
+
+    ASSERT(connect(con->server_rtp_fd, &con->rtp_peer.sa, sizeof(con->rtp_peer.in)) == 0
+            && connect(con->server_rtcp_fd, &con->rtcp_peer.sa, sizeof(con->rtcp_peer.in)) == 0, ({
+                ERR("connect:%s\n",strerror(errno));
+                return FAILURE;}));
+
+    ASSERT(__udp_setup_rtp(con->server_rtp_fd, 1, attr) == SUCCESS, return FAILURE);
+
+    con->tx_caps = __probe_tx_caps(con->server_rtp_fd, attr->tx_flags & ~RTSP_TX_ZEROCOPY);
+
+    con->ssrc = (unsigned int)__get_random_llu(&h->ctx);
+    con->rtp_seq = rand_r(&h->ctx);
+    con->rtp_timestamp = rand_r(&h->ctx);
+    con->rtcp_tick_org = 150;
+    con->rtcp_tick = 0;
+    con->gop_pos = -1;
+    con->con_state = __CON_S_PLAYING;
+
+    h->mcast_transport_len = snprintf(h->mcast_transport, sizeof(h->mcast_transport), 
+            "Transport: RTP/AVP;multicast;destination=%s;port=%u-%u;ttl=%u;ssrc=%08X\r\n\r\n",
+            inet_ntoa(con->rtp_peer.in.sin_addr), attr->mcast_port, attr->mcast_port + 1, 
+            ttl, con->ssrc);
+    ASSERT(h->mcast_transport_len > 0 && h->mcast_transport_len < (int)sizeof(h->mcast_transport), 
+            return FAILURE);
+
+    return SUCCESS;
+}
+
+static inline void __mcast_delete(rtsp_handle h)
+{
+    struct connection_item_t *con = h->mcast;
+
+    if (con) {
+        CLOSE(con->server_rtp_fd);
         CLOSE(con->server_rtcp_fd);
-        con->server_rtcp_fd = 0;
+        FREE(con->zc_headers);
+        FREE(con);
+        h->mcast = NULL;
     }
+}
 
-    /* setup serve rsocket */
-    ASSERT((server_fd = socket(AF_INET,SOCK_DGRAM,0)) > 0, ({
-                ERR("socket:%s\n",strerror(errno));
-                goto error;}));
+/* each worker keeps its own copy of the packet descriptors and the GOP burst state. the
+   thread pool takes the worker itself, the handle its batches */
+static inline struct __rtp_worker_t *__worker_create(rtsp_handle h, unsigned int index)
+{
+    struct __rtp_worker_t *nh = NULL;
 
-    addr.sin_port=htons(con->server_port_rtcp);
-    addr.sin_addr.s_addr=htonl(INADDR_ANY);
-    addr.sin_family=AF_INET;
+    TALLOC(nh, return NULL);
 
-    tmp = 1;
-    setsockopt(server_fd,SOL_SOCKET,SO_REUSEADDR,&tmp,sizeof(tmp));
+    nh->index = index;
+    ASSERT(nh->batch = __rtp_batch_create(), goto error);
+    if (h->gop) {
+        ASSERT(nh->gop_batch = __rtp_batch_create(), goto error);
+    }
 
-    ASSERT(bind(server_fd,(struct sockaddr *)&addr,sizeof(addr)) == 0, ({
-                ERR("bind:%s\n",strerror(errno));
-                goto error;}));
+    return nh;
+error:
+    __rtp_batch_delete(nh->batch);
+    FREE(nh);
+    return NULL;
+}
+
+static inline void __workers_delete(rtsp_handle h)
+{
+    unsigned int i;
+
+    if (h->workers) {
+        for (i = 0; i < h->attr.send_workers; i++) {
+            if (h->workers[i]) {
+                __rtp_batch_delete(h->workers[i]->batch);
+                __rtp_batch_delete(h->workers[i]->gop_batch);
+            }
+        }
+        FREE(h->workers);
+    }
+}
+
+/* done at SETUP, so that the reply tells the ports and PLAY creates nothing. O(1) but for
+   RTSP_UDP_RANGE, which walks the range from the pair after the last one given and lets bind() 
+   tell a free pair */
+static inline int __bind_udp(struct connection_item_t *con, rtsp_handle h)
+{
+    const struct rtsp_attr_t *attr = &h->attr;
+    int rtp_fd = -1;
+    int rtcp_fd = -1;
+    unsigned int port = 0;
+    unsigned int num;
+    unsigned int i;
+
+    __unbind_udp(con);
+
+    con->interleaved = FALSE;
+    con->multicast = FALSE;
+
+    con->rtp_peer.in = con->addr;
+    con->rtp_peer.in.sin_port = htons(con->client_port_rtp);
+    con->rtcp_peer.in = con->addr;
+    con->rtcp_peer.in.sin_port = htons(con->client_port_rtcp);
+
+    if (attr->udp_mode == RTSP_UDP_SHARED) {
+        con->server_rtp_fd = h->udp_rtp_fd;
+        con->server_rtcp_fd = h->udp_rtcp_fd;
+        con->server_port_rtp = attr->udp_port_min;
+        con->server_port_rtcp = attr->udp_port_min + 1;
+        con->tx_caps = h->udp_tx_caps;
+        con->udp_shared = TRUE;
 
-    addr = con->addr;
-    addr.sin_port=htons(con->client_port_rtcp);
+        return SUCCESS;
+    }
+
+    if (attr->udp_mode == RTSP_UDP_RANGE) {
+        num = (attr->udp_port_max - attr->udp_port_min + 1) / 2;
+
+        for (i = 0; i < num && rtcp_fd < 0; i++) {
+            port = attr->udp_port_min + 2 * ((h->udp_cursor + i) % num);
+
+            if ((rtp_fd = __udp_socket(port, FALSE)) < 0) {
+                continue;
+            }
+
+            if ((rtcp_fd = __udp_socket(port + 1, FALSE)) < 0) {
+                close(rtp_fd);
+                rtp_fd = -1;
+            }
+        }
+
+        ASSERT(rtcp_fd > 0, ({
+                    ERR("no free port pair in %u-%u\n", attr->udp_port_min, attr->udp_port_max);
+                    goto error;}));
+
+        h->udp_cursor = (port - attr->udp_port_min) / 2 + 1;
+
+        con->server_port_rtp = port;
+        con->server_port_rtcp = port + 1;
+    } else {
+        ASSERT((rtp_fd = __udp_socket(SERVER_RTP_PORT, TRUE)) > 0, ({
+                    ERR("bind:%s\n",strerror(errno));
+                    goto error;}));
+        ASSERT((rtcp_fd = __udp_socket(SERVER_RTCP_PORT, TRUE)) > 0, ({
+                    ERR("bind:%s\n",strerror(errno));
+                    goto error;}));
+
+        con->server_port_rtp = SERVER_RTP_PORT;
+        con->server_port_rtcp = SERVER_RTCP_PORT;
+    }
 
-    ASSERT(connect(server_fd,(struct sockaddr *)&addr,sizeof(addr)) == 0, ({
+    ASSERT(connect(rtp_fd,&con->rtp_peer.sa,sizeof(con->rtp_peer.in)) == 0, ({
                 ERR("connect:%s\n",strerror(errno));
                 goto error;}));
 
-    con->server_rtcp_fd = server_fd;
+    ASSERT(connect(rtcp_fd,&con->rtcp_peer.sa,sizeof(con->rtcp_peer.in)) == 0, ({
+                ERR("connect:%s\n",strerror(errno));
+                goto error;}));
+
+    ASSERT(__udp_setup_rtp(rtp_fd, 1, attr) == SUCCESS, goto error);
+
+    con->tx_caps = __probe_tx_caps(rtp_fd, attr->tx_flags);
+    con->server_rtp_fd = rtp_fd;
+    con->server_rtcp_fd = rtcp_fd;
 
     return SUCCESS;
 error:
-    if (server_fd > 0) close(server_fd);
+    if (rtp_fd > 0) close(rtp_fd);
+    if (rtcp_fd > 0) close(rtcp_fd);
     return FAILURE;
 }
 
-static inline int __accept_proc_sock(rtsp_handle h, int server_fd, struct sock_select_t *p_socks)
+/* RTSP_UDP_SHARED: one pair for every session. zerocopy completions of a socket could not 
+   be told apart among sessions, so it is never probed */
+static inline int __bind_udp_shared(rtsp_handle h)
 {
-    unsigned int len;
-    int fd;
-    //int tmp;
-    struct sockaddr_in from_addr;
+    const struct rtsp_attr_t *attr = &h->attr;
+
+    ASSERT((h->udp_rtp_fd = __udp_socket(attr->udp_port_min, FALSE)) > 0, ({
+                ERR("bind %u:%s\n", attr->udp_port_min, strerror(errno));
+                h->udp_rtp_fd = 0;
+                return FAILURE;}));
 
-    if (FD_ISSET(server_fd, &p_socks->rfds) != 0) {
+    ASSERT((h->udp_rtcp_fd = __udp_socket(attr->udp_port_min + 1, FALSE)) > 0, ({
+                ERR("bind %u:%s\n", attr->udp_port_min + 1, strerror(errno));
+                h->udp_rtcp_fd = 0;
+                return FAILURE;}));
 
-        /* accept new connection */
-        len = sizeof(from_addr);
+    ASSERT(__udp_setup_rtp(h->udp_rtp_fd, attr->max_con, attr) == SUCCESS, return FAILURE);
 
-        fd = accept(server_fd,(struct sockaddr *) &from_addr,
-                &len);
+    h->udp_tx_caps = __probe_tx_caps(h->udp_rtp_fd, attr->tx_flags & ~RTSP_TX_ZEROCOPY);
+
+    return SUCCESS;
+}
+
+static inline int __accept_proc_sock(rtsp_handle h, struct sock_epoll_t *p_socks)
+{
+    socklen_t len;
+    int fd;
+    int ret;
+    union __sockaddr_t from_addr;
+    struct connection_item_t *con;
+
+    /* edge triggered: accept until the backlog is empty */
+    for (;;) {
+        len = sizeof(from_addr.in);
+
+        fd = accept4(p_socks->server_fd, &from_addr.sa,
+                &len, SOCK_NONBLOCK);
 
-        /* we have selected this fd, but still EAGAIN may occur */
         if (fd < 0){
-            ASSERT(errno == EAGAIN, ({
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+
+            ASSERT(errno == EAGAIN || errno == EWOULDBLOCK, ({
                         ERR("accept:%s\n",strerror(errno));
                         return FAILURE;}));
             return SUCCESS;
         }
 
-        /* set server fd to non-blocking */
-        fcntl(fd,F_SETFL,fcntl(fd,F_GETFL) | O_NONBLOCK);
+        /* update connection-list exclusively. refuse the client when we are full */
+        rtsp_lock(h);
+        ret = __connection_list_add(h->con_pool,&p_socks->con_list,fd, from_addr.in, &con);
+        rtsp_unlock(h);
 
-        /* update connection-list exclusively */
-        ASSERT(__connection_list_add(h->con_pool,&h->con_list,fd, from_addr) == SUCCESS,
-                return FAILURE);
+        if (ret != SUCCESS) {
+            ERR("connection refused\n");
+            continue;
+        }
 
+        TEST(__epoll_add(p_socks->epfd, fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP, con) == SUCCESS, ({
+                    __connection_hangup(con);
+                    rtsp_lock(h);
+                    ret = __connection_sweep(p_socks);
+                    rtsp_unlock(h);
+                    ASSERT(ret == SUCCESS, return FAILURE);}));
     }
+
     return SUCCESS;
 }
 
@@ -713,6 +1696,41 @@ static int __connection_is_dead(struct list_t *l)
     return c->con_state == __CON_S_DISCONNECTED;
 }
 
+static int __connection_forget(struct list_t *l, void *v)
+{
+    struct connection_item_t *c;
+
+    list_upcast(c,l);
+
+    if (c->con_state == __CON_S_DISCONNECTED) {
+        __session_unlist(c, v);
+        ASSERT(bufpool_detach(c->pool,c) == SUCCESS, return FAILURE);
+    }
+
+    return SUCCESS;
+}
+
+/* O(n): let go of the connections of the thread that have hung up. a snapshot may still hold 
+   one. called under rtsp_lock by the thread, so that none is closed while it serves them */
+static inline int __connection_sweep(struct sock_epoll_t *p_socks)
+{
+    ASSERT(list_map(&p_socks->con_list, __connection_forget, p_socks->h_rtsp) == SUCCESS, return FAILURE);
+
+    return list_sweep(&p_socks->con_list, __connection_is_dead);
+}
+
+static inline struct sock_epoll_t *__control_create(rtsp_handle h)
+{
+    struct sock_epoll_t *nh = NULL;
+
+    TALLOC(nh, return NULL);
+
+    nh->epfd = -1;
+    nh->h_rtsp = h;
+
+    return nh;
+}
+
 /******************************************************************************
  *                  THREAD CALLBACKS
  ******************************************************************************/
@@ -721,51 +1739,112 @@ static void *rtspThrFxn(void *v)
     thread_handle           h = v;
     rtsp_handle             rh = h->sharedp->param_shared;
     void                    *status = THREAD_FAILURE;
-    struct sock_select_t    socks = {};
-
-    int     ret_select;
-    int     server_fd = -1;
+    struct sock_epoll_t     *socks = h->param_priv;
+    struct connection_item_t *con;
+    struct list_t *e;
+    int     i;
+    int     fd;
+    int     dead;
 
     DASSERT(thread_check_isoleted_job(h) == SUCCESS, goto error);
 
     /* open tcp connection */
-    ASSERT((server_fd = __bind_tcp(SERVER_RTSP_PORT)) > 0, goto error);
+    ASSERT((socks->server_fd = __bind_tcp(SERVER_RTSP_PORT, rh->attr.listen_backlog)) > 0, goto error);
+
+    ASSERT((socks->epfd = epoll_create1(EPOLL_CLOEXEC)) >= 0, ({
+                ERR("epoll_create1:%s\n",strerror(errno));
+                goto error;}));
 
-    socks.nfds = server_fd + 1;
-    socks.h_rtsp = rh;
+    /* the listener and the wake-up event are told apart from connections by their tags */
+    ASSERT(__epoll_add(socks->epfd, socks->server_fd, EPOLLIN, &socks->server_fd) == SUCCESS, goto error);
+    ASSERT(__epoll_add(socks->epfd, rh->wake_fd, EPOLLIN, &rh->wake_fd) == SUCCESS, goto error);
 
     thread_sync_init(h);
 
     while (!gbl_get_quit(h->sharedp->gbl)) {
 
-        FD_ZERO(&(socks.rfds));
-        FD_SET(server_fd, &(socks.rfds));
-        socks.timeout.tv_sec = 1;
-        socks.timeout.tv_usec = 0;
+        /* no periodic wake up, but while the sender holds a retired snapshot or a request waits
+           for it. rtsp_finish() kicks 'wake_fd' */
+        socks->nevents = epoll_wait(socks->epfd, socks->events, __RTSP_EPOLL_EVENTS, 
+                (rh->retired || socks->deferred) ? __SESSION_RECLAIM_MS : -1);
 
-        ASSERT(list_map_inline(&rh->con_list, (__set_select_sock), &socks) == SUCCESS, goto error);
+        if (socks->nevents < 0) {
+            ASSERT(errno == EINTR, ({
+                        ERR("epoll_wait:%s\n",  strerror(errno));
+                        goto error;}));
+            continue;
+        }
 
-        ASSERT((ret_select = select(socks.nfds,&(socks.rfds),NULL,NULL,&(socks.timeout))) >= 0, ({
-                    ERR("select:%s\n",  strerror(errno));
-                    goto error;}));
+        dead = FALSE;
 
-        if (ret_select > 0){
-            /* lock while tcp layer is done */
-            rtsp_lock(rh);
+        /* the connections are ours alone. requests take the lock on their own */
+        for (i = 0; i < socks->nevents; i++) {
+            if (socks->events[i].data.ptr == &rh->wake_fd) {
+                continue;
+            }
 
-            ASSERT(__accept_proc_sock(rh, server_fd, &socks) == SUCCESS, 
-                    ({ rtsp_unlock(rh); goto error;}));
+            if (socks->events[i].data.ptr == &socks->server_fd) {
+                ASSERT(__accept_proc_sock(rh, socks) == SUCCESS, goto error);
+                continue;
+            }
 
-            ASSERT(list_map_inline(&rh->con_list,__message_proc_sock, &socks) == SUCCESS, 
-                    ({ rtsp_unlock(rh); goto error;}));
+            con = socks->events[i].data.ptr;
+            fd = con->client_fd;
+
+            ASSERT(__message_proc_sock(con, rh) == SUCCESS, goto error);
+
+            if (con->con_state == __CON_S_DISCONNECTED) {
+                /* the fd may outlive the connection while the sender holds it */
+                epoll_ctl(socks->epfd, EPOLL_CTL_DEL, fd, NULL);
+                dead = TRUE;
+            } else if (con->request_deferred) {
+                socks->deferred = TRUE;
+            }
+        }
+
+        /* retry the requests waiting for the snapshots to let go of their session. the list 
+           changes by this thread only */
+        if (socks->deferred) {
+            socks->deferred = FALSE;
+
+            for (e = socks->con_list.list; e; e = e->next) {
+                list_upcast(con, e);
+
+                if (!con->request_deferred || con->con_state == __CON_S_DISCONNECTED) {
+                    continue;
+                }
+
+                fd = con->client_fd;
 
-            MUST(list_sweep(&rh->con_list,__connection_is_dead) == SUCCESS, 
+                ASSERT(__message_proc_sock(con, rh) == SUCCESS, goto error);
+
+                if (con->con_state == __CON_S_DISCONNECTED) {
+                    epoll_ctl(socks->epfd, EPOLL_CTL_DEL, fd, NULL);
+                    dead = TRUE;
+                } else if (con->request_deferred) {
+                    socks->deferred = TRUE;
+                }
+            }
+        }
+
+        rtsp_lock(rh);
+
+        if (dead) {
+            MUST(__connection_sweep(socks) == SUCCESS, 
                     ({ rtsp_unlock(rh); goto error;}));
+        }
 
-            socks.nfds = max(server_fd, __find_fd_max(&rh->con_list)) + 1;
+        /* a session may have been started by another thread just before it hung up here, 
+           so any hang up is published as well as the requests that started or stopped one */
+        if (dead || rh->sessions_changed) {
+            rh->sessions_changed = FALSE;
+            ASSERT(__session_publish(rh) == SUCCESS, 
+                    ({ rtsp_unlock(rh); goto error;}));
+        } else if (rh->retired) {
+            __session_reclaim(rh);
+        }
 
-            rtsp_unlock(rh);
-        } 
+        rtsp_unlock(rh);
         //bufpool_statistics(rh->con_pool);
     }
 
@@ -774,7 +1853,8 @@ error:
     /* Make sure the other threads aren't waiting for us */
     thread_sync_cleanup(h);
 
-    if (server_fd > 0) close(server_fd);
+    if (socks->epfd >= 0) close(socks->epfd);
+    if (socks->server_fd > 0) close(socks->server_fd);
 
     return status;
 }
@@ -787,54 +1867,254 @@ void rtsp_finish(rtsp_handle h)
 {
     /* close every connections in the handle */
     if (h) {
-        
-        list_destroy(&h->con_list);
 
         if (h->pool) {
 
             gbl_set_quit(h->pool->sharedp->gbl);
 
+            /* wake up the rtsp threads */
+            if (h->wake_fd > 0) TEST(eventfd_write(h->wake_fd, 1) == 0, ERR("eventfd_write:%s\n",strerror(errno)));
+
+            /* wake up the sender thread */
+            if (h->submit_fifo) fifo_flush(h->submit_fifo);
+
+            /* and the send workers */
+            pthread_mutex_lock(&h->work_mutex);
+            pthread_cond_broadcast(&h->work_cond);
+            pthread_mutex_unlock(&h->work_mutex);
+
             ASSERT(threadpool_join(h->pool) == SUCCESS, ERR("thread join with error\n"));
 
+            /* unpin connections before their pool goes */
+            __session_snapshot_delete(h->sessions);
+            __session_reclaim(h);
+
+            /* gives its frames back to the job pool */
+            gop_cache_delete(h->gop);
+
             bufpool_delete(h->con_pool);
-            bufpool_delete(h->transfer_pool);
+            bufpool_delete(h->job_pool);
+            fifo_delete(h->submit_fifo);
+            __rtp_batch_delete(h->batch);
+            nal_table_delete(h->nals);
+            __rtp_batch_delete(h->gop_batch);
+            __workers_delete(h);
+            hash_destroy(h->session_table);
+            /* the connection lists go with the threads */
+            FREE(h->ctls);
 
             mime_encoded_delete(h->sprop_sps_b64);
             mime_encoded_delete(h->sprop_sps_b16);
             mime_encoded_delete(h->sprop_pps_b64);
+            FREE(h->sprop_sps.ptr);
+            FREE(h->sprop_pps.ptr);
+            __sdp_blob_release(h->sdp);
 
             threadpool_delete(h->pool);
         }
 
+        CLOSE(h->wake_fd);
+        CLOSE(h->udp_rtp_fd);
+        CLOSE(h->udp_rtcp_fd);
+        __mcast_delete(h);
+
         pthread_mutex_destroy(&h->mutex);
+        pthread_mutex_destroy(&h->send_mutex);
+        pthread_mutex_destroy(&h->work_mutex);
+        pthread_cond_destroy(&h->work_cond);
+        pthread_cond_destroy(&h->done_cond);
 
         FREE(h);
     }
     return;
 }
 
-rtsp_handle rtsp_create(unsigned char max_con, int priority)
+void rtsp_attr_init(struct rtsp_attr_t *attr)
 {
-    rtsp_handle       nh = NULL;
+    DASSERT(attr, return);
+
+    memset(attr, 0, sizeof(*attr));
+
+    attr->max_con = RTSP_MAXIMUM_CONNECTIONS;
+    attr->con_batch = RTSP_DEFAULT_CONNECTION_BATCH;
+    attr->priority = RTSP_DEFAULT_PRIORITY;
+    attr->tx_flags = 0;
+    attr->zerocopy_threshold = RTSP_DEFAULT_ZEROCOPY_THRESHOLD;
+    attr->send_queue_depth = RTSP_DEFAULT_SEND_QUEUE_DEPTH;
+    attr->udp_mode = RTSP_UDP_FIXED;
+    attr->udp_port_min = RTSP_DEFAULT_UDP_PORT_MIN;
+    attr->udp_port_max = RTSP_DEFAULT_UDP_PORT_MAX;
+    attr->mcast_group = NULL;
+    attr->mcast_port = RTSP_DEFAULT_MCAST_PORT;
+    attr->mcast_ttl = RTSP_DEFAULT_MCAST_TTL;
+    attr->gop_cache_size = 0;
+    attr->send_workers = 0;
+    attr->control_threads = RTSP_DEFAULT_CONTROL_THREADS;
+    attr->listen_backlog = RTSP_DEFAULT_LISTEN_BACKLOG;
+    attr->control_policy.sched = RTSP_SCHED_FIFO;
+    attr->sender_policy.sched = RTSP_SCHED_FIFO;
+}
 
-    ASSERT(max_con <= RTSP_MAXIMUM_CONNECTIONS,
-            ({ERR("maximum number of connections should be within %d\n", RTSP_MAXIMUM_CONNECTIONS);
-             return NULL;}));
+static void __thread_policy_init(thread_policy *tp, const struct rtsp_thread_policy_t *p, int priority)
+{
+    int i;
+
+    memset(tp, 0, sizeof(*tp));
+
+    switch (p->sched) {
+        case RTSP_SCHED_RR:
+            tp->sched = SCHED_RR;
+            break;
+        case RTSP_SCHED_OTHER:
+            tp->sched = SCHED_OTHER;
+            break;
+        default:
+            tp->sched = SCHED_FIFO;
+            break;
+    }
+
+    /* the sender and its workers run below 'priority', but not below the least of the class */
+    if (tp->sched != SCHED_OTHER) {
+        priority = max(min(priority, sched_get_priority_max(tp->sched)), sched_get_priority_min(tp->sched));
+    }
+
+    tp->priority = priority;
+    tp->nice = p->nice;
+
+    CPU_ZERO(&tp->cpus);
+    for (i = 0; i < 64; i++) {
+        if (p->cpus & (1ULL << i)) {
+            CPU_SET(i, &tp->cpus);
+        }
+    }
+}
+
+/* one core for each send worker, so that the shards are sent in parallel. taken in turn
+   out of the sender's CPUs, or out of all */
+static void __worker_policy(thread_policy *tp, const struct rtsp_attr_t *attr, int priority, unsigned int index)
+{
+    unsigned long long mask = attr->sender_policy.cpus;
+    long ncpu;
+    int k;
+
+    __thread_policy_init(tp, &attr->sender_policy, priority);
+
+    if (mask) {
+        for (k = index % __builtin_popcountll(mask); k > 0; k--) {
+            mask &= mask - 1;
+        }
+        CPU_ZERO(&tp->cpus);
+        CPU_SET(__builtin_ctzll(mask), &tp->cpus);
+    } else if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0) {
+        CPU_SET(index % ncpu, &tp->cpus);
+    }
+}
+
+rtsp_handle rtsp_create_attr(const struct rtsp_attr_t *attr)
+{
+    rtsp_handle       nh = NULL;
+    thread_handle     th;
+    thread_policy     tp;
+    int               priority;
+    unsigned int      con_batch;
+    unsigned int      i;
+    int               hold;
+
+    ASSERT(attr, return NULL);
+
+    ASSERT(attr->max_con > 0, return NULL);
+    /* the pools and the session table count in int. 'con_batch' is capped by 'max_con' below */
+    ASSERT(attr->max_con <= INT_MAX && attr->con_batch <= INT_MAX, ({
+            ERR("max_con %u or con_batch %u exceeds %d\n", attr->max_con, attr->con_batch, INT_MAX);
+            return NULL;}));
+    ASSERT(attr->udp_mode != RTSP_UDP_RANGE || attr->udp_port_max > attr->udp_port_min, return NULL);
+    /* RTP on the even port, RTCP on the odd one above it (RFC 3550) */
+    ASSERT(attr->udp_mode == RTSP_UDP_FIXED || attr->udp_port_min % 2 == 0, ({
+            ERR("udp_port_min %u is odd\n", attr->udp_port_min);
+            return NULL;}));
+    ASSERT(attr->control_threads > 0, return NULL);
+    ASSERT(attr->control_threads + 1 + attr->send_workers <= MAX_NUMTHREAD, return NULL);
+    ASSERT(attr->listen_backlog > 0, return NULL);
+    ASSERT(attr->gop_hold_frames <= INT_MAX - __SUBMIT_QUEUE_SIZE, return NULL);
+    ASSERT(attr->control_policy.sched <= RTSP_SCHED_OTHER, return NULL);
+    ASSERT(attr->sender_policy.sched <= RTSP_SCHED_OTHER, return NULL);
 
     TALLOC(nh,return NULL);
 
-    nh->max_con = max_con;
-    nh->priority = priority;
+    nh->attr = *attr;
+    priority = attr->priority;
 
     pthread_mutex_init(&nh->mutex,NULL);
+    pthread_mutex_init(&nh->send_mutex,NULL);
+    pthread_mutex_init(&nh->work_mutex,NULL);
+    pthread_cond_init(&nh->work_cond,NULL);
+    pthread_cond_init(&nh->done_cond,NULL);
 
+    ASSERT((nh->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) > 0, ({
+                ERR("eventfd:%s\n",strerror(errno));
+                goto error;}));
     ASSERT(nh->pool = threadpool_create(nh), goto error);
-    ASSERT(nh->con_pool =  __connectionpool_create(max_con), goto error);
-    ASSERT(nh->transfer_pool =  __transpool_create(max_con), goto error);
+    /* held frames are jobs taken off the queue */
+    hold = attr->gop_cache_size > 0 ? attr->gop_hold_frames : 0;
+
+    /* tables grow by 'con_batch' on demand, so nothing is allocated per accepted client */
+    con_batch = attr->con_batch ? min(attr->con_batch, attr->max_con) : attr->max_con;
+
+    ASSERT(nh->con_pool =  __connectionpool_create(con_batch, attr->max_con), goto error);
+    ASSERT(nh->sessions = calloc(1, sizeof(struct session_snapshot_t)), goto error);
+    ASSERT(nh->session_table = hash_create(attr->max_con), goto error);
+    ASSERT(nh->ctls = calloc(attr->control_threads, sizeof(struct sock_epoll_t *)), goto error);
+    ASSERT(nh->job_pool =  __jobpool_create(__SUBMIT_QUEUE_SIZE, __SUBMIT_QUEUE_SIZE + hold), goto error);
+    ASSERT(nh->submit_fifo = fifo_create(), goto error);
+    ASSERT(nh->batch = __rtp_batch_create(), goto error);
+    ASSERT(nh->nals = nal_table_create(), goto error);
+
+    if (attr->gop_cache_size > 0) {
+        ASSERT(nh->gop = gop_cache_create(attr->gop_cache_size, hold, (__gop_job_release)), goto error);
+        ASSERT(nh->gop_batch = __rtp_batch_create(), goto error);
+    }
 
-    /* create tcp thread */
-    ASSERT(CREATE_THREAD(nh->pool, rtspThrFxn, priority--, NULL),
+    if (attr->send_workers > 0) {
+        ASSERT(nh->workers = calloc(attr->send_workers, sizeof(struct __rtp_worker_t *)), goto error);
+    }
+
+    ASSERT(__sdp_publish(nh) == SUCCESS, goto error);
+
+    if (attr->udp_mode == RTSP_UDP_SHARED) {
+        ASSERT(__bind_udp_shared(nh) == SUCCESS, goto error);
+    }
+
+    if (attr->mcast_group) {
+        ASSERT(__mcast_create(nh) == SUCCESS, goto error);
+    }
+
+    /* create tcp threads */
+    for (i = 0; i < attr->control_threads; i++) {
+        ASSERT(nh->ctls[i] = __control_create(nh), goto error);
+        ASSERT(th = CREATE_THREAD(nh->pool, rtspThrFxn, priority, nh->ctls[i]), ({
+                nh->ctls[i] = NULL;
+                goto error;}));
+        __thread_policy_init(&tp, &attr->control_policy, priority);
+        thread_set_policy(th, &tp);
+    }
+    priority--;
+
+    /* create rtp sender thread */
+    ASSERT(th = CREATE_THREAD(nh->pool, rtpThrFxn, priority, NULL),
             goto error);
+    __thread_policy_init(&tp, &attr->sender_policy, priority);
+    thread_set_policy(th, &tp);
+    priority--;
+
+    /* and its send workers */
+    for (i = 0; i < attr->send_workers; i++) {
+        ASSERT(nh->workers[i] = __worker_create(nh, i), goto error);
+        ASSERT(th = CREATE_THREAD(nh->pool, rtpWorkerThrFxn, priority, nh->workers[i]), ({
+                nh->workers[i] = NULL;
+                goto error;}));
+        __worker_policy(&tp, attr, priority, i);
+        thread_set_policy(th, &tp);
+    }
 
     ASSERT(threadpool_start(nh->pool) == SUCCESS,
             goto error);
@@ -848,6 +2128,62 @@ error:
     return NULL;
 }
 
+rtsp_handle rtsp_create(unsigned char max_con, int priority)
+{
+    struct rtsp_attr_t attr;
+
+    rtsp_attr_init(&attr);
+
+    attr.max_con = max_con;
+    attr.priority = priority;
+
+    return rtsp_create_attr(&attr);
+}
+
+int rtsp_get_stat(rtsp_handle h, struct rtsp_stat_t *p_stat)
+{
+    ASSERT(h, return FAILURE);
+    ASSERT(p_stat, return FAILURE);
+
+    rtsp_lock(h);
+    *p_stat = h->tx_stat;
+    rtsp_unlock(h);
+
+    return SUCCESS;
+}
+
+int rtsp_get_threads(rtsp_handle h, struct rtsp_thread_info_t *info, int num)
+{
+    unsigned int index[RTSP_THREAD_WORKER + 1] = {};
+    enum rtsp_thread_e kind;
+    thread_handle th;
+    int i;
+
+    ASSERT(h, return FAILURE);
+    ASSERT(info || num == 0, return FAILURE);
+
+    /* the pool does not change once started */
+    for (i = 0; i < h->pool->cnt && i < num; i++) {
+        th = h->pool->threads[i];
+
+        if (th->fxn == rtspThrFxn) {
+            kind = RTSP_THREAD_CONTROL;
+        } else if (th->fxn == rtpThrFxn) {
+            kind = RTSP_THREAD_SENDER;
+        } else {
+            kind = RTSP_THREAD_WORKER;
+        }
+
+        info[i].kind = kind;
+        info[i].index = index[kind]++;
+        info[i].tid = __atomic_load_n(&th->tid, __ATOMIC_ACQUIRE);
+        info[i].sched = th->sched == SCHED_FIFO ? RTSP_SCHED_FIFO :
+            th->sched == SCHED_RR ? RTSP_SCHED_RR : RTSP_SCHED_OTHER;
+    }
+
+    return h->pool->cnt;
+}
+
 int rtsp_tick(rtsp_handle h)
 {
     ASSERT(h, return FAILURE);
@@ -3,6 +3,9 @@
 
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <errno.h>
 #include <arpa/inet.h>
 
 #include "rtsp_server.h"
@@ -13,12 +16,24 @@
 #include "thread.h"
 #include "bufpool.h"
 #include "mime.h"
+#include "nal.h"
+#include "interleaved.h"
+#include "gop.h"
+#include "hash.h"
 
 /******************************************************************************
  *              DEFINITIONS
  ******************************************************************************/
 #define __RTSP_TCP_BUF_SIZE 4096
-#define __CONNECTION_QUEUE_SIZE 16
+#define __RTSP_RX_BUF_SIZE 4096     /* the longest request line we accept */
+#define __RTSP_TX_BUF_SIZE 8192
+#define __RTSP_TX_RESERVE 4096      /* room kept for one more response */
+#define __RTSP_TX_IOV 64
+#define __RTSP_TRANSPORT_SIZE 160   /* a Transport header line */
+#define __SUBMIT_QUEUE_SIZE 8
+#define __RTSP_EPOLL_EVENTS 64
+#define __SESSION_RECLAIM_MS 10
+#define __REQUEST_DEFERRED 1     /* __request_proc(): the request waits for the sender */
 
 #define __TERM  "\r\n"
 #define SCMP(id,s) (strncasecmp(id,s,strlen(id)) == 0)
@@ -67,6 +82,12 @@ struct __time_stat_t {
     unsigned int ts_offset;
 };
 
+/* an IPv4 address as the socket calls take it, without a type-punned pointer */
+union __sockaddr_t {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+};
+
 struct connection_item_t {
     struct sockaddr_in addr;
     int client_fd;
@@ -74,20 +95,35 @@ struct connection_item_t {
     int server_rtp_fd;
     int cseq;
 
-    //FILE *fp_rtcp_write;
-    //FILE *fp_rtcp_read;
-    //FILE *fp_rtp_write;
-    FILE *fp_tcp_read;
-    FILE *fp_tcp_write;
+    /* received bytes: [rx_head, rx_tail) is unparsed, lines are sliced out in place */
+    char rx_buf[__RTSP_RX_BUF_SIZE];
+    unsigned int rx_head;
+    unsigned int rx_tail;
+    unsigned int rx_scan;       /* no '\n' in [rx_head, rx_scan) */
+    unsigned int rx_skip;       /* bytes left of a '$' framed packet from the client */
+    /* responses of one wakeup, sent by a single writev. [tx_iov_first, tx_iovcnt) is unsent */
+    char tx_buf[__RTSP_TX_BUF_SIZE];
+    unsigned int tx_len;
+    struct iovec tx_iov[__RTSP_TX_IOV];
+    int tx_iov_first;
+    int tx_iovcnt;
+    struct sdp_blob_t *tx_pin[__RTSP_TX_IOV];   /* sdp pinned by the staged iovec, or NULL */
     enum __connection_state_e con_state;
     enum __parser_state_e parser_state;
     enum __method_e method;
     unsigned int client_port_rtp;
     unsigned int client_port_rtcp;
+    int client_tcp;             /* the request asks for RTP/AVP/TCP */
+    int client_multicast;       /* the request asks for multicast */
+    unsigned int client_channel_rtp;
+    unsigned int client_channel_rtcp;
     unsigned int server_port_rtp;
     unsigned int server_port_rtcp;
     unsigned long long session_id;
     unsigned long long given_session_id;
+    int session_listed;         /* in the session table */
+    unsigned int snap_pins;     /* snapshots listing it, so the sender may use its transport. rtsp lock */
+    int request_deferred;       /* a parsed SETUP or PLAY waits until the session has no 'snap_pins' */
     unsigned int range_start;
     unsigned int range_end;
     unsigned int rtcp_octet;
@@ -98,38 +134,133 @@ struct connection_item_t {
     bufpool_handle pool;
     unsigned int rtp_timestamp;
     unsigned int ssrc;
+    int udp_shared;             /* server_rtp_fd/server_rtcp_fd belong to the handle */
+    union __sockaddr_t rtp_peer;
+    union __sockaddr_t rtcp_peer;
+    unsigned int tx_caps;       /* RTSP_TX_* available on server_rtp_fd */
+    int interleaved;            /* RTP/RTCP go '$' framed over client_fd */
+    unsigned char rtp_channel;
+    unsigned char rtcp_channel;
+    struct interleaved_ring_t *ring;    /* client_fd output once interleaved */
+    int multicast;              /* RTP/RTCP come from the group stream of the handle */
+    rtp_hdr_t *zc_headers;      /* headers must outlive MSG_ZEROCOPY sends */
+    int zc_headers_cap;
+    unsigned int zc_issued;
+    unsigned int zc_completed;
+    int wait_idr;               /* dropping frames until next IDR */
+    int gop_pos;                /* next cached frame to catch up with. -1 when live */
+    unsigned int gop_gen;
+    unsigned int drop_frames;
+    unsigned long long drop_packets;
     struct list_t list_entry;
 };
 
-struct transfer_item_t {
-    struct list_t list_entry;
-    struct connection_item_t *con;
+/* immutable set of PLAYING sessions. the rtsp thread publishes a new version on every change
+   and the sender reads the current one without locks. each connection is pinned by a reference */
+struct session_snapshot_t {
+    unsigned long long version;
+    struct session_snapshot_t *next_retired;
+    int num;
+    struct connection_item_t *cons[];
+};
+
+/* DESCRIBE entity headers and SDP, rendered when the parameter sets change. immutable once 
+   published, and freed by the last reference */
+struct sdp_blob_t {
+    int ref_count;  /* atomic */
+    unsigned int version;
+    size_t len;
+    char data[];
+};
+
+/* access unit queued by rtp_submit_h264_async() */
+struct frame_job_t {
+    unsigned int magic;
+    signed char *buf;
+    size_t len;
+    struct timeval tv;
+    rtp_release_fxn release;
+    void *arg;
     bufpool_handle pool;
 };
 
+/* a packetized frame published to every send worker. read-only while referenced. each worker 
+   drops its reference when its shard is done, and the last one wakes the publisher */
+struct __rtp_frame_t {
+    unsigned long long seq;     /* bumped for each frame */
+    struct __rtp_batch_t *batch;
+    struct session_snapshot_t *sessions;
+    size_t len;
+    int idr;
+    int ref_count;
+    int ret;
+};
+
+/* a send worker owns the sessions [num * index / workers, num * (index + 1) / workers) 
+   of each frame. it stamps its own copy of the packet descriptors */
+struct __rtp_worker_t {
+    unsigned int index;
+    unsigned long long seq;     /* last frame served */
+    struct __rtp_batch_t *batch;
+    struct __rtp_batch_t *gop_batch;
+    struct rtsp_stat_t stat;
+};
+
 struct __rtsp_obj_t {
-    pthread_mutex_t mutex;
-    struct list_head_t con_list;
+    pthread_mutex_t mutex;      /* what the rtsp threads share. taken for a request, not for its I/O */
+    pthread_mutex_t send_mutex; /* serializes frames among callers and the sender thread */
+    struct sock_epoll_t **ctls; /* attr.control_threads. the thread pool frees each one */
     threadpool_handle pool;
     bufpool_handle con_pool;
-    bufpool_handle transfer_pool;
+    bufpool_handle job_pool;
+    fifo_handle submit_fifo;
+    struct __rtp_batch_t *batch;
+    struct session_snapshot_t *sessions;    /* atomic. current snapshot */
+    struct session_snapshot_t *hazard;      /* atomic. snapshot the sender is reading */
+    struct session_snapshot_t *retired;     /* waiting for the sender to let go. rtsp lock */
+    struct nal_table_t *nals;   /* start codes of the frame being sent */
+    struct gop_cache_t *gop;    /* sender only */
+    struct __rtp_batch_t *gop_batch;
+    struct __rtp_worker_t **workers;    /* attr.send_workers. the thread pool frees each one */
+    pthread_mutex_t work_mutex;
+    pthread_cond_t work_cond;   /* a frame is published */
+    pthread_cond_t done_cond;   /* the last worker let go of it */
+    struct __rtp_frame_t frame;
     unsigned short  port;
     struct __time_stat_t stat;
+    struct rtsp_stat_t tx_stat;
     mime_encoded_handle sprop_sps_b64;
     mime_encoded_handle sprop_pps_b64;
     mime_encoded_handle sprop_sps_b16;
+    struct nal_unit_t sprop_sps;    /* copies of the parameter sets last published. read by the sender,
+                                       changed with the encodings under the rtsp lock */
+    struct nal_unit_t sprop_pps;
+    struct sdp_blob_t *sdp;     /* current one. replaced under the rtsp lock */
+    int             wake_fd; /* eventfd. kicks the rtsp threads out of epoll_wait() */
+    int             udp_rtp_fd;     /* RTSP_UDP_SHARED */
+    int             udp_rtcp_fd;
+    unsigned int    udp_tx_caps;
+    unsigned int    udp_cursor;     /* RTSP_UDP_RANGE. pair to try first */
+    struct connection_item_t *mcast;    /* the group stream. stands in the snapshot for every 
+                                           multicast session, and has no pool */
+    char            mcast_transport[__RTSP_TRANSPORT_SIZE]; /* its SETUP Transport header, the 
+                                                               same for every session */
+    int             mcast_transport_len;
+    hash_handle     session_table;  /* session id -> connection, from SETUP until TEARDOWN */
+    int             sessions_changed;   /* a request started or stopped a session */
     unsigned        ctx; /* for rand_r */
     int             con_num;
-    unsigned char   max_con;
-    int             priority; 
+    struct rtsp_attr_t attr;
 };
 
-struct sock_select_t {
-    struct timeval timeout;
-    fd_set rfds;
-    fd_set wfds;
-    fd_set efds;
-    int nfds;
+/* an rtsp thread. it alone reads and writes the connections it accepted */
+struct sock_epoll_t {
+    int epfd;
+    int server_fd;
+    int nevents;
+    struct epoll_event events[__RTSP_EPOLL_EVENTS];
+    struct list_head_t con_list;    /* added to and swept under the rtsp lock */
+    int deferred;               /* some connection has a request deferred */
     rtsp_handle h_rtsp;
 };
 
@@ -138,8 +269,20 @@ struct sock_select_t {
  ******************************************************************************/
 static inline void rtsp_lock(rtsp_handle h);
 static inline void rtsp_unlock(rtsp_handle h);
-static inline int __read_line(struct connection_item_t *p, char *buf);
-static inline int __transfer_item_cleaner(struct list_t *e);
+static inline int __read_line(struct connection_item_t *p, char **p_line, size_t *p_len);
+static inline int __rx_fill(struct connection_item_t *p);
+static inline void __connection_hangup(struct connection_item_t *p);
+static inline struct session_snapshot_t *__session_snapshot_acquire(rtsp_handle h);
+static inline void __session_snapshot_release(rtsp_handle h);
+static inline void __session_snapshot_delete(struct session_snapshot_t *snap);
+static inline void __frame_job_release(struct frame_job_t *job);
+static inline void __sdp_blob_release(struct sdp_blob_t *sdp);
+
+/* sender thread of rtp_submit_h264_async() (rtp.c) */
+void *rtpThrFxn(void *v);
+void *rtpWorkerThrFxn(void *v);
+/* render the SDP of the current parameter sets. called with the rtsp lock held (rtsp.c) */
+int __sdp_publish(rtsp_handle h);
 
 /******************************************************************************
  *              INLINE FUNCTIONS
@@ -154,29 +297,117 @@ static inline void rtsp_unlock(rtsp_handle h)
     pthread_mutex_unlock(&h->mutex);
 }
 
-static inline int __read_line(struct connection_item_t *p, char *buf)
+/* O(1) amortized: slice the next line out of the rx buffer, without copying and without the 
+   line terminator. FALSE when no complete line has been received yet */
+static inline int __read_line(struct connection_item_t *p, char **p_line, size_t *p_len)
+{
+    char *line;
+    char *end;
+    size_t len;
+
+    /* '$' framed packets of the client, receiver reports mostly, come between requests */
+    while(p->parser_state == __PARSER_S_INIT) {
+        if(p->rx_skip > 0) {
+            len = min(p->rx_skip, p->rx_tail - p->rx_head);
+            p->rx_head += len;
+            p->rx_skip -= len;
+
+            if(p->rx_skip > 0) {
+                p->rx_scan = p->rx_tail;
+                return FALSE;
+            }
+        }
+
+        if(p->rx_head == p->rx_tail || p->rx_buf[p->rx_head] != '$') {
+            break;
+        }
+
+        if(p->rx_tail - p->rx_head < __INTERLEAVED_HDR_SIZE) {
+            return FALSE;
+        }
+
+        p->rx_skip = __INTERLEAVED_HDR_SIZE + 
+            ((unsigned char)p->rx_buf[p->rx_head + 2] << 8 | (unsigned char)p->rx_buf[p->rx_head + 3]);
+    }
+
+    p->rx_scan = max(p->rx_scan, p->rx_head);
+    line = p->rx_buf + p->rx_head;
+
+    end = memchr(p->rx_buf + p->rx_scan, '\n', p->rx_tail - p->rx_scan);
+
+    if(end == NULL) {
+        /* do not scan again what we have seen */
+        p->rx_scan = p->rx_tail;
+        return FALSE;
+    }
+
+    len = end - line;
+    p->rx_head += len + 1;
+    p->rx_scan = p->rx_head;
+
+    if(len > 0 && line[len - 1] == '\r') {
+        len--;
+    }
+
+    DBG(">%.*s\n", (int)len, line);
+
+    *p_line = line;
+    *p_len = len;
+
+    return TRUE;
+}
+
+/* read what the socket has into the rx buffer. the unparsed part is moved to the front first, 
+   so a line is always contiguous. returns bytes read, 0 when drained and FAILURE when the 
+   connection is gone */
+static inline int __rx_fill(struct connection_item_t *p)
 {
-    /* we set the socket to non-blocking */
-    if(fgets(buf,__RTSP_TCP_BUF_SIZE,p->fp_tcp_read) == NULL) {
-        /* unexpected end. we do not expect it */
-        if(p->parser_state == __PARSER_S_INIT) {
+    ssize_t n;
+
+    if(p->rx_head > 0) {
+        memmove(p->rx_buf, p->rx_buf + p->rx_head, p->rx_tail - p->rx_head);
+        p->rx_tail -= p->rx_head;
+        p->rx_scan -= p->rx_head;
+        p->rx_head = 0;
+    }
+
+    TEST(p->rx_tail < sizeof(p->rx_buf), ({
+                ERR("request line exceeds %zu bytes\n", sizeof(p->rx_buf));
+                goto error;}));
+
+    do {
+        n = recv(p->client_fd, p->rx_buf + p->rx_tail, sizeof(p->rx_buf) - p->rx_tail, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        /* every request has been read out. wait for the next edge */
+        return 0;
+    }
+
+    if(n <= 0) {
+        if(p->parser_state == __PARSER_S_INIT && p->rx_tail == 0) {
             /* when this selected sd is EOF at first glance, it's dead */
             DBG("disconnected\n");
-            
         } else {
             /* corrupted message. nothing to be done */
             ERR("message end before delimiter\n");
         }
-
-        p->con_state = __CON_S_DISCONNECTED;
-        ASSERT(bufpool_detach(p->pool,p) == SUCCESS, ERR("connection detach failed\n"));
-        return FALSE;
+        goto error;
     }
 
-    DBG(">%s",buf);
+    p->rx_tail += n;
+
+    return n;
+error:
+    __connection_hangup(p);
+    return FAILURE;
+}
 
-    /* check end of request */
-    return !(SCMP(__TERM,buf));
+/* the connection is swept, and let go of, by its rtsp thread. a request served by another 
+   thread may change the state at the same time */
+static inline void __connection_hangup(struct connection_item_t *p)
+{
+    __atomic_store_n(&p->con_state, __CON_S_DISCONNECTED, __ATOMIC_SEQ_CST);
 }
 
 static inline unsigned long long __get_random_byte(unsigned *ctx)
@@ -197,21 +428,60 @@ static inline unsigned long long __get_random_llu(unsigned *ctx)
         | (__get_random_byte(ctx)) << 56;
 }
 
-static inline int __transfer_item_cleaner(struct list_t *e)
+/* O(1): single reader (the send path is serialized by send_mutex). the hazard slot keeps
+   the snapshot alive until __session_snapshot_release() */
+static inline struct session_snapshot_t *__session_snapshot_acquire(rtsp_handle h)
 {
-    struct transfer_item_t *p;
-    list_upcast(p,e);
+    struct session_snapshot_t *snap;
+
+    do {
+        snap = __atomic_load_n(&h->sessions, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&h->hazard, snap, __ATOMIC_SEQ_CST);
+    } while (snap != __atomic_load_n(&h->sessions, __ATOMIC_SEQ_CST));
+
+    return snap;
+}
 
-    if(p->con) {
-        ASSERT(bufpool_detach(p->con->pool,p->con) == SUCCESS,
-            return FAILURE);
-        p->con = NULL;
+static inline void __session_snapshot_release(rtsp_handle h)
+{
+    __atomic_store_n(&h->hazard, NULL, __ATOMIC_SEQ_CST);
+}
+
+static inline void __session_snapshot_delete(struct session_snapshot_t *snap)
+{
+    int i;
+
+    if(snap) {
+        for(i = 0; i < snap->num; i++) {
+            if(snap->cons[i]->pool == NULL) {
+                continue;
+            }
+            snap->cons[i]->snap_pins--;
+            ASSERT(bufpool_detach(snap->cons[i]->pool, snap->cons[i]) == SUCCESS,
+                ERR("connection detach failed\n"));
+        }
+        FREE(snap);
     }
+}
 
-    ASSERT(bufpool_detach(p->pool,p) == SUCCESS,
-        return FAILURE);
+static inline void __sdp_blob_release(struct sdp_blob_t *sdp)
+{
+    if(sdp && __atomic_sub_fetch(&sdp->ref_count, 1, __ATOMIC_ACQ_REL) == 0) {
+        FREE(sdp);
+    }
+}
 
-    return SUCCESS;
+static inline void __frame_job_release(struct frame_job_t *job)
+{
+    rtp_release_fxn release = job->release;
+
+    job->release = NULL;
+
+    if(release) {
+        release(job->buf, job->len, job->arg);
+    }
+
+    ASSERT(bufpool_detach(job->pool, job) == SUCCESS, ERR("job detach failed\n"));
 }
 
 static inline int __get_timestamp_offset(struct __time_stat_t *p_stat, struct timeval *p_tv)
@@ -5,6 +5,13 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/futex.h>
 
 #include "common.h"
 
@@ -159,14 +166,26 @@ static inline void rendezvous_force_reset(rendezvous_handle hRv)
 /******************************************************************************/
 
 #define FIFO_EFLUSH      1   /**< The command was flushed (success). */
-
+#define FIFO_DEPTH       1024   /* pointers a fifo holds. a power of two */
+#define FIFO_CACHELINE   64
+
+/* ring of pointers for any number of producers and one consumer. producers claim a slot by
+   a CAS on 'tail' and fill it after, so the consumer takes a slot once it is no longer NULL.
+   the consumer index and the producer side have a cache line each, the latter with the copy
+   of 'head' producers last saw. a side sleeps on a futex only when the ring is empty (or
+   full), and the other side makes the system call only when it was told so. fan-in by
+   thread_chain() is fine. a fifo must not have two consumers, so never chain one producer
+   to several threads */
 typedef struct fifo_object_t{
-	pthread_mutex_t mutex;
-	int             numBufs;
+	unsigned int    head __attribute__((aligned(FIFO_CACHELINE)));  /* consumer */
+	int             get_waiting;
+	unsigned int    tail __attribute__((aligned(FIFO_CACHELINE)));  /* producers. atomic */
+	unsigned int    head_seen;      /* atomic */
+	int             put_waiting;    /* atomic. producers asleep on a full ring */
+	int             get_seq __attribute__((aligned(FIFO_CACHELINE)));   /* futex words */
+	int             put_seq;
 	int             flush;
-	int             pipes[2];
-	int             rfd;
-	int             wfd;
+	void           *ring[FIFO_DEPTH] __attribute__((aligned(FIFO_CACHELINE)));  /* NULL when free */
 } fifo_object;
 typedef fifo_object *fifo_handle;
 static inline  fifo_handle fifo_create(void);
@@ -176,6 +195,24 @@ static inline  int      fifo_put(fifo_handle hfifo, void *ptr);
 static inline  int      fifo_getNumEntries(fifo_handle hfifo);
 static inline  int      fifo_delete(fifo_handle hfifo);
 
+/******************************************************************************
+ * __fifo_wait / __fifo_wake
+ ******************************************************************************/
+static inline void
+__fifo_wait(int *seq, int val)
+{
+	/* returns at once when *seq has moved on. EINTR and spurious wake ups are
+	   taken care of by the callers checking again */
+	syscall(SYS_futex, seq, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline void
+__fifo_wake(int *seq, int num)
+{
+	__atomic_add_fetch(seq, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, seq, FUTEX_WAKE_PRIVATE, num, NULL, NULL, 0);
+}
+
 /******************************************************************************
  * fifo_create
  ******************************************************************************/
@@ -183,27 +220,17 @@ static inline fifo_handle
 //fifo_create(fifo_Attrs * attrs)
 fifo_create()
 {
-	fifo_handle     hfifo;
+	void           *hfifo;
 
-	hfifo = calloc(1, sizeof(fifo_object));
-
-	if (hfifo == NULL) {
+	if (posix_memalign(&hfifo, FIFO_CACHELINE, sizeof(fifo_object))) {
 		fprintf(stderr,
 			"Failed to allocate space for fifo Object\n");
 		return NULL;
 	}
 
-	if (pipe(hfifo->pipes)) {
-		FREE(hfifo);
-		return NULL;
-	}
-
-	hfifo->rfd = hfifo->pipes[0];
-	hfifo->wfd = hfifo->pipes[1];
+	memset(hfifo, 0, sizeof(fifo_object));
 
-	pthread_mutex_init(&hfifo->mutex, NULL);
-
-	return hfifo;
+	return (fifo_handle) hfifo;
 }
 
 /******************************************************************************
@@ -212,23 +239,11 @@ fifo_create()
 static inline int
 fifo_delete(fifo_handle hfifo)
 {
-	int             ret = SUCCESS;
-
 	if (hfifo) {
-		if (close(hfifo->pipes[0])) {
-			ret = FAILURE;
-		}
-
-		if (close(hfifo->pipes[1])) {
-			ret = FAILURE;
-		}
-
-		pthread_mutex_destroy(&hfifo->mutex);
-
 		FREE(hfifo);
 	}
 
-	return ret;
+	return SUCCESS;
 }
 
 /******************************************************************************
@@ -237,39 +252,54 @@ fifo_delete(fifo_handle hfifo)
 static inline int
 fifo_get(fifo_handle hfifo, void *ptrPtr)
 {
-	int             flush;
-	int             numBytes;
+	unsigned int    head;
+	void          **slot;
+	void           *ptr;
+	int             seq;
 
 	DASSERT(hfifo,return FAILURE);
 	DASSERT(ptrPtr, return FAILURE);
 
-	pthread_mutex_lock(&hfifo->mutex);
-	flush = hfifo->flush;
-	pthread_mutex_unlock(&hfifo->mutex);
-
-	if (flush) {
+	if (__atomic_load_n(&hfifo->flush, __ATOMIC_ACQUIRE)) {
 		return FIFO_EFLUSH;
 	}
 
-	numBytes = read(hfifo->pipes[0], ptrPtr, sizeof(ptrPtr));
+	head = hfifo->head;
+	slot = &hfifo->ring[head & (FIFO_DEPTH - 1)];
 
-	if (numBytes != sizeof(ptrPtr)) {
-		pthread_mutex_lock(&hfifo->mutex);
-		flush = hfifo->flush;
-		if (flush) {
-			hfifo->flush = FALSE;
+	/*
+	 * Empty, or claimed by a producer that has not filled it yet
+	 */
+	while (!(ptr = __atomic_load_n(slot, __ATOMIC_ACQUIRE))) {
+		/*
+		 * Idle. Ask the producers for a wake up, and look once more before sleeping
+		 */
+		seq = __atomic_load_n(&hfifo->get_seq, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&hfifo->get_waiting, TRUE, __ATOMIC_SEQ_CST);
+
+		if (!__atomic_load_n(slot, __ATOMIC_SEQ_CST)
+				&& !__atomic_load_n(&hfifo->flush, __ATOMIC_SEQ_CST)) {
+			__fifo_wait(&hfifo->get_seq, seq);
 		}
-		pthread_mutex_unlock(&hfifo->mutex);
 
-		if (flush) {
+		__atomic_store_n(&hfifo->get_waiting, FALSE, __ATOMIC_RELAXED);
+
+		if (__atomic_load_n(&hfifo->flush, __ATOMIC_ACQUIRE)) {
 			return FIFO_EFLUSH;
 		}
-		return FAILURE;
 	}
 
-	pthread_mutex_lock(&hfifo->mutex);
-	hfifo->numBufs--;
-	pthread_mutex_unlock(&hfifo->mutex);
+	*(void **) ptrPtr = ptr;
+
+	/* the slot is free for the producer that sees the new head */
+	__atomic_store_n(slot, NULL, __ATOMIC_RELAXED);
+	__atomic_store_n(&hfifo->head, head + 1, __ATOMIC_SEQ_CST);
+
+	/* producers asleep on a full ring go on together once it has drained to half */
+	if (__atomic_load_n(&hfifo->put_waiting, __ATOMIC_SEQ_CST)
+			&& __atomic_load_n(&hfifo->tail, __ATOMIC_RELAXED) - (head + 1) <= FIFO_DEPTH / 2) {
+		__fifo_wake(&hfifo->put_seq, INT_MAX);
+	}
 
 	return SUCCESS;
 }
@@ -280,20 +310,15 @@ fifo_get(fifo_handle hfifo, void *ptrPtr)
 static inline int
 fifo_flush(fifo_handle hfifo)
 {
-	char            ch = 0xff;
-
 	DASSERT(hfifo, return FAILURE);
 
-	pthread_mutex_lock(&hfifo->mutex);
-	hfifo->flush = TRUE;
-	pthread_mutex_unlock(&hfifo->mutex);
+	__atomic_store_n(&hfifo->flush, TRUE, __ATOMIC_SEQ_CST);
 
 	/*
-	 * Make sure any fifo_get() calls are unblocked 
+	 * Make sure any fifo_get() and fifo_put() calls are unblocked
 	 */
-	if (write(hfifo->pipes[1], &ch, 1) != 1) {
-		return FAILURE;
-	}
+	__fifo_wake(&hfifo->get_seq, INT_MAX);
+	__fifo_wake(&hfifo->put_seq, INT_MAX);
 
 	return SUCCESS;
 }
@@ -304,15 +329,56 @@ fifo_flush(fifo_handle hfifo)
 static inline int
 fifo_put(fifo_handle hfifo, void *ptr)
 {
+	unsigned int    tail;
+	unsigned int    head;
+	int             seq;
+
 	DASSERT(hfifo,return FAILURE);
 	DASSERT(ptr,return FAILURE);
 
-	pthread_mutex_lock(&hfifo->mutex);
-	hfifo->numBufs++;
-	pthread_mutex_unlock(&hfifo->mutex);
+	tail = __atomic_load_n(&hfifo->tail, __ATOMIC_RELAXED);
 
-	if (write(hfifo->pipes[1], &ptr, sizeof(ptr)) != sizeof(ptr)) {
-		return FAILURE;
+	for (;;) {
+		head = __atomic_load_n(&hfifo->head_seen, __ATOMIC_ACQUIRE);
+
+		if (tail - head >= FIFO_DEPTH) {
+			head = __atomic_load_n(&hfifo->head, __ATOMIC_ACQUIRE);
+			__atomic_store_n(&hfifo->head_seen, head, __ATOMIC_RELEASE);
+		}
+
+		if (tail - head >= FIFO_DEPTH) {
+			/*
+			 * Full. Nobody is going to make room after a flush
+			 */
+			if (__atomic_load_n(&hfifo->flush, __ATOMIC_ACQUIRE)) {
+				return FAILURE;
+			}
+
+			seq = __atomic_load_n(&hfifo->put_seq, __ATOMIC_SEQ_CST);
+			__atomic_add_fetch(&hfifo->put_waiting, 1, __ATOMIC_SEQ_CST);
+
+			if (tail - __atomic_load_n(&hfifo->head, __ATOMIC_SEQ_CST) >= FIFO_DEPTH
+					&& !__atomic_load_n(&hfifo->flush, __ATOMIC_SEQ_CST)) {
+				__fifo_wait(&hfifo->put_seq, seq);
+			}
+
+			__atomic_sub_fetch(&hfifo->put_waiting, 1, __ATOMIC_RELAXED);
+
+			tail = __atomic_load_n(&hfifo->tail, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		/* a producer that got there first moves 'tail' on. look again */
+		if (__atomic_compare_exchange_n(&hfifo->tail, &tail, tail + 1, FALSE,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	__atomic_store_n(&hfifo->ring[tail & (FIFO_DEPTH - 1)], ptr, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&hfifo->get_waiting, __ATOMIC_SEQ_CST)) {
+		__fifo_wake(&hfifo->get_seq, 1);
 	}
 
 	return SUCCESS;
@@ -324,15 +390,16 @@ fifo_put(fifo_handle hfifo, void *ptr)
 static inline int
 fifo_getNumEntries(fifo_handle hfifo)
 {
-	int             numEntries;
+	unsigned int    head;
 
 	DASSERT(hfifo,return FAILURE);
 
-	pthread_mutex_lock(&hfifo->mutex);
-	numEntries = hfifo->numBufs;
-	pthread_mutex_unlock(&hfifo->mutex);
+	/*
+	 * A snapshot. Either side may move on right after
+	 */
+	head = __atomic_load_n(&hfifo->head, __ATOMIC_ACQUIRE);
 
-	return numEntries;
+	return (int) (__atomic_load_n(&hfifo->tail, __ATOMIC_ACQUIRE) - head);
 }
 
 /******************************************************************************/
@@ -348,12 +415,23 @@ typedef struct shared_interface {
     struct global_state_t *gbl;
 } shared_interface;
 
+/* how a thread is scheduled. a real time class the process may not use falls back to SCHED_OTHER */
+typedef struct thread_policy {
+    int sched;          /* SCHED_FIFO, SCHED_RR or SCHED_OTHER */
+    int priority;       /* real time classes */
+    int nice;           /* SCHED_OTHER */
+    cpu_set_t cpus;     /* none leaves it to the scheduler */
+} thread_policy;
+
 typedef struct thread_job {
     shared_interface *sharedp;
     void *param_priv;
     void *(*fxn)(void *);
     int priority;
     int started;
+    thread_policy policy;
+    int sched;          /* the class it got */
+    pid_t tid;          /* atomic. set once it runs */
     fifo_handle hInPut;
     fifo_handle hInGet;
     fifo_handle hOutPut;
@@ -390,6 +468,7 @@ static inline int thread_close(thread_handle lhs, thread_handle rhs);
 static inline int thread_chain(thread_handle lhs, thread_handle rhs);
 static inline int thread_joint(thread_handle lhs, thread_handle rhs);
 static inline void thread_delete(thread_handle h);
+static inline void thread_set_policy(thread_handle h, const thread_policy *p);
 static inline thread_handle create_base_thread(threadpool_handle h_pool, const char *name, void *(*fxn)(void *),int priority, void *param);
 
 #define FIFO_GET(hfifo,p,magic) do {\
@@ -397,7 +476,7 @@ static inline thread_handle create_base_thread(threadpool_handle h_pool, const c
         case SUCCESS: \
             DASSERT(CHECK_MAGIC(magic,p), \
                 ({ERR("invalid fifo element, expect %08x(%s), given %08x\n", \
-                    magic,#magic,((unsigned int*)(p))[0]);\
+                    magic,#magic,*(p) ? READ_MAGIC(*(p)) : 0);\
                   goto error;}));\
             break;\
         case FIFO_EFLUSH: \
@@ -551,6 +630,9 @@ static inline thread_handle create_base_thread(threadpool_handle h_pool, const c
     nh->fxn = fxn;
     nh->priority = priority;
     nh->param_priv = params;
+    nh->policy.sched = SCHED_FIFO;
+    nh->policy.priority = priority;
+    CPU_ZERO(&nh->policy.cpus);
 
     strncpy(nh->name, name,MAX_THREADNAME);
     
@@ -569,10 +651,60 @@ static inline void thread_sync_init(thread_handle h)
     DBG("Entering %s thread main loop\n",h->name);
 }
 
+static inline void thread_set_policy(thread_handle h, const thread_policy *p)
+{
+    h->policy = *p;
+    h->priority = p->priority;
+}
+
+static inline void *__thread_entry(void *v)
+{
+    thread_handle h = v;
+    pid_t tid = syscall(SYS_gettid);
+
+    /* nice is per thread on linux */
+    if(h->sched == SCHED_OTHER && h->policy.nice != 0) {
+        TEST(setpriority(PRIO_PROCESS, tid, h->policy.nice) == 0,
+                ERR("%s: cannot set nice %d:%s\n", h->name, h->policy.nice, strerror(errno)));
+    }
+
+    __atomic_store_n(&h->tid, tid, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &h->tid, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+
+    return h->fxn(h);
+}
+
+static inline int __thread_attr(pthread_attr_t *attr, thread_handle threadp, int sched)
+{
+    struct sched_param  schedParam = {};
+
+    /* Force the thread to use custom scheduling attributes */
+    ASSERT(pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED) == 0,
+           return FAILURE);
+
+    ASSERT(pthread_attr_setschedpolicy(attr, sched) == 0,
+            return FAILURE);
+
+    if(sched != SCHED_OTHER) {
+        schedParam.sched_priority = threadp->policy.priority;
+    }
+    ASSERT(pthread_attr_setschedparam(attr, &schedParam) == 0,
+            return FAILURE);
+
+    if(CPU_COUNT(&threadp->policy.cpus) > 0) {
+        ASSERT(pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &threadp->policy.cpus) == 0,
+                return FAILURE);
+    }
+
+    threadp->sched = sched;
+
+    return SUCCESS;
+}
+
 static inline int start_thread(thread_handle threadp)
 {
-    struct sched_param  schedParam;
     pthread_attr_t attr;
+    int ret;
 
     DASSERT(threadp->fxn,return FAILURE);
     DASSERT(threadp->sharedp,return FAILURE);
@@ -580,24 +712,34 @@ static inline int start_thread(thread_handle threadp)
     /* Initialize the thread attributes */
     ASSERT(pthread_attr_init(&attr) == 0, return FAILURE);
 
-    /* Force the thread to use custom scheduling attributes */
-    ASSERT(pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED) == 0,
-           return FAILURE);
+    ASSERT(__thread_attr(&attr, threadp, threadp->policy.sched) == SUCCESS, goto error);
 
-    /* Set the thread to be fifo real time scheduled */
-    ASSERT(pthread_attr_setschedpolicy(&attr, SCHED_FIFO) == 0,
-            return FAILURE);
+    ret = pthread_create(&threadp->pthread, &attr, __thread_entry, threadp);
 
-    schedParam.sched_priority = threadp->priority;
-    ASSERT(pthread_attr_setschedparam(&attr, &schedParam) == 0,
-            return FAILURE);
+    /* real time scheduling needs CAP_SYS_NICE (or RLIMIT_RTPRIO) */
+    if(ret == EPERM && threadp->policy.sched != SCHED_OTHER) {
+        ERR("%s: no permission for real time scheduling. falls back to SCHED_OTHER\n", threadp->name);
+        ASSERT(__thread_attr(&attr, threadp, SCHED_OTHER) == SUCCESS, goto error);
+        ret = pthread_create(&threadp->pthread, &attr, __thread_entry, threadp);
+    }
 
-    ASSERT(pthread_create(&threadp->pthread, &attr, threadp->fxn, threadp) == 0,
-            return FAILURE);
+    ASSERT(ret == 0, ({
+            ERR("%s: pthread_create:%s\n", threadp->name, strerror(ret));
+            goto error;}));
+
+    pthread_attr_destroy(&attr);
 
     threadp->started = TRUE;
 
+    /* so that the thread id is known once started */
+    while(__atomic_load_n(&threadp->tid, __ATOMIC_ACQUIRE) == 0) {
+        syscall(SYS_futex, &threadp->tid, FUTEX_WAIT_PRIVATE, 0, NULL, NULL, 0);
+    }
+
     return SUCCESS;
+error:
+    pthread_attr_destroy(&attr);
+    return FAILURE;
 }
 
 #define __THREAD_CHECK_JOB(h,v1,v2,v3,v4) do {\